@@ -9,6 +9,12 @@
 #include <assert.h>
 #include <sys/stat.h>
 
+#if _WIN32
+	#include <intrin.h>
+#else
+	#include <x86intrin.h>
+#endif
+
 typedef uint8_t  U8;
 typedef uint16_t U16;
 typedef uint32_t U32;
@@ -133,6 +139,7 @@ typedef struct {
 #define buf_len(b)  ((b) ? (int)buf__header(b)->len : 0)
 #define buf_lenu(b) ((b) ?      buf__header(b)->len : 0)
 #define buf_set_len(b, l) buf__header(b)->len = (l)
+#define buf_clear(b) ((b) ? buf__header(b)->len = 0 : 0)
 #define buf_cap(b) ((b) ? buf__header(b)->cap : 0)
 #define buf_end(b) ((b) + buf_lenu(b))
 #define buf_push(b, ...) (buf__fit(b, 1), (b)[buf__header(b)->len++] = (__VA_ARGS__))
@@ -241,19 +248,305 @@ U64 estimate_cpu_freq(void) {
 	return cpu_freq;
 }
 
+// NOTE(shaw): profile state is per thread. A thread gets its own blocks and
+// block stack the first time it enters a profile block, so threads never touch
+// each other's, and end_profile merges them. A thread that exits gives its
+// profile back with profile_thread_release and the next new thread carries on
+// in it, so pools created over and over don't pile up profiles, and "thread n"
+// in the report is a slot rather than one os thread. Summed over the threads
+// the ticks are CPU time, as long as every thread had a core to itself. Each
+// thread also keeps when it first began and last ended a block, and the span
+// from the earliest begin to the latest end on any thread is the block's wall
+// time, which shows how parallel it ran. Phases of a block with gaps between
+// them count the gaps too.
+#define PROFILE_MAX_BLOCKS  4096
+
+#if _WIN32
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+// NOTE(shaw): every call of a block also lands in its latency histogram, HDR
+// style: ticks below 8 get a bucket each, and every power of two above that is
+// split into 8 buckets, so a bucket is never wider than an eighth of the ticks
+// in it and percentiles read from it are good to 12.5%. Calls past 2^48 ticks,
+// over half a day at any clock rate, share the last bucket. The buckets are
+// U32, about 1.5kb a block, and a thread's are allocated and touched with its
+// profile for just the blocks its translation unit has, profile_block_count,
+// so recording a call never allocates or faults. A bucket wraps past 4 billion
+// calls, which would take a block hours even at its cheapest. A call lands
+// with the ticks it was timed at, and only as the percentiles are printed does
+// the overhead every call carries, profile_overhead_inside, come off them. The
+// blocks inside a call aren't taken off since their count varies from call to
+// call, and taken off each call the overhead would push small calls to 0.
+#define PROFILE_LATENCY_SUB_BITS 3
+#define PROFILE_LATENCY_MAX_BITS 48
+#define PROFILE_LATENCY_BUCKETS  ((PROFILE_LATENCY_MAX_BITS - PROFILE_LATENCY_SUB_BITS + 1) << PROFILE_LATENCY_SUB_BITS)
+
 typedef struct {
 	char *name;
 	U64 count;
 	U64 ticks_exclusive; // without children
 	U64 ticks_inclusive; // with children
 	U64 processed_byte_count;
+	U64 counters[OS_PERF_COUNTER_COUNT]; // with children, when profile_count_hardware
+	U64 ticks_max; // of one call, as timed
+	U64 first_begin; // timer at the begin of the first call
+	U64 last_end;    // and at the end of the last, less its overhead
+	U32 *latency_buckets; // PROFILE_LATENCY_BUCKETS of them, NULL past profile_block_count
 } ProfileBlock;
 
-ProfileBlock profile_blocks[4096];
-U64 profile_start; 
-U64 current_profile_block_index;
+// NOTE(shaw): with profile_record_events every block also logs its begin and
+// end into its thread's ring of events, allocated up front so recording is
+// two stores and an increment. A thread that logs more than the ring holds
+// loses its oldest events. end_profile replays the rings into a Chrome trace
+// (chrome://tracing, ui.perfetto.dev) and folded stacks (flamegraph.pl).
+typedef struct {
+	U64 time;
+	U32 block_index;
+	U32 end; // 0 for the begin of the block
+} ProfileEvent;
+
+typedef struct ProfileThread ProfileThread;
+struct ProfileThread {
+	ProfileBlock blocks[PROFILE_MAX_BLOCKS];
+	U64 current_block_index;
+	U32 index; // in the order threads first profiled something
+	ProfileEvent *events; // ring, NULL when not recording
+	U64 event_mask;
+	U64 event_count;
+	OS_PerfCounters counters; // NULL handle when not counting
+	U64 blocks_begun;
+	U64 overhead_ticks; // taken off its outermost blocks, see profile_subtract_overhead
+	bool extras; // events or counters on, see profile_extras_begin
+	volatile U64 in_use; // by a running thread
+	ProfileThread *next;
+};
+
+volatile U64 profile_thread_list; // ProfileThread *, newest first
+volatile U64 profile_thread_count;
+THREAD_LOCAL ProfileThread *profile_thread;
+U64 profile_start;
+char *profile_events_path;
+U64 profile_events_per_thread;
+bool profile_counting;
+U64 profile_overhead_inside; // least of a block's own timer reads and bookkeeping that lands between them
+U64 profile_overhead_block;  // least of a whole block, empty, as its parent sees it
+
+static void profile_calibrate(void);
+
+#ifdef PROFILE
+extern U32 profile_block_count; // defined by PROFILE_TRANSLATION_UNIT_END
+
+static void profile_alloc_latency(ProfileThread *thread) {
+	U64 size = profile_block_count * PROFILE_LATENCY_BUCKETS * sizeof(U32);
+	U32 *buckets = xmalloc(size);
+	memset(buckets, 0, size);
+	for (U32 i=0; i < profile_block_count; ++i) {
+		thread->blocks[i].latency_buckets = buckets + i * PROFILE_LATENCY_BUCKETS;
+	}
+}
+#endif
 
+static void profile_alloc_events(ProfileThread *thread) {
+	// touched now so its page faults don't land in the blocks being recorded
+	thread->events = xmalloc(profile_events_per_thread * sizeof(ProfileEvent));
+	memset(thread->events, 0, profile_events_per_thread * sizeof(ProfileEvent));
+	thread->event_mask = profile_events_per_thread - 1;
+	thread->event_count = 0;
+	thread->extras = true;
+}
+
+static ProfileThread *profile_thread_first(void) {
+	return (ProfileThread *)os_atomic_load_u64(&profile_thread_list);
+}
+
+static ProfileThread *profile_thread_get(void) {
+	if (!profile_thread) {
+		// a profile a finished thread gave back, or else a new one
+		ProfileThread *thread = profile_thread_first();
+		while (thread && !os_atomic_compare_exchange_u64(&thread->in_use, 0, 1)) {
+			thread = thread->next;
+		}
+		if (!thread) {
+			thread = xcalloc(1, sizeof(ProfileThread));
+			thread->in_use = 1;
+			thread->index = (U32)os_atomic_add_u64(&profile_thread_count, 1);
 #ifdef PROFILE
+			profile_alloc_latency(thread);
+#endif
+			if (profile_events_per_thread) {
+				profile_alloc_events(thread);
+			}
+			for (;;) {
+				U64 first = os_atomic_load_u64(&profile_thread_list);
+				thread->next = (ProfileThread *)first;
+				if (os_atomic_compare_exchange_u64(&profile_thread_list, first, (U64)thread)) break;
+			}
+		}
+		if (profile_counting) {
+			char error[256];
+			os_perf_counters_open(&thread->counters, error, sizeof(error));
+		}
+		thread->extras = thread->events || thread->counters.handle;
+		profile_thread = thread;
+	}
+	return profile_thread;
+}
+
+// call on a thread that may have profiled something just before it exits,
+// outside of any block
+void profile_thread_release(void) {
+	ProfileThread *thread = profile_thread;
+	if (thread) {
+		assert(thread->current_block_index == 0);
+		os_perf_counters_close(&thread->counters);
+		thread->extras = thread->events != NULL;
+		profile_thread = NULL;
+		os_atomic_store_u64(&thread->in_use, 0);
+	}
+}
+
+// the most ticks a call in the bucket can have taken
+static U64 profile_latency_bucket_max(U64 bucket) {
+	U64 sub_buckets = 1 << PROFILE_LATENCY_SUB_BITS;
+	if (bucket < sub_buckets) return bucket;
+	U64 shift = bucket / sub_buckets - 1;
+	U64 sub_bucket = bucket % sub_buckets;
+	return ((sub_buckets + sub_bucket + 1) << shift) - 1;
+}
+
+// within the bucket the percentile falls in, and never past the slowest call
+static U64 profile_latency_percentile(ProfileBlock *block, F64 percentile) {
+	F64 rank = percentile / 100.0 * block->count;
+	U64 below = 0;
+	for (U64 bucket=0; bucket < PROFILE_LATENCY_BUCKETS; ++bucket) {
+		below += block->latency_buckets[bucket];
+		if (below >= rank && block->latency_buckets[bucket]) {
+			return MIN(profile_latency_bucket_max(bucket), block->ticks_max);
+		}
+	}
+	return block->ticks_max;
+}
+
+// call before any thread but the calling one has profiled anything, end_profile
+// writes path.json and path.folded, events_per_thread is rounded up to a
+// power of two
+void profile_record_events(char *path, U64 events_per_thread) {
+	U64 capacity = 1;
+	while (capacity < events_per_thread) capacity *= 2;
+	profile_events_path = path;
+	profile_events_per_thread = capacity;
+	for (ProfileThread *thread = profile_thread_first(); thread; thread = thread->next) {
+		profile_alloc_events(thread);
+	}
+	profile_calibrate();
+}
+
+// call before any thread but the calling one has profiled anything, returns
+// false and leaves the profile as it was when the counters can't be opened
+bool profile_count_hardware(void) {
+	char error[256];
+	for (ProfileThread *thread = profile_thread_first(); thread; thread = thread->next) {
+		if (thread->in_use && !os_perf_counters_open(&thread->counters, error, sizeof(error))) {
+			printf("Hardware counters unavailable, %s\n", error);
+			return false;
+		}
+		thread->extras = thread->events || thread->counters.handle;
+	}
+	profile_counting = true;
+	profile_calibrate();
+	return true;
+}
+
+#ifdef PROFILE
+
+// NOTE(shaw): with profile_count_hardware every thread also opens the
+// hardware counters of os_perf_counters_open and every block reads them as it
+// begins and ends, just outside its timer reads, so end_profile can report
+// IPC and misses for it. The reads stay in user mode (see os_linux.c) but
+// still cost more than the timer, so the ticks of small blocks grow with them.
+typedef struct {
+	U64 start[OS_PERF_COUNTER_COUNT];
+	U64 top_level_sum[OS_PERF_COUNTER_COUNT];
+} ProfileCounterSpan;
+
+static void profile_counters_begin(ProfileThread *thread, ProfileBlock *block, ProfileCounterSpan *span) {
+	memcpy(span->top_level_sum, block->counters, sizeof(span->top_level_sum));
+	os_perf_counters_read(thread->counters, span->start);
+}
+
+static void profile_counters_end(ProfileThread *thread, ProfileBlock *block, ProfileCounterSpan *span) {
+	U64 end[OS_PERF_COUNTER_COUNT];
+	os_perf_counters_read(thread->counters, end);
+	for (int i=0; i < OS_PERF_COUNTER_COUNT; ++i) {
+		block->counters[i] = span->top_level_sum[i] + (end[i] - span->start[i]);
+	}
+}
+
+static void profile_record_event(ProfileThread *thread, U64 block_index, U64 time, U32 end) {
+	ProfileEvent *event = &thread->events[thread->event_count++ & thread->event_mask];
+	event->time = time;
+	event->block_index = (U32)block_index;
+	event->end = end;
+}
+
+static U32 profile_highest_bit(U64 value) {
+#if _WIN32
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+static U64 profile_latency_bucket(U64 ticks) {
+	U64 sub_buckets = 1 << PROFILE_LATENCY_SUB_BITS;
+	if (ticks < sub_buckets) return ticks;
+	ticks = MIN(ticks, (1ull << PROFILE_LATENCY_MAX_BITS) - 1);
+	U32 shift = profile_highest_bit(ticks) - PROFILE_LATENCY_SUB_BITS;
+	return (shift + 1) * sub_buckets + ((ticks >> shift) & (sub_buckets - 1));
+}
+
+static void profile_record_latency(ProfileBlock *block, U64 ticks) {
+	++block->latency_buckets[profile_latency_bucket(ticks)];
+	block->ticks_max = MAX(block->ticks_max, ticks);
+}
+
+// NOTE(shaw): the parts of a block that are off unless asked for sit behind
+// the one extras branch, so with neither on a block pays for its timer reads,
+// its bookkeeping and a single predictable branch each side. The counters are
+// read just outside the timer reads, the events are logged just inside them.
+static U64 profile_extras_begin(ProfileThread *thread, ProfileBlock *block, U64 block_index, ProfileCounterSpan *span) {
+	if (thread->counters.handle) profile_counters_begin(thread, block, span);
+	U64 start = read_cpu_timer();
+	if (thread->events) profile_record_event(thread, block_index, start, 0);
+	return start;
+}
+
+static U64 profile_extras_end(ProfileThread *thread, ProfileBlock *block, U64 block_index, ProfileCounterSpan *span) {
+	U64 end = read_cpu_timer();
+	if (thread->counters.handle) profile_counters_end(thread, block, span);
+	if (thread->events) profile_record_event(thread, block_index, end, 1);
+	return end;
+}
+
+// NOTE(shaw): a block's ticks include part of its own begin and end, and the
+// whole begin and end of every block inside it. profile_calibrate times empty
+// blocks to learn the least either costs, and each block takes that off its
+// elapsed ticks as it ends, counting the blocks inside it by how many its
+// thread began in the meantime. Taken off there, they come off the inclusive
+// ticks and, through the parent's subtraction, off the exclusive ticks of the
+// parent too. The wall time loses what the last call took off. What the
+// outermost blocks of a thread lose is its overhead_ticks, end_profile reports
+// it as a row of its own. The trace and the folded stacks stay as they were
+// timed.
+static U64 profile_subtract_overhead(U64 elapsed, U64 blocks_inside) {
+	U64 overhead = profile_overhead_inside + blocks_inside * profile_overhead_block;
+	return elapsed > overhead ? elapsed - overhead : 0;
+}
 
 // NOTE(shaw): This macro is not guarded with typical do-while because it relies on 
 // variables declared inside it being accessible in the associated PROFILE_BLOCK_END.
@@ -263,45 +556,321 @@ U64 current_profile_block_index;
 #define PROFILE_BLOCK_BEGIN(block_name) \
 	char *__block_name = block_name; \
 	U64 __block_index = __COUNTER__ + 1; \
-	ProfileBlock *__block = &profile_blocks[__block_index]; \
+	ProfileThread *__profile_thread = profile_thread_get(); \
+	ProfileBlock *__block = &__profile_thread->blocks[__block_index]; \
 	U64 __top_level_sum = __block->ticks_inclusive; \
-	U64 __parent_index = current_profile_block_index; \
-	current_profile_block_index = __block_index; \
-	U64 __block_start = read_cpu_timer(); \
+	U64 __parent_index = __profile_thread->current_block_index; \
+	__profile_thread->current_block_index = __block_index; \
+	U64 __blocks_before = __profile_thread->blocks_begun++; \
+	ProfileCounterSpan __counter_span; \
+	U64 __block_start = __profile_thread->extras ? \
+		profile_extras_begin(__profile_thread, __block, __block_index, &__counter_span) : read_cpu_timer(); \
 
 #define PROFILE_BLOCK_END_THROUGHPUT(byte_count) do { \
-	U64 elapsed = read_cpu_timer() - __block_start; \
+	U64 __block_end = __profile_thread->extras ? \
+		profile_extras_end(__profile_thread, __block, __block_index, &__counter_span) : read_cpu_timer(); \
+	U64 __block_ticks = __block_end - __block_start; \
+	U64 elapsed = profile_subtract_overhead(__block_ticks, __profile_thread->blocks_begun - __blocks_before - 1); \
 	__block->name = __block_name; \
+	if (!__block->count) __block->first_begin = __block_start; \
+	__block->last_end = __block_end - (__block_ticks - elapsed); \
 	++__block->count; \
 	__block->ticks_inclusive = __top_level_sum + elapsed; \
 	__block->ticks_exclusive += elapsed; \
 	__block->processed_byte_count += byte_count; \
-	profile_blocks[__parent_index].ticks_exclusive -= elapsed; \
-	current_profile_block_index = __parent_index; \
+	profile_record_latency(__block, __block_ticks); \
+	__profile_thread->blocks[__parent_index].ticks_exclusive -= elapsed; \
+	__profile_thread->overhead_ticks += __parent_index ? 0 : __block_ticks - elapsed; \
+	__profile_thread->current_block_index = __parent_index; \
 } while(0)
 
 #define PROFILE_BLOCK_END      PROFILE_BLOCK_END_THROUGHPUT(0)
 #define PROFILE_FUNCTION_BEGIN PROFILE_BLOCK_BEGIN(__func__)
 #define PROFILE_FUNCTION_END   PROFILE_BLOCK_END
 
-#define PROFILE_TRANSLATION_UNIT_END static_assert(ARRAY_COUNT(profile_blocks) > __COUNTER__, "Too many profile blocks")
+#define PROFILE_TRANSLATION_UNIT_END \
+	static_assert(PROFILE_MAX_BLOCKS > __COUNTER__ + 1, "Too many profile blocks"); \
+	U32 profile_block_count = __COUNTER__ // one past the last block's index
+
+// times empty blocks on the calling thread one at a time, then puts its
+// profile back the way it was. Anything that changes what a block costs calls
+// it again.
+static void profile_calibrate(void) {
+	enum { samples = 16384 };
+	profile_overhead_inside = 0;
+	profile_overhead_block = 0;
+
+	ProfileThread *thread = profile_thread_get();
+	ProfileBlock root = thread->blocks[0];
+	U64 blocks_begun = thread->blocks_begun;
+	U64 overhead_ticks = thread->overhead_ticks;
+	U64 event_count = thread->event_count;
+	U64 block_index = 0;
+
+	// NOTE(shaw): the fastest of each, slower ones were interrupted or waited on
+	// a cache. A block in real code can overlap its timer reads with the work
+	// around it and cost less than the average empty one, so only the least a
+	// block was ever seen to cost comes off, never more than it added.
+	U64 min_timer = ~0ull; // two timer reads back to back
+	U64 min_block = ~0ull;
+	U64 min_inside = ~0ull;
+	U64 inside_total = 0;
+	for (int i=0; i < samples; ++i) {
+		U64 start = read_cpu_timer();
+		min_timer = MIN(min_timer, read_cpu_timer() - start);
+	}
+	for (int i=0; i < samples; ++i) {
+		U64 start = read_cpu_timer();
+		PROFILE_BLOCK_BEGIN("profiler calibration");
+		block_index = __block_index;
+		PROFILE_BLOCK_END;
+		U64 ticks = read_cpu_timer() - start;
+		U64 inside = thread->blocks[block_index].ticks_inclusive - inside_total;
+		inside_total += inside;
+		min_block = MIN(min_block, ticks);
+		min_inside = MIN(min_inside, inside);
+	}
+
+	U32 *latency_buckets = thread->blocks[block_index].latency_buckets;
+	memset(latency_buckets, 0, PROFILE_LATENCY_BUCKETS * sizeof(U32));
+	memset(&thread->blocks[block_index], 0, sizeof(ProfileBlock));
+	thread->blocks[block_index].latency_buckets = latency_buckets;
+	thread->blocks[0] = root;
+	thread->blocks_begun = blocks_begun;
+	thread->overhead_ticks = overhead_ticks;
+	thread->event_count = event_count;
+	profile_overhead_block = min_block > min_timer ? min_block - min_timer : 0;
+	profile_overhead_inside = MIN(min_inside, profile_overhead_block);
+}
 
 #else 
 
 #define PROFILE_BLOCK_BEGIN(...)
+#define PROFILE_BLOCK_END_THROUGHPUT(...)
 #define PROFILE_BLOCK_END
 #define PROFILE_FUNCTION_BEGIN
 #define PROFILE_FUNCTION_END
 #define PROFILE_TRANSLATION_UNIT_END
 
+static void profile_calibrate(void) {}
+
 #endif // PROFILE
 
 void begin_profile(void) {
+	profile_thread_get(); // the calling thread is thread 0
+	profile_calibrate();
 	profile_start = read_cpu_timer();
 }
 
+// in whichever unit keeps it readable, calls run from nanoseconds to seconds
+static void print_profile_latency(char *label, U64 ticks, U64 cpu_freq) {
+	F64 seconds = ticks / (F64)cpu_freq;
+	if (seconds < 1e-6) {
+		printf(" %s %.0f ns", label, seconds * 1e9);
+	} else if (seconds < 1e-3) {
+		printf(" %s %.3f us", label, seconds * 1e6);
+	} else if (seconds < 1) {
+		printf(" %s %.3f ms", label, seconds * 1e3);
+	} else {
+		printf(" %s %.3f s", label, seconds);
+	}
+}
+
+// wall_ticks is 0 for a single thread's blocks, whose ticks are wall time already
+static void print_profile_block(ProfileBlock *block, U64 wall_ticks, U64 total_ticks, U64 cpu_freq) {
+	// the overhead taken off the children can leave a parent with next to
+	// nothing, and timer noise can take it below that
+	U64 ticks_exclusive = (S64)block->ticks_exclusive < 0 ? 0 : block->ticks_exclusive;
+
+	F64 pct_exclusive = 100 * (ticks_exclusive / (F64)total_ticks);
+	printf("\t%s[%llu]: %llu (%.2f%%", block->name, block->count, ticks_exclusive, pct_exclusive);
+
+	if (ticks_exclusive != block->ticks_inclusive) {
+		F64 pct_inclusive = 100 * (block->ticks_inclusive / (F64)total_ticks);
+		printf(", %.2f%% w/children", pct_inclusive);
+	} 
+
+	printf(")");
+
+	// throughput over the time the block took start to end, not the sum of
+	// every thread's part of it
+	U64 throughput_ticks = wall_ticks ? wall_ticks : MAX(block->ticks_inclusive, 1);
+	if (block->processed_byte_count) {
+		F64 megabytes = block->processed_byte_count / (F64)(1024*1024);
+		F64 gigabytes_per_second = (megabytes / 1024) / (throughput_ticks / (F64)cpu_freq);
+		printf(" %.3fmb at %.2fgb/s", megabytes, gigabytes_per_second);
+	}
+
+	if (wall_ticks) {
+		F64 wall_ms = 1000 * (wall_ticks / (F64)cpu_freq);
+		F64 cpu_ms = 1000 * (block->ticks_inclusive / (F64)cpu_freq);
+		printf(" wall %.3f ms cpu %.3f ms (%.2fx)", wall_ms, cpu_ms, cpu_ms / wall_ms);
+	}
+
+	printf("\n");
+
+	if (block->count > 1) {
+		U64 overhead = profile_overhead_inside;
+		U64 p50 = profile_latency_percentile(block, 50);
+		U64 p99 = profile_latency_percentile(block, 99);
+		printf("\t\tper call");
+		print_profile_latency("p50", p50 > overhead ? p50 - overhead : 0, cpu_freq);
+		print_profile_latency("p99", p99 > overhead ? p99 - overhead : 0, cpu_freq);
+		print_profile_latency("max", block->ticks_max > overhead ? block->ticks_max - overhead : 0, cpu_freq);
+		printf("\n");
+	}
+
+	U64 *counters = block->counters;
+	if (profile_counting && counters[OS_PERF_CYCLES]) {
+		F64 kilo_instructions = MAX(counters[OS_PERF_INSTRUCTIONS], 1) / 1000.0;
+		printf("\t\t%.2f ipc, misses per 1k instructions: %.3f llc %.3f branch %.3f dtlb",
+			counters[OS_PERF_INSTRUCTIONS] / (F64)counters[OS_PERF_CYCLES],
+			counters[OS_PERF_LLC_MISSES] / kilo_instructions,
+			counters[OS_PERF_BRANCH_MISSES] / kilo_instructions,
+			counters[OS_PERF_DTLB_MISSES] / kilo_instructions);
+		if (block->processed_byte_count) {
+			F64 kilobytes = block->processed_byte_count / 1024.0;
+			printf(", per kb: %.3f llc %.3f branch %.3f dtlb",
+				counters[OS_PERF_LLC_MISSES] / kilobytes,
+				counters[OS_PERF_BRANCH_MISSES] / kilobytes,
+				counters[OS_PERF_DTLB_MISSES] / kilobytes);
+		}
+		printf("\n");
+	}
+}
+
+// NOTE(shaw): past a few percent the calibration is only a rough guess at what
+// the profiler did to the caches and the pipeline of the code it timed, so the
+// blocks above it are rough too
+static void print_profile_overhead(U64 blocks_begun, U64 overhead_ticks, U64 total_ticks) {
+	if (!blocks_begun) return;
+	F64 pct_overhead = 100 * (overhead_ticks / (F64)total_ticks);
+	printf("\tprofiler overhead[%llu]: %llu (%.2f%%) taken off the blocks above, at least %llu ticks a block, %llu inside it%s\n",
+		blocks_begun, overhead_ticks, pct_overhead, profile_overhead_block, profile_overhead_inside,
+		pct_overhead > 10 ? ", too much to trust them" : "");
+}
+
+// the name of a block as any thread recorded it
+static char *profile_block_name(U64 block_index) {
+	for (ProfileThread *thread = profile_thread_first(); thread; thread = thread->next) {
+		char *name = thread->blocks[block_index].name;
+		if (name) return name;
+	}
+	return "unfinished block";
+}
+
+static FILE *profile_open_events_file(char *extension) {
+	char filepath[1024];
+	snprintf(filepath, sizeof(filepath), "%s%s", profile_events_path, extension);
+	FILE *file = fopen(filepath, "w");
+	if (!file) {
+		fatal("failed to open %s for writing", filepath);
+	}
+	printf("Wrote %s\n", filepath);
+	return file;
+}
+
+// the events of a thread that are still in its ring are first..end
+static U64 profile_first_event(ProfileThread *thread) {
+	U64 capacity = thread->event_mask + 1;
+	return thread->event_count > capacity ? thread->event_count - capacity : 0;
+}
+
+// ends whose begin was overwritten are skipped and blocks still open are
+// closed at end_time, so every begin has its end
+static void profile_write_chrome_trace(ProfileThread **threads, U32 thread_count, U64 end_time, U64 cpu_freq) {
+	FILE *file = profile_open_events_file(".json");
+	F64 us_per_tick = 1e6 / cpu_freq;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	char *separator = "\n";
+	for (U32 t=0; t < thread_count; ++t) {
+		ProfileThread *thread = threads[t];
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", separator, t, t);
+		separator = ",\n";
+		U64 depth = 0;
+		for (U64 i=profile_first_event(thread); i < thread->event_count; ++i) {
+			ProfileEvent event = thread->events[i & thread->event_mask];
+			if (event.end && !depth) continue;
+			depth += event.end ? -1 : 1;
+			F64 ts = (S64)(event.time - profile_start) * us_per_tick;
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+				profile_block_name(event.block_index), event.end ? 'E' : 'B', ts, t);
+		}
+		for (; depth; --depth) {
+			fprintf(file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", (S64)(end_time - profile_start) * us_per_tick, t);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
+
+// a call stack as a path through a tree of blocks, node 0 is the thread
+typedef struct {
+	U32 parent;
+	U32 block_index;
+	U32 first_child;
+	U32 next_sibling;
+	U64 ticks; // while this stack was the one running
+} ProfileStackNode;
+
+static void profile_write_stack(FILE *file, ProfileStackNode *nodes, U32 node, U32 thread_index) {
+	if (node == 0) {
+		fprintf(file, "thread %u", thread_index);
+		return;
+	}
+	profile_write_stack(file, nodes, nodes[node].parent, thread_index);
+	fprintf(file, ";%s", profile_block_name(nodes[node].block_index));
+}
+
+// one line per stack with the ticks spent in it and not in a child
+static void profile_write_folded_stacks(ProfileThread **threads, U32 thread_count, U64 end_time) {
+	FILE *file = profile_open_events_file(".folded");
+	for (U32 t=0; t < thread_count; ++t) {
+		ProfileThread *thread = threads[t];
+		BUF(ProfileStackNode *nodes) = NULL;
+		buf_push(nodes, (ProfileStackNode){0});
+		U32 current = 0;
+		U64 first = profile_first_event(thread);
+		U64 last_time = first < thread->event_count ? thread->events[first & thread->event_mask].time : end_time;
+		for (U64 i=first; i < thread->event_count; ++i) {
+			ProfileEvent event = thread->events[i & thread->event_mask];
+			nodes[current].ticks += event.time - last_time;
+			last_time = event.time;
+			if (event.end) {
+				current = nodes[current].parent;
+				continue;
+			}
+			U32 child = nodes[current].first_child;
+			while (child && nodes[child].block_index != event.block_index) {
+				child = nodes[child].next_sibling;
+			}
+			if (!child) {
+				child = buf_len(nodes);
+				buf_push(nodes, (ProfileStackNode){ current, event.block_index, 0, nodes[current].first_child, 0 });
+				nodes[current].first_child = child;
+			}
+			current = child;
+		}
+		nodes[current].ticks += end_time - last_time;
+
+		// time outside of every block isn't written, like in the table
+		for (U32 node=1; node < buf_lenu(nodes); ++node) {
+			if (!nodes[node].ticks) continue;
+			profile_write_stack(file, nodes, node, t);
+			fprintf(file, " %llu\n", nodes[node].ticks);
+		}
+		U64 lost = first;
+		if (lost) {
+			printf("Thread %u logged %llu events, the oldest %llu were overwritten\n", t, thread->event_count, lost);
+		}
+		buf_free(nodes);
+	}
+	fclose(file);
+}
+
 void end_profile(void) {
-	U64 total_ticks = read_cpu_timer() - profile_start;
+	U64 end_time = read_cpu_timer();
+	U64 total_ticks = end_time - profile_start;
 	assert(total_ticks);
 	U64 cpu_freq = estimate_cpu_freq();
 	assert(cpu_freq);
@@ -309,28 +878,80 @@ void end_profile(void) {
 
 	printf("\nTotal time: %f ms %llu ticks (cpu freq %llu)\n", total_ms, total_ticks, cpu_freq);
 
-	for (int i=0; i<ARRAY_COUNT(profile_blocks); ++i) {
-		ProfileBlock block = profile_blocks[i];
-		if (!block.ticks_inclusive) continue;
-
-		F64 pct_exclusive = 100 * (block.ticks_exclusive / (F64)total_ticks);
-		printf("\t%s[%llu]: %llu (%.2f%%", block.name, block.count, block.ticks_exclusive, pct_exclusive);
-
-		if (block.ticks_exclusive != block.ticks_inclusive) {
-			F64 pct_inclusive = 100 * (block.ticks_inclusive / (F64)total_ticks);
-			printf(", %.2f%% w/children", pct_inclusive);
-		} 
-
-		printf(")");
+	// in the order they first profiled something
+	U32 thread_count = (U32)os_atomic_load_u64(&profile_thread_count);
+	ProfileThread **threads = xcalloc(MAX(thread_count, 1), sizeof(ProfileThread *));
+	for (ProfileThread *thread = profile_thread_first(); thread; thread = thread->next) {
+		threads[thread->index] = thread;
+	}
+	if (profile_events_path) {
+		profile_write_chrome_trace(threads, thread_count, end_time, cpu_freq);
+		profile_write_folded_stacks(threads, thread_count, end_time);
+	}
 
-		if (block.processed_byte_count) {
-			F64 megabytes = block.processed_byte_count / (F64)(1024*1024);
-			F64 gigabytes_per_second = (megabytes / 1024) / (block.ticks_inclusive / (F64)cpu_freq);
-			printf(" %.3fmb at %.2fgb/s", megabytes, gigabytes_per_second);
+	if (thread_count <= 1) {
+		for (int i=0; thread_count && i < PROFILE_MAX_BLOCKS; ++i) {
+			ProfileBlock *block = &threads[0]->blocks[i];
+			if (!block->count) continue;
+			print_profile_block(block, 0, total_ticks, cpu_freq);
+		}
+		if (thread_count) {
+			print_profile_overhead(threads[0]->blocks_begun, threads[0]->overhead_ticks, total_ticks);
 		}
+		free(threads);
+		return;
+	}
 
-		printf("\n");
+	// NOTE(shaw): percentages are of the wall time of the whole profile, so in
+	// the merged report a block that ran on several threads can pass 100%
+	printf("\nAll %u threads (ticks summed over the threads):\n", thread_count);
+	U32 *merged_buckets = xcalloc(PROFILE_LATENCY_BUCKETS, sizeof(U32));
+	for (int i=0; i < PROFILE_MAX_BLOCKS; ++i) {
+		ProfileBlock merged = {0};
+		merged.first_begin = ~0ull;
+		merged.latency_buckets = merged_buckets;
+		for (U32 t=0; t < thread_count; ++t) {
+			ProfileBlock *block = &threads[t]->blocks[i];
+			if (!block->count) continue;
+			merged.name = block->name;
+			merged.first_begin = MIN(merged.first_begin, block->first_begin);
+			merged.last_end = MAX(merged.last_end, block->last_end);
+			merged.count += block->count;
+			merged.ticks_exclusive += block->ticks_exclusive;
+			merged.ticks_inclusive += block->ticks_inclusive;
+			merged.processed_byte_count += block->processed_byte_count;
+			for (int c=0; c < OS_PERF_COUNTER_COUNT; ++c) {
+				merged.counters[c] += block->counters[c];
+			}
+			for (int b=0; b < PROFILE_LATENCY_BUCKETS; ++b) {
+				merged.latency_buckets[b] += block->latency_buckets[b];
+			}
+			merged.ticks_max = MAX(merged.ticks_max, block->ticks_max);
+		}
+		if (!merged.count) continue;
+		U64 wall_ticks = merged.last_end > merged.first_begin ? merged.last_end - merged.first_begin : 1;
+		print_profile_block(&merged, wall_ticks, total_ticks, cpu_freq);
+		memset(merged_buckets, 0, PROFILE_LATENCY_BUCKETS * sizeof(U32));
 	}
+	free(merged_buckets);
+	U64 blocks_begun = 0;
+	U64 overhead_ticks = 0;
+	for (U32 t=0; t < thread_count; ++t) {
+		blocks_begun += threads[t]->blocks_begun;
+		overhead_ticks += threads[t]->overhead_ticks;
+	}
+	print_profile_overhead(blocks_begun, overhead_ticks, total_ticks);
+
+	for (U32 t=0; t < thread_count; ++t) {
+		printf("\nThread %u:\n", t);
+		for (int i=0; i < PROFILE_MAX_BLOCKS; ++i) {
+			ProfileBlock *block = &threads[t]->blocks[i];
+			if (!block->count) continue;
+			print_profile_block(block, 0, total_ticks, cpu_freq);
+		}
+		print_profile_overhead(threads[t]->blocks_begun, threads[t]->overhead_ticks, total_ticks);
+	}
+	free(threads);
 }
 
 // ---------------------------------------------------------------------------
@@ -352,5 +973,178 @@ void end_profile(void) {
 #define ARRAY_COUNT(a) sizeof(a)/sizeof(*(a))
 
 
+// ---------------------------------------------------------------------------
+// Thread Pool
+// ---------------------------------------------------------------------------
+// Runs the same function on every thread of the pool at once. The calling
+// thread takes part as thread 0, so a pool of one thread never starts any.
+typedef void ThreadPoolFunc(void *params, U32 thread_index, U32 thread_count);
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+	ThreadPool *pool;
+	U32 index;
+	OS_Semaphore start;
+	OS_Thread thread;
+} ThreadPoolWorker;
+
+struct ThreadPool {
+	U32 thread_count;
+	ThreadPoolWorker *workers;
+	OS_Semaphore done;
+	ThreadPoolFunc *func;
+	void *params;
+	bool quit;
+};
+
+static void thread_pool_worker(void *param) {
+	ThreadPoolWorker *worker = param;
+	ThreadPool *pool = worker->pool;
+	for (;;) {
+		os_semaphore_wait(worker->start);
+		if (pool->quit) break;
+		pool->func(pool->params, worker->index, pool->thread_count);
+		os_semaphore_signal(pool->done);
+	}
+	profile_thread_release();
+}
+
+// thread_count 0 means one thread per logical processor
+ThreadPool *thread_pool_create(U32 thread_count) {
+	if (thread_count == 0) {
+		thread_count = os_logical_processor_count();
+	}
+	ThreadPool *pool = xcalloc(1, sizeof(ThreadPool));
+	pool->thread_count = thread_count;
+	pool->workers = xcalloc(thread_count, sizeof(ThreadPoolWorker));
+	pool->done = os_semaphore_create(0);
+	for (U32 i=1; i < thread_count; ++i) {
+		ThreadPoolWorker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		worker->start = os_semaphore_create(0);
+		worker->thread = os_thread_create(thread_pool_worker, worker);
+	}
+	return pool;
+}
+
+void thread_pool_run(ThreadPool *pool, ThreadPoolFunc *func, void *params) {
+	pool->func = func;
+	pool->params = params;
+	for (U32 i=1; i < pool->thread_count; ++i) {
+		os_semaphore_signal(pool->workers[i].start);
+	}
+	func(params, 0, pool->thread_count);
+	for (U32 i=1; i < pool->thread_count; ++i) {
+		os_semaphore_wait(pool->done);
+	}
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+	pool->quit = true;
+	for (U32 i=1; i < pool->thread_count; ++i) {
+		os_semaphore_signal(pool->workers[i].start);
+		os_thread_join(pool->workers[i].thread);
+		os_semaphore_destroy(pool->workers[i].start);
+	}
+	os_semaphore_destroy(pool->done);
+	free(pool->workers);
+	free(pool);
+}
+
+
+// ---------------------------------------------------------------------------
+// Bounded Queue
+// ---------------------------------------------------------------------------
+// Lock-free multi-producer multi-consumer queue of pointers with a fixed
+// power of two capacity, after Dmitry Vyukov's bounded MPMC queue. Every cell
+// carries a sequence number that says whether it is ready to be written
+// (sequence == position) or read (sequence == position + 1), so producers and
+// consumers only ever contend on their own end of the queue.
+typedef struct {
+	volatile U64 sequence;
+	void *value;
+} QueueCell;
 
+typedef struct {
+	QueueCell *cells;
+	U64 mask;
+	U8 pad0[48];
+	volatile U64 push_position;
+	U8 pad1[56];
+	volatile U64 pop_position;
+	U8 pad2[56];
+} BoundedQueue;
+
+BoundedQueue *queue_create(U64 capacity) {
+	assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+	BoundedQueue *queue = xcalloc(1, sizeof(BoundedQueue));
+	queue->cells = xcalloc(capacity, sizeof(QueueCell));
+	queue->mask = capacity - 1;
+	for (U64 i=0; i < capacity; ++i) {
+		queue->cells[i].sequence = i;
+	}
+	return queue;
+}
 
+void queue_destroy(BoundedQueue *queue) {
+	free(queue->cells);
+	free(queue);
+}
+
+// returns false if the queue is full
+bool queue_try_push(BoundedQueue *queue, void *value) {
+	U64 position = os_atomic_load_u64(&queue->push_position);
+	for (;;) {
+		QueueCell *cell = &queue->cells[position & queue->mask];
+		S64 diff = (S64)os_atomic_load_u64(&cell->sequence) - (S64)position;
+		if (diff == 0) {
+			if (os_atomic_compare_exchange_u64(&queue->push_position, position, position + 1)) {
+				cell->value = value;
+				os_atomic_store_u64(&cell->sequence, position + 1);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		}
+		position = os_atomic_load_u64(&queue->push_position);
+	}
+}
+
+// returns false if the queue is empty
+bool queue_try_pop(BoundedQueue *queue, void **value) {
+	U64 position = os_atomic_load_u64(&queue->pop_position);
+	for (;;) {
+		QueueCell *cell = &queue->cells[position & queue->mask];
+		S64 diff = (S64)os_atomic_load_u64(&cell->sequence) - (S64)(position + 1);
+		if (diff == 0) {
+			if (os_atomic_compare_exchange_u64(&queue->pop_position, position, position + 1)) {
+				*value = cell->value;
+				os_atomic_store_u64(&cell->sequence, position + queue->mask + 1);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		}
+		position = os_atomic_load_u64(&queue->pop_position);
+	}
+}
+
+// NOTE(shaw): the blocking versions just give up the rest of the time slice
+// while they wait. The stages feeding each other are expected to be busy, so
+// this is rarely hit for long and keeps things working on machines with fewer
+// cores than threads.
+void queue_push(BoundedQueue *queue, void *value) {
+	while (!queue_try_push(queue, value)) {
+		os_thread_yield();
+	}
+}
+
+void *queue_pop(BoundedQueue *queue) {
+	void *value;
+	while (!queue_try_pop(queue, &value)) {
+		os_thread_yield();
+	}
+	return value;
+}
@@ -2,6 +2,42 @@ void os_metrics_init(void);
 U64 os_timer_freq(void);
 U64 os_read_timer(void);
 U64 os_file_size(char *filepath);
+U64 os_file_mtime(char *filepath); // opaque, only good for comparing against itself
+bool os_map_file(char *filepath, void **data, U64 *size); // read-only view of the whole file
+void os_unmap_file(void *data, U64 size);
 U64 os_process_page_fault_count(void);
 U64 os_max_random_count(void);
 bool os_random_bytes(void *dest, U64 dest_size);
+
+typedef struct { void *handle; } OS_Thread;
+typedef struct { void *handle; } OS_Semaphore;
+typedef void OS_ThreadFunc(void *param);
+
+U32 os_logical_processor_count(void);
+OS_Thread os_thread_create(OS_ThreadFunc *func, void *param);
+void os_thread_join(OS_Thread thread);
+OS_Semaphore os_semaphore_create(U32 initial_count);
+void os_semaphore_destroy(OS_Semaphore semaphore);
+void os_semaphore_wait(OS_Semaphore semaphore);
+void os_semaphore_signal(OS_Semaphore semaphore);
+void os_thread_yield(void);
+U64 os_atomic_add_u64(volatile U64 *dest, U64 value); // returns the previous value
+U64 os_atomic_load_u64(volatile U64 *src);              // acquire
+void os_atomic_store_u64(volatile U64 *dest, U64 value); // release
+bool os_atomic_compare_exchange_u64(volatile U64 *dest, U64 expected, U64 desired);
+
+// hardware performance counters of the calling thread, Linux only for now,
+// open returns false where they can't be had and says why in error
+enum {
+	OS_PERF_INSTRUCTIONS,
+	OS_PERF_CYCLES,
+	OS_PERF_LLC_MISSES,
+	OS_PERF_BRANCH_MISSES,
+	OS_PERF_DTLB_MISSES,
+	OS_PERF_COUNTER_COUNT,
+};
+typedef struct { void *handle; } OS_PerfCounters;
+
+bool os_perf_counters_open(OS_PerfCounters *counters, char *error, U64 error_size);
+void os_perf_counters_read(OS_PerfCounters counters, U64 values[OS_PERF_COUNTER_COUNT]); // running totals
+void os_perf_counters_close(OS_PerfCounters *counters); // and clears the handle
@@ -1,13 +1,28 @@
 #include <x86intrin.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+#define _strdup strdup
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
 
 void os_metrics_init(void) {
-	assert(0 && "Not implemented");
+	// nothing to set up, getrusage works on the calling process
 }
 
 U64 os_process_page_fault_count(void) {
-	assert(0 && "Not implemented");
-	return 0;
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+	return (U64)usage.ru_minflt + (U64)usage.ru_majflt;
 }
 
 U64 os_timer_freq(void) {
@@ -24,7 +39,39 @@ U64 os_read_timer(void) {
 U64 os_file_size(char *filepath) {
 	struct stat filestat;
 	stat(filepath, &filestat);
-	return stat.st_size;
+	return filestat.st_size;
+}
+
+U64 os_file_mtime(char *filepath) {
+	struct stat filestat;
+	if (stat(filepath, &filestat) != 0) {
+		return 0;
+	}
+	return (U64)filestat.st_mtim.tv_sec*1000000000ull + filestat.st_mtim.tv_nsec;
+}
+
+bool os_map_file(char *filepath, void **data, U64 *size) {
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat filestat;
+	if (fstat(fd, &filestat) != 0) {
+		close(fd);
+		return false;
+	}
+	void *view = filestat.st_size > 0 ? mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd); // the mapping keeps its own reference to the file
+	if (view == MAP_FAILED || !view) {
+		return false;
+	}
+	*data = view;
+	*size = filestat.st_size;
+	return true;
+}
+
+void os_unmap_file(void *data, U64 size) {
+	munmap(data, size);
 }
 
 U64 os_max_random_count(void) {
@@ -36,3 +83,183 @@ bool os_random_bytes(void *dest, U64 dest_size) {
 	assert(0 && "not implemented");
 	return false;
 }
+
+U32 os_logical_processor_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (U32)count : 1;
+}
+
+typedef struct {
+	OS_ThreadFunc *func;
+	void *param;
+} OS_ThreadStart;
+
+static void *os_thread_start(void *param) {
+	OS_ThreadStart start = *(OS_ThreadStart *)param;
+	free(param);
+	start.func(start.param);
+	return NULL;
+}
+
+OS_Thread os_thread_create(OS_ThreadFunc *func, void *param) {
+	OS_ThreadStart *start = xmalloc(sizeof(OS_ThreadStart));
+	start->func = func;
+	start->param = param;
+	pthread_t *handle = xmalloc(sizeof(pthread_t));
+	if (pthread_create(handle, NULL, os_thread_start, start) != 0) {
+		fatal("pthread_create failed");
+	}
+	return (OS_Thread){ handle };
+}
+
+void os_thread_join(OS_Thread thread) {
+	pthread_join(*(pthread_t *)thread.handle, NULL);
+	free(thread.handle);
+}
+
+OS_Semaphore os_semaphore_create(U32 initial_count) {
+	sem_t *handle = xmalloc(sizeof(sem_t));
+	if (sem_init(handle, 0, initial_count) != 0) {
+		fatal("sem_init failed");
+	}
+	return (OS_Semaphore){ handle };
+}
+
+void os_semaphore_destroy(OS_Semaphore semaphore) {
+	sem_destroy(semaphore.handle);
+	free(semaphore.handle);
+}
+
+void os_semaphore_wait(OS_Semaphore semaphore) {
+	while (sem_wait(semaphore.handle) != 0 && errno == EINTR) {}
+}
+
+void os_semaphore_signal(OS_Semaphore semaphore) {
+	sem_post(semaphore.handle);
+}
+
+U64 os_atomic_add_u64(volatile U64 *dest, U64 value) {
+	return __atomic_fetch_add(dest, value, __ATOMIC_SEQ_CST);
+}
+
+void os_thread_yield(void) {
+	sched_yield();
+}
+
+U64 os_atomic_load_u64(volatile U64 *src) {
+	return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+}
+
+void os_atomic_store_u64(volatile U64 *dest, U64 value) {
+	__atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+
+bool os_atomic_compare_exchange_u64(volatile U64 *dest, U64 expected, U64 desired) {
+	return __atomic_compare_exchange_n(dest, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+//------------------------------------------------------------------------------
+// Performance counters
+//
+// perf_event_open counts the calling thread, one event per counter, opened as
+// a group so they are always scheduled onto the PMU together. Each is mapped
+// so its count can be read in user mode with rdpmc and the offset the kernel
+// keeps on the mapped page, rather than with a read() system call every time.
+// When the kernel doesn't let a counter be read that way, index is 0 on its
+// page and the read falls back to read().
+//------------------------------------------------------------------------------
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+typedef struct {
+	int fds[OS_PERF_COUNTER_COUNT];
+	struct perf_event_mmap_page *pages[OS_PERF_COUNTER_COUNT];
+} OS_PerfCountersLinux;
+
+static U64 os_perf_counter_read(int fd, struct perf_event_mmap_page *page) {
+	for (;;) {
+		U32 sequence = page->lock;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		U32 index = page->index;
+		S64 count = page->offset;
+		if (!page->cap_user_rdpmc || !index) break;
+		U32 width = page->pmc_width;
+		S64 pmc = (S64)__rdpmc(index - 1);
+		pmc = (S64)((U64)pmc << (64 - width)) >> (64 - width); // sign extend from the counter's width
+		count += pmc;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if (page->lock == sequence) return (U64)count;
+	}
+
+	U64 value = 0;
+	if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+		return 0;
+	}
+	return value;
+}
+
+bool os_perf_counters_open(OS_PerfCounters *counters, char *error, U64 error_size) {
+	static struct { U32 type; U64 config; } events[OS_PERF_COUNTER_COUNT] = {
+		[OS_PERF_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		[OS_PERF_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		[OS_PERF_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		[OS_PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		[OS_PERF_DTLB_MISSES]   = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	};
+
+	OS_PerfCountersLinux *linux_counters = xcalloc(1, sizeof(OS_PerfCountersLinux));
+	int i = 0;
+	for (; i < OS_PERF_COUNTER_COUNT; ++i) {
+		struct perf_event_attr attr = {0};
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int group = i ? linux_counters->fds[0] : -1;
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+		if (fd < 0) {
+			snprintf(error, error_size, "perf_event_open: %s%s", strerror(errno),
+				errno == EACCES || errno == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+			break;
+		}
+		linux_counters->fds[i] = fd;
+		void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+		if (page == MAP_FAILED) {
+			snprintf(error, error_size, "mmap of a perf event: %s", strerror(errno));
+			close(fd);
+			break;
+		}
+		linux_counters->pages[i] = page;
+	}
+
+	if (i < OS_PERF_COUNTER_COUNT) {
+		for (int j=0; j < i; ++j) {
+			munmap(linux_counters->pages[j], sysconf(_SC_PAGESIZE));
+			close(linux_counters->fds[j]);
+		}
+		free(linux_counters);
+		return false;
+	}
+	counters->handle = linux_counters;
+	return true;
+}
+
+void os_perf_counters_read(OS_PerfCounters counters, U64 values[OS_PERF_COUNTER_COUNT]) {
+	OS_PerfCountersLinux *linux_counters = counters.handle;
+	for (int i=0; i < OS_PERF_COUNTER_COUNT; ++i) {
+		values[i] = os_perf_counter_read(linux_counters->fds[i], linux_counters->pages[i]);
+	}
+}
+
+void os_perf_counters_close(OS_PerfCounters *counters) {
+	OS_PerfCountersLinux *linux_counters = counters->handle;
+	if (!linux_counters) return;
+	for (int i=0; i < OS_PERF_COUNTER_COUNT; ++i) {
+		munmap(linux_counters->pages[i], sysconf(_SC_PAGESIZE));
+		close(linux_counters->fds[i]);
+	}
+	free(linux_counters);
+	counters->handle = NULL;
+}
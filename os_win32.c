@@ -2,6 +2,7 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <psapi.h>
+#include <limits.h>
 
 #pragma comment (lib, "bcrypt.lib")
 
@@ -40,6 +41,41 @@ U64 os_file_size(char *filepath) {
 	return stat.st_size;
 }
 
+U64 os_file_mtime(char *filepath) {
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filepath, GetFileExInfoStandard, &data)) {
+		return 0;
+	}
+	return ((U64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+bool os_map_file(char *filepath, void **data, U64 *size) {
+	HANDLE file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+	// the view keeps the mapping and the file alive on its own
+	if (mapping) CloseHandle(mapping);
+	CloseHandle(file);
+	if (!view) {
+		return false;
+	}
+	*data = view;
+	*size = file_size.QuadPart;
+	return true;
+}
+
+void os_unmap_file(void *data, U64 size) {
+	UnmapViewOfFile(data);
+}
+
 U64 os_process_page_fault_count(void) {
 	PROCESS_MEMORY_COUNTERS_EX counters = {0};
 	if (!GetProcessMemoryInfo(global_metrics.process_handle, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
@@ -70,3 +106,96 @@ bool os_random_bytes(void *dest, U64 dest_size) {
 	return true;
 }
 
+U32 os_logical_processor_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+typedef struct {
+	OS_ThreadFunc *func;
+	void *param;
+} OS_ThreadStart;
+
+static DWORD WINAPI os_thread_start(LPVOID param) {
+	OS_ThreadStart start = *(OS_ThreadStart *)param;
+	free(param);
+	start.func(start.param);
+	return 0;
+}
+
+OS_Thread os_thread_create(OS_ThreadFunc *func, void *param) {
+	OS_ThreadStart *start = xmalloc(sizeof(OS_ThreadStart));
+	start->func = func;
+	start->param = param;
+	OS_Thread thread = { CreateThread(0, 0, os_thread_start, start, 0, 0) };
+	if (!thread.handle) {
+		fatal("CreateThread failed");
+	}
+	return thread;
+}
+
+void os_thread_join(OS_Thread thread) {
+	WaitForSingleObject(thread.handle, INFINITE);
+	CloseHandle(thread.handle);
+}
+
+OS_Semaphore os_semaphore_create(U32 initial_count) {
+	OS_Semaphore semaphore = { CreateSemaphoreA(0, initial_count, LONG_MAX, 0) };
+	if (!semaphore.handle) {
+		fatal("CreateSemaphore failed");
+	}
+	return semaphore;
+}
+
+void os_semaphore_destroy(OS_Semaphore semaphore) {
+	CloseHandle(semaphore.handle);
+}
+
+void os_semaphore_wait(OS_Semaphore semaphore) {
+	WaitForSingleObject(semaphore.handle, INFINITE);
+}
+
+void os_semaphore_signal(OS_Semaphore semaphore) {
+	ReleaseSemaphore(semaphore.handle, 1, 0);
+}
+
+U64 os_atomic_add_u64(volatile U64 *dest, U64 value) {
+	return InterlockedExchangeAdd64((volatile LONG64 *)dest, value);
+}
+
+void os_thread_yield(void) {
+	SwitchToThread();
+}
+
+// NOTE(shaw): aligned 64 bit loads and stores are atomic on x64 and already
+// have acquire/release ordering in hardware, the barriers keep the compiler
+// from moving things across them
+U64 os_atomic_load_u64(volatile U64 *src) {
+	U64 value = *src;
+	_ReadWriteBarrier();
+	return value;
+}
+
+void os_atomic_store_u64(volatile U64 *dest, U64 value) {
+	_ReadWriteBarrier();
+	*dest = value;
+}
+
+bool os_atomic_compare_exchange_u64(volatile U64 *dest, U64 expected, U64 desired) {
+	return InterlockedCompareExchange64((volatile LONG64 *)dest, desired, expected) == (LONG64)expected;
+}
+
+// NOTE(shaw): no performance counter backend on windows yet
+bool os_perf_counters_open(OS_PerfCounters *counters, char *error, U64 error_size) {
+	snprintf(error, error_size, "hardware counters are only supported on linux");
+	return false;
+}
+
+void os_perf_counters_read(OS_PerfCounters counters, U64 values[OS_PERF_COUNTER_COUNT]) {
+	memset(values, 0, OS_PERF_COUNTER_COUNT * sizeof(U64));
+}
+
+void os_perf_counters_close(OS_PerfCounters *counters) {
+	counters->handle = NULL;
+}
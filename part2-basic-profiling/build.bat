@@ -3,6 +3,8 @@ if not exist build\ mkdir build
 pushd build
 if "%1"=="generate" (
 	cl /W3 /WX /Zi /nologo "%~dp0generate_points.c"
+) else if "%1"=="bench" (
+	cl /O2 /W3 /WX /Zi /nologo "%~dp0haversine_bench.c"
 ) else (
 	cl /W3 /WX /Zi /nologo "%~dp0haversine.c"
 )
@@ -6,30 +6,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define EARTH_RADIUS_KM 6372.8
-
-typedef double F64;
-
-void *xrealloc(void *ptr, size_t new_size) {
-	void *result = realloc(ptr, new_size);
-	if (!result) {
-		perror("realloc");
-		exit(1);
-	}
-	return result;
-}
+#include "../common.c"
+#include "haversine_pairs.h"
+#include "haversine_generator.c"
+#include "haversine_json_writer.c"
 
-F64 lerp_f64(F64 min, F64 max, F64 t) {
-	return min + t * (max-min);
-}
-
-// returns a random float from min to max, both inclusive
-F64 random_f64(F64 min, F64 max) {
-	assert(max - min <= RAND_MAX);
-	F64 normalized = rand() / (F64)RAND_MAX;
-	return lerp_f64(min, max, normalized);
-}
+#if !_WIN32
+	#define _fseeki64 fseeko
+#endif
 
+#define EARTH_RADIUS_KM 6372.8
 
 /* ========================================================================
    from LISTING 65 - Reference Haversine Distance Formula
@@ -71,174 +57,313 @@ static F64 reference_haversine(F64 x0, F64 y0, F64 x1, F64 y1, F64 earth_radius)
 }
 /* ======================================================================== */
 
-// min is inclusive, max is exclusive
-typedef struct {
-	F64 x_min, x_max, y_min, y_max;
-} Cluster;
+// output files are unbuffered, everything is written to them in large pieces
+FILE *open_output_file(char *filepath, char *mode) {
+	FILE *file = fopen(filepath, mode);
+	if (!file) { perror("fopen"); exit(1); }
+	setvbuf(file, NULL, _IONBF, 0);
+	return file;
+}
 
 typedef struct {
-	Cluster *clusters;
-	int count;
-	int cap;
-} ClusterArray;
-
-Cluster cluster_create(F64 x_min, F64 x_max, F64 y_min, F64 y_max) {
-	return (Cluster){ 
-		.x_min = x_min, .x_max = x_max, 
-		.y_min = y_min, .y_max = y_max
-	};
+	FILE *file;
+	PairsHeader header;
+} BinaryWriter;
+
+void binary_writer_begin(BinaryWriter *writer, char *filepath, U64 num_pairs) {
+	writer->file = open_output_file(filepath, "wb");
+	writer->header = pairs_header(PAIRS_COLUMN_F64, num_pairs);
+	fwrite(&writer->header, sizeof(writer->header), 1, writer->file);
 }
 
-void cluster_append(ClusterArray *clusters, Cluster cluster) {
-	if (clusters->count + 1 >= clusters->cap) {
-		// resize
-		clusters->cap = clusters->cap == 0 ? 2 : 2 * clusters->cap;
-		size_t new_size = clusters->cap * sizeof(Cluster);
-		clusters->clusters = xrealloc(clusters->clusters, new_size);
+// each column of the pairs first..first+count goes to its place in the file
+void binary_writer_write(BinaryWriter *writer, F64 **columns, U64 first, U64 count) {
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		U64 offset = writer->header.column_offsets[column] + first * sizeof(F64);
+		if (_fseeki64(writer->file, offset, SEEK_SET) != 0 ||
+			fwrite(columns[column], sizeof(F64), count, writer->file) != count)
+		{
+			perror("fwrite");
+			exit(1);
+		}
 	}
-	clusters->clusters[clusters->count++] = cluster;
 }
 
-Cluster choose_cluster(ClusterArray clusters) {
-	int i = rand() % clusters.count;
-	return clusters.clusters[i];
+void binary_writer_end(BinaryWriter *writer) {
+	// the gaps after the other columns were skipped over by seeking, only the
+	// last column needs padding written out to its aligned size
+	char padding[PAIRS_ALIGN] = {0};
+	U64 end = writer->header.column_offsets[PAIRS_Y1] + writer->header.num_pairs * sizeof(F64);
+	U64 padding_size = pairs_file_size(writer->header) - end;
+	if (_fseeki64(writer->file, end, SEEK_SET) != 0 || fwrite(padding, 1, padding_size, writer->file) != padding_size) {
+		perror("fwrite");
+		exit(1);
+	}
+	fclose(writer->file);
 }
 
-ClusterArray generate_clusters(void) {
-	ClusterArray result = {0};
-	F64 x = -180, y = -90;
-	enum {
-		max_x_divisions = 12,
-		max_y_divisions = 7,
-	};
-
-	// maximum step in x and y
-	F64 x_step = 60; 
-	F64 y_step = 60;
-
-	// get x divisions
-	F64 x_divisions[max_x_divisions] = {-180};
-	int x_division_count = 1;
-	for (; x_division_count < max_x_divisions-1; ++x_division_count) {
-		x += random_f64(1, x_step);
-		if (x > 180) x = 180;
-		x_divisions[x_division_count] = x;
-		if (x == 180) break;
-	}
-	if (x < 180) {
-		assert(x_division_count < max_x_divisions);
-		x_divisions[x_division_count++] = 180;
-	}
 
-	// get y divisions
-	F64 y_divisions[max_y_divisions] = {-90};
-	int y_division_count = 1;
-	for (; y_division_count < max_y_divisions-1; ++y_division_count) {
-		y += random_f64(1, y_step);
-		if (y > 90) y = 90;
-		y_divisions[y_division_count] = y;
-		if (y == 90) break;
-	}
-	if (y < 90) {
-		assert(y_division_count < max_y_divisions);
-		y_divisions[y_division_count++] = 90;
-	}
+//------------------------------------------------------------------------------
+// Generation
+//
+// The pairs are cut into chunks of GENERATE_CHUNK_PAIRS. The threads of the pool
+// take chunks a wave at a time and format each into the chunk's own buffers:
+// the JSON text, the binary columns and the distances. Once a wave is done the
+// chunks are written out in order with one large write per file and column, so
+// the files come out the same whatever the thread count. The files are
+// unbuffered, so those writes go straight to the OS rather than being copied
+// through stdio's buffer a few KB at a time. The average is summed
+// left to right within a chunk and chunk by chunk after that, so it does too.
+//
+// With more than one shard every shard is its own complete file, cut into
+// chunks from its own first pair, and a manifest lists them (see
+// haversine_pairs.h). A pair only depends on the seed and its index, so the
+// shards hold exactly the pairs one file would have.
+//
+// Styled pairs can take several times the room of plain ones, so their chunks
+// hold fewer pairs to keep the JSON buffers the same size.
+//------------------------------------------------------------------------------
+#define GENERATE_CHUNK_PAIRS        65536
+#define GENERATE_STYLED_CHUNK_PAIRS (GENERATE_CHUNK_PAIRS / 8)
+#define GENERATE_WAVE_CHUNKS        32
+
+typedef struct {
+	U64 first;
+	U64 count;
+	char *json;
+	U64 json_size;
+	F64 *columns[PAIRS_COLUMN_COUNT];
+	F64 *distances;
+	F64 sum;
+} GenerateChunk;
+
+typedef struct {
+	PairGenerator generator;
+	U32 style;
+	U64 chunk_pairs;
+	bool write_json;
+	bool write_binary;
+	U64 shard_first;
+	U64 shard_end;
+	U64 wave_first_chunk;
+	U64 wave_chunk_count;
+	GenerateChunk chunks[GENERATE_WAVE_CHUNKS];
+	volatile U64 next_chunk;
+} GenerateJob;
+
+static void generate_chunk(GenerateJob *job, GenerateChunk *chunk) {
+	chunk->json_size = 0;
+	chunk->sum = 0;
+	for (U64 i=0; i < chunk->count; ++i) {
+		U64 index = chunk->first + i;
+		F64 coords[PAIRS_COLUMN_COUNT];
+		generate_pair(&job->generator, index, &coords[PAIRS_X0], &coords[PAIRS_Y0], &coords[PAIRS_X1], &coords[PAIRS_Y1]);
+		json_style_pair(job->style, job->generator.seed, index, coords);
+
+		F64 reference_result = reference_haversine(coords[PAIRS_X0], coords[PAIRS_Y0], coords[PAIRS_X1], coords[PAIRS_Y1], EARTH_RADIUS_KM);
+		chunk->sum += reference_result;
+		if (chunk->distances) {
+			chunk->distances[i] = reference_result;
+		}
 
-	for (int j = 0; j < y_division_count - 1; ++j) {
-		F64 y_min = y_divisions[j];
-		F64 y_max = y_divisions[j+1];
-		for (int i = 0; i < x_division_count - 1; ++i) {
-			F64 x_min = x_divisions[i];
-			F64 x_max = x_divisions[i+1];
-			cluster_append(&result, cluster_create(x_min, x_max, y_min, y_max));
+		if (job->write_json) {
+			chunk->json_size += write_json_pair(chunk->json + chunk->json_size, job->style, job->generator.seed,
+				index, index == job->shard_first, coords);
+		}
+		if (job->write_binary) {
+			for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+				chunk->columns[column][i] = coords[column];
+			}
 		}
 	}
-
-	return result;
 }
 
-bool cluster_flag_from_mode_string(char *mode) {
-	bool cluster;
-	enum { max_mode_chars = 16 };
-	if (0 == strncmp(mode, "cluster", max_mode_chars)) {
-		cluster = true;
-	} else if (0 == strncmp(mode, "uniform", max_mode_chars)) {
-		cluster = false;
-	} else {
-		printf("Mode argument must be uniform or cluster, got '%s'\n", mode);
-		exit(1);
+static void generate_job_thread(void *params, U32 thread_index, U32 thread_count) {
+	GenerateJob *job = params;
+	for (;;) {
+		U64 i = os_atomic_add_u64(&job->next_chunk, 1);
+		if (i >= job->wave_chunk_count) break;
+		GenerateChunk *chunk = &job->chunks[i];
+		chunk->first = job->shard_first + (job->wave_first_chunk + i) * job->chunk_pairs;
+		chunk->count = MIN(job->chunk_pairs, job->shard_end - chunk->first);
+		generate_chunk(job, chunk);
 	}
-	return cluster;
+}
+
+FILE *begin_manifest(char *filepath, char *format, U64 num_pairs, U64 shard_count) {
+	FILE *manifest = fopen(filepath, "w");
+	if (!manifest) { perror("fopen"); exit(1); }
+	fprintf(manifest, "%s %d\nformat %s\npairs %llu\nshards %llu\n",
+		SHARD_MANIFEST_MAGIC, SHARD_MANIFEST_VERSION, format, num_pairs, shard_count);
+	return manifest;
 }
 
 int main(int argc, char **argv) {
 	if (argc < 4) {
-		printf("Usage: %s [uniform/cluster] [random seed] [number of coordinate pairs to generate]\n", argv[0]);
+		printf("Usage: %s [uniform/cluster] [random seed] [number of coordinate pairs to generate] [json/binary/both/none] [threads] [shards] [style]\n", argv[0]);
+		printf("       none skips writing files, for timing the generator itself\n");
+		printf("       threads defaults to one per logical processor, the output is the same for any count\n");
+		printf("       shards over 1 splits the pairs over that many files, listed in a .manifest\n");
+		printf("       style is plain (the default), all, or a comma separated list of\n");
+		printf("       whitespace, shuffle, scientific, digits, unknown and escapes, for parser stress tests\n");
 		exit(1);
 	}
 
 	char *mode        = argv[1];
 	bool cluster_mode = cluster_flag_from_mode_string(mode);
-	int seed          = atoi(argv[2]);
-	int num_pairs     = atoi(argv[3]);
-
-	srand(seed);
-
-	ClusterArray clusters = generate_clusters();
+	U64 seed          = strtoull(argv[2], NULL, 10);
+	U64 num_pairs     = strtoull(argv[3], NULL, 10);
+	char *format      = argc > 4 ? argv[4] : "json";
+	U32 thread_count  = argc > 5 ? (U32)atoi(argv[5]) : 0;
+	U64 shard_count   = argc > 6 ? strtoull(argv[6], NULL, 10) : 1;
+	U32 style         = argc > 7 ? json_style_from_string(argv[7]) : 0;
+
+	bool write_json   = 0 == strcmp(format, "json") || 0 == strcmp(format, "both");
+	bool write_binary = 0 == strcmp(format, "binary") || 0 == strcmp(format, "both");
+	bool write_files  = 0 != strcmp(format, "none");
+	if (!write_json && !write_binary && write_files) {
+		printf("Format argument must be json, binary, both or none, got '%s'\n", format);
+		exit(1);
+	}
+	if (num_pairs == 0) {
+		printf("Number of coordinate pairs must be positive, got '%s'\n", argv[3]);
+		exit(1);
+	}
+	if (shard_count == 0 || shard_count > num_pairs) {
+		printf("Shards must be from 1 to the number of pairs, got '%s'\n", argv[6]);
+		exit(1);
+	}
+	bool sharded = shard_count > 1;
 
-	char json_filepath[256];
 	char computations_filepath[256];
-	snprintf(json_filepath, 256, "data_%d_pairs.json", num_pairs);
-	snprintf(computations_filepath, 256, "data_%d_computations.f64", num_pairs);
+	snprintf(computations_filepath, 256, "data_%llu_computations.f64", num_pairs);
+	FILE *comp_file = write_files ? open_output_file(computations_filepath, "wb") : NULL;
+
+	FILE *json_manifest = NULL;
+	FILE *binary_manifest = NULL;
+	if (sharded) {
+		char manifest_filepath[256];
+		if (write_json) {
+			snprintf(manifest_filepath, 256, "data_%llu_pairs.json.manifest", num_pairs);
+			json_manifest = begin_manifest(manifest_filepath, "json", num_pairs, shard_count);
+		}
+		if (write_binary) {
+			snprintf(manifest_filepath, 256, "data_%llu_pairs.bin.manifest", num_pairs);
+			binary_manifest = begin_manifest(manifest_filepath, "bin", num_pairs, shard_count);
+		}
+	}
 
-	FILE *json_file = fopen(json_filepath, "w");
-	if (!json_file) { perror("fopen"); exit(1); }
-	FILE *comp_file = fopen(computations_filepath, "wb");
-	if (!comp_file) { perror("fopen"); exit(1); }
+	static GenerateJob job;
+	job.generator = pair_generator(seed, cluster_mode);
+	job.style = style;
+	job.chunk_pairs = style ? GENERATE_STYLED_CHUNK_PAIRS : GENERATE_CHUNK_PAIRS;
+	job.write_json = write_json;
+	job.write_binary = write_binary;
+	for (int i=0; i < GENERATE_WAVE_CHUNKS; ++i) {
+		GenerateChunk *chunk = &job.chunks[i];
+		if (write_json) {
+			chunk->json = xmalloc(job.chunk_pairs * json_pair_max_chars(style));
+		}
+		if (write_binary) {
+			for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+				chunk->columns[column] = xmalloc(GENERATE_CHUNK_PAIRS * sizeof(F64));
+			}
+		}
+		if (write_files) {
+			chunk->distances = xmalloc(GENERATE_CHUNK_PAIRS * sizeof(F64));
+		}
+	}
 
-	fprintf(json_file, "{\"pairs\":[\n");
+	ThreadPool *pool = thread_pool_create(thread_count);
+	U64 start = os_read_timer();
 
 	F64 sum = 0;
-
-	// generate pairs
-	for (int i=0; i<num_pairs; ++i) {
-		F64 x0, y0, x1, y1;
-		if (cluster_mode) {
-			Cluster cluster = choose_cluster(clusters);
-			x0 = random_f64(cluster.x_min, cluster.x_max);
-			y0 = random_f64(cluster.y_min, cluster.y_max);
-			x1 = random_f64(cluster.x_min, cluster.x_max);
-			y1 = random_f64(cluster.y_min, cluster.y_max);
+	for (U64 shard=0; shard < shard_count; ++shard) {
+		job.shard_first = num_pairs / shard_count * shard + MIN(shard, num_pairs % shard_count);
+		job.shard_end = job.shard_first + num_pairs / shard_count + (shard < num_pairs % shard_count);
+		U64 shard_pairs = job.shard_end - job.shard_first;
+
+		char json_filepath[256];
+		char binary_filepath[256];
+		if (sharded) {
+			snprintf(json_filepath, 256, "data_%llu_pairs.%llu.json", num_pairs, shard);
+			snprintf(binary_filepath, 256, "data_%llu_pairs.%llu.bin", num_pairs, shard);
 		} else {
-			x0 = random_f64(-180, 180);
-			y0 = random_f64(-90, 90);
-			x1 = random_f64(-180, 180);
-			y1 = random_f64(-90, 90);
+			snprintf(json_filepath, 256, "data_%llu_pairs.json", num_pairs);
+			snprintf(binary_filepath, 256, "data_%llu_pairs.bin", num_pairs);
 		}
 
-		F64 reference_result = reference_haversine(x0, y0, x1, y1, EARTH_RADIUS_KM);
-		sum += reference_result;
+		FILE *json_file = NULL;
+		if (write_json) {
+			json_file = open_output_file(json_filepath, "w");
+			fprintf(json_file, "{\"pairs\":[\n");
+		}
+		BinaryWriter binary_writer = {0};
+		if (write_binary) {
+			binary_writer_begin(&binary_writer, binary_filepath, shard_pairs);
+		}
 
-		// write computed distance to comp_file
-		fwrite(&reference_result, sizeof(reference_result), 1, comp_file);
+		U64 total_chunks = (shard_pairs + job.chunk_pairs - 1) / job.chunk_pairs;
+		for (U64 wave=0; wave < total_chunks; wave += GENERATE_WAVE_CHUNKS) {
+			job.wave_first_chunk = wave;
+			job.wave_chunk_count = MIN(GENERATE_WAVE_CHUNKS, total_chunks - wave);
+			job.next_chunk = 0;
+			thread_pool_run(pool, generate_job_thread, &job);
+
+			for (U64 i=0; i < job.wave_chunk_count; ++i) {
+				GenerateChunk *chunk = &job.chunks[i];
+				sum += chunk->sum;
+				if (comp_file && fwrite(chunk->distances, sizeof(F64), chunk->count, comp_file) != chunk->count) {
+					perror("fwrite");
+					exit(1);
+				}
+				if (json_file && fwrite(chunk->json, 1, chunk->json_size, json_file) != chunk->json_size) {
+					perror("fwrite");
+					exit(1);
+				}
+				if (write_binary) {
+					binary_writer_write(&binary_writer, chunk->columns, chunk->first - job.shard_first, chunk->count);
+				}
+			}
+		}
 
-		// write pair to json_file
-		if (i > 0) fprintf(json_file, ",\n");
-		fprintf(json_file, "\t{\"x0\":%.16f, \"y0\":%.16f, \"x1\":%.16f, \"y1\":%.16f}", x0, y0, x1, y1);
+		if (json_file) {
+			fprintf(json_file, "\n]}");
+			fclose(json_file);
+		}
+		if (write_binary) {
+			binary_writer_end(&binary_writer);
+		}
+		if (json_manifest) {
+			fprintf(json_manifest, "%llu %llu %s\n", job.shard_first, shard_pairs, json_filepath);
+		}
+		if (binary_manifest) {
+			fprintf(binary_manifest, "%llu %llu %s\n", job.shard_first, shard_pairs, binary_filepath);
+		}
 	}
 
-	assert(num_pairs > 0);
 	F64 average = sum / num_pairs;
 
-	// write average to comp_file
-	fwrite(&average, sizeof(average), 1, comp_file);
-
-	fprintf(json_file, "\n]}");
-
-	fclose(comp_file);
-	fclose(json_file);
+	if (comp_file) {
+		// write average to comp_file
+		fwrite(&average, sizeof(average), 1, comp_file);
+		fclose(comp_file);
+	}
+	if (json_manifest) fclose(json_manifest);
+	if (binary_manifest) fclose(binary_manifest);
 
-	printf("Mode: %s\nRandom seed: %d\nPair count: %d\nAverage distance: %f\n", mode, seed, num_pairs, average);
+	F64 seconds = (os_read_timer() - start) / (F64)os_timer_freq();
+	printf("Mode: %s\nRandom seed: %llu\nPair count: %llu\nAverage distance: %f\n", mode, seed, num_pairs, average);
+	if (sharded) {
+		printf("Shards: %llu\n", shard_count);
+	}
+	if (style) {
+		printf("Style: %s\n", json_style_string(style));
+	}
+	if (seconds > 0) {
+		printf("Generated in %.3f s, %.2f mpairs/s, %u threads\n", seconds, num_pairs / seconds / 1e6, pool->thread_count);
+	}
 
+	thread_pool_destroy(pool);
 	return 0;
 }
@@ -7,9 +7,16 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h>
 
+// NOTE(shaw): haversine_bench.c includes this file for its stages and does
+// its own timing, so it builds without the profiler and without main
+#ifndef HAVERSINE_BENCH
 #define PROFILE 1
+#endif
 #include "../common.c"
+#include "haversine_pairs.h"
+#include "haversine_generator.c"
 
 #define EARTH_RADIUS_KM 6372.8
 
@@ -60,14 +67,30 @@ typedef struct JsonExpr JsonExpr;
 
 typedef struct {
 	char *key;
+	U64 hash;
 	JsonExpr *val;
 } Entry;
 
+// dicts with more entries than this get a hash table of slots in addition to
+// the entries array, smaller ones are just scanned comparing hashes
+#define DICT_LINEAR_MAX 8
+
 typedef struct {
 	Entry *entries;	
 	size_t num_entries;
+	U32 *slots; // open addressed, holds entry index + 1, 0 means empty
+	size_t num_slots;
 } JsonDict;
 
+// a key with its hash computed up front, plus the entry index it was last
+// found at. objects in an array usually share the same key order, so reusing
+// a DictKey across them turns most lookups into a single compare.
+typedef struct {
+	char *str;
+	U64 hash;
+	size_t slot_hint;
+} DictKey;
+
 typedef struct {
 	JsonExpr **items;	
 	size_t num_items;
@@ -83,24 +106,67 @@ struct JsonExpr {
 	};
 };
 
+// coordinates are stored as separate columns so kernels can load several
+// pairs at once, either as F64 degrees or, once quantized, as S32 fixed point
+// (see PAIRS_S32_UNITS_PER_DEGREE) with the F64 columns left NULL
 typedef struct {
-	F64 x0, y0, x1, y1;
-} Pair;
-
-typedef struct {
-	Pair *pairs;
+	F64 *x0, *y0, *x1, *y1;
+	S32 *qx0, *qy0, *qx1, *qy1;
 	size_t num_pairs;
 } HaversineInput;
 
-JsonExpr *dict_get(JsonDict dict, char *key) {
-	// NOTE(shaw): slow linear search since dict is an array of key value pairs right now
-	for (int i=0; i < dict.num_entries; ++i) {
-		Entry entry = dict.entries[i];
-		if (strcmp(entry.key, key) == 0) {
-			return entry.val;
+// FNV-1a
+U64 hash_key(char *str) {
+	U64 hash = 0xcbf29ce484222325ull;
+	for (; *str; ++str) {
+		hash ^= (U8)*str;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+DictKey dict_key(char *str) {
+	return (DictKey){ .str = str, .hash = hash_key(str) };
+}
+
+static bool entry_matches(Entry *entry, DictKey *key) {
+	return entry->hash == key->hash && strcmp(entry->key, key->str) == 0;
+}
+
+// NOTE(shaw): called four times per pair, too often and too short for a profile
+// block of its own, which would cost more than the lookup. Callers time their
+// lookups together instead, see haversine_input_from_json.
+JsonExpr *dict_lookup(JsonDict dict, DictKey *key) {
+	JsonExpr *result = NULL;
+
+	if (key->slot_hint < dict.num_entries && entry_matches(&dict.entries[key->slot_hint], key)) {
+		result = dict.entries[key->slot_hint].val;
+	} else if (dict.slots) {
+		size_t mask = dict.num_slots - 1;
+		for (size_t i = key->hash & mask; dict.slots[i]; i = (i + 1) & mask) {
+			size_t index = dict.slots[i] - 1;
+			if (entry_matches(&dict.entries[index], key)) {
+				key->slot_hint = index;
+				result = dict.entries[index].val;
+				break;
+			}
+		}
+	} else {
+		for (size_t i=0; i < dict.num_entries; ++i) {
+			if (entry_matches(&dict.entries[i], key)) {
+				key->slot_hint = i;
+				result = dict.entries[i].val;
+				break;
+			}
 		}
 	}
-	return NULL;
+
+	return result;
+}
+
+JsonExpr *dict_get(JsonDict dict, char *key) {
+	DictKey dkey = dict_key(key);
+	return dict_lookup(dict, &dkey);
 }
 
 //------------------------------------------------------------------------------
@@ -111,6 +177,22 @@ JsonExpr *expr_dict(Entry *entries, size_t num_entries) {
 	expr->kind = EXPR_DICT;
 	expr->dict.entries = entries;
 	expr->dict.num_entries = num_entries;
+	expr->dict.slots = NULL;
+	expr->dict.num_slots = 0;
+
+	if (num_entries > DICT_LINEAR_MAX) {
+		size_t num_slots = 16;
+		while (num_slots < 2*num_entries) num_slots *= 2;
+		U32 *slots = xcalloc(num_slots, sizeof(U32));
+		size_t mask = num_slots - 1;
+		for (size_t i=0; i < num_entries; ++i) {
+			size_t slot = entries[i].hash & mask;
+			while (slots[slot]) slot = (slot + 1) & mask;
+			slots[slot] = (U32)(i + 1);
+		}
+		expr->dict.slots = slots;
+		expr->dict.num_slots = num_slots;
+	}
 	return expr;
 }
 
@@ -137,6 +219,29 @@ JsonExpr *expr_float(F64 val) {
 	return expr;
 }
 
+// strings point into the parsed text, only keys are copies
+void free_json(JsonExpr *expr) {
+	switch (expr->kind) {
+		case EXPR_DICT:
+			for (size_t i=0; i < expr->dict.num_entries; ++i) {
+				free(expr->dict.entries[i].key);
+				free_json(expr->dict.entries[i].val);
+			}
+			buf_free(expr->dict.entries);
+			free(expr->dict.slots);
+			break;
+		case EXPR_ARRAY:
+			for (size_t i=0; i < expr->array.num_items; ++i) {
+				free_json(expr->array.items[i]);
+			}
+			buf_free(expr->array.items);
+			break;
+		default:
+			break;
+	}
+	free(expr);
+}
+
 //------------------------------------------------------------------------------
 // Parsing
 //------------------------------------------------------------------------------
@@ -181,13 +286,85 @@ void expect_token(TokenKind kind) {
 	}
 }
 
+static U32 scan_hex4(char *at) {
+	U32 value = 0;
+	for (int i=0; i < 4; ++i) {
+		char c = at[i];
+		U32 digit = isdigit(c) ? c - '0' : (c|0x20) >= 'a' && (c|0x20) <= 'f' ? (c|0x20) - 'a' + 10 : 16;
+		if (digit == 16) parse_error("bad \\u escape in string");
+		value = value*16 + digit;
+	}
+	return value;
+}
+
+// decodes the escape at `stream` into `out` as UTF-8, returns past the end of
+// what it wrote
+// NOTE(shaw): every escape is at least as long as what it decodes to, so the
+// string is decoded in place
+static char *scan_escape(char *out) {
+	++stream;
+	char c = *stream++;
+	switch (c) {
+		case '"':  *out++ = '"';  return out;
+		case '\\': *out++ = '\\'; return out;
+		case '/':  *out++ = '/';  return out;
+		case 'b':  *out++ = '\b'; return out;
+		case 'f':  *out++ = '\f'; return out;
+		case 'n':  *out++ = '\n'; return out;
+		case 'r':  *out++ = '\r'; return out;
+		case 't':  *out++ = '\t'; return out;
+		case 'u':  break;
+		default:   parse_error("bad escape '\\%c' in string", c);
+	}
+
+	U32 code = scan_hex4(stream);
+	stream += 4;
+	if (code >= 0xD800 && code < 0xDC00 && stream[0] == '\\' && stream[1] == 'u') {
+		U32 low = scan_hex4(stream + 2);
+		if (low >= 0xDC00 && low < 0xE000) {
+			code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			stream += 6;
+		}
+	}
+	if (code < 0x80) {
+		*out++ = (char)code;
+	} else if (code < 0x800) {
+		*out++ = (char)(0xC0 | (code >> 6));
+		*out++ = (char)(0x80 | (code & 0x3F));
+	} else if (code < 0x10000) {
+		*out++ = (char)(0xE0 | (code >> 12));
+		*out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (code & 0x3F));
+	} else {
+		*out++ = (char)(0xF0 | (code >> 18));
+		*out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+		*out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (code & 0x3F));
+	}
+	return out;
+}
+
 void scan_str(void) {
 	token.kind = TOKEN_STRING;
 	++stream;
 	char *start = stream;
-	while (*stream != '"') {
+	while (*stream != '"' && *stream != '\\') {
+		if (!*stream) parse_error("unterminated string");
 		++stream;
 	}
+	// the first escape switches to copying the string down over its escapes
+	if (*stream == '\\') {
+		char *out = stream;
+		while (*stream != '"') {
+			if (!*stream) parse_error("unterminated string");
+			if (*stream == '\\') {
+				out = scan_escape(out);
+			} else {
+				*out++ = *stream++;
+			}
+		}
+		*out = 0;
+	}
 	*stream = 0; // add null terminator
 	++stream;
 	token.str_val = start;
@@ -203,6 +380,15 @@ void scan_float(void) {
 		++stream;
 	while (isdigit(*stream))
 		++stream;
+	if (*stream == 'e' || *stream == 'E') {
+		++stream;
+		if (*stream == '+' || *stream == '-')
+			++stream;
+		while (isdigit(*stream))
+			++stream;
+	}
+	if (stream == start && *stream)
+		parse_error("unexpected character '%c'", *stream);
 	F64 val = strtod(start, NULL);
 	if (val == HUGE_VAL || val == -HUGE_VAL)
 		parse_error("Float literal overflow");
@@ -267,12 +453,14 @@ JsonExpr *parse_expr_dict(void) {
 	PROFILE_FUNCTION_BEGIN;
 	expect_token(TOKEN_LEFT_BRACE);
 	BUF(Entry *entries) = NULL;
-	do {
-		char *key = parse_string();
-		expect_token(TOKEN_COLON);
-		JsonExpr *val = parse_expr();
-		buf_push(entries, (Entry){key, val});
-	} while (match_token(TOKEN_COMMA));
+	if (!is_token(TOKEN_RIGHT_BRACE)) {
+		do {
+			char *key = parse_string();
+			expect_token(TOKEN_COLON);
+			JsonExpr *val = parse_expr();
+			buf_push(entries, (Entry){key, hash_key(key), val});
+		} while (match_token(TOKEN_COMMA));
+	}
 	expect_token(TOKEN_RIGHT_BRACE);
 	JsonExpr *dict = expr_dict(entries, buf_len(entries));
 	PROFILE_FUNCTION_END;
@@ -282,9 +470,11 @@ JsonExpr *parse_expr_dict(void) {
 JsonExpr *parse_expr_array(void) {
 	expect_token(TOKEN_LEFT_BRACKET);
 	BUF(JsonExpr **items) = NULL;
-	do {
-		buf_push(items, parse_expr());
-	} while (match_token(TOKEN_COMMA));
+	if (!is_token(TOKEN_RIGHT_BRACKET)) {
+		do {
+			buf_push(items, parse_expr());
+		} while (match_token(TOKEN_COMMA));
+	}
 	expect_token(TOKEN_RIGHT_BRACKET);
 	return expr_array(items, buf_len(items));
 }
@@ -339,171 +529,1200 @@ JsonExpr *parse_json(void) {
 	return json;
 }
 
-HaversineInput parse_haversine_input(void) {
+HaversineInput haversine_input_from_json(JsonExpr *json) {
 	PROFILE_FUNCTION_BEGIN;
 	HaversineInput input = {0};
 
-	JsonExpr *json = parse_json();
-
 	JsonExpr *pairs = dict_get(json->dict, "pairs");
 
 	input.num_pairs = pairs->array.num_items;
-	input.pairs = xcalloc(input.num_pairs, sizeof(Pair));
-
-	for (int i=0; i < pairs->array.num_items; ++i) {
-		JsonExpr *item = pairs->array.items[i];
-		assert(item->kind == EXPR_DICT);
-		Pair *pair = &input.pairs[i];
-		JsonExpr *x0 = dict_get(item->dict, "x0");
-		if (x0) pair->x0 = x0->float_val;
-		JsonExpr *y0 = dict_get(item->dict, "y0");
-		if (y0) pair->y0 = y0->float_val;
-		JsonExpr *x1 = dict_get(item->dict, "x1");
-		if (x1) pair->x1 = x1->float_val;
-		JsonExpr *y1 = dict_get(item->dict, "y1");
-		if (y1) pair->y1 = y1->float_val;
+	input.x0 = xcalloc(4*input.num_pairs, sizeof(F64));
+	input.y0 = input.x0 + input.num_pairs;
+	input.x1 = input.y0 + input.num_pairs;
+	input.y1 = input.x1 + input.num_pairs;
+
+	// keys are reused across items so their slot hints learn the object shape
+	DictKey x0_key = dict_key("x0");
+	DictKey y0_key = dict_key("y0");
+	DictKey x1_key = dict_key("x1");
+	DictKey y1_key = dict_key("y1");
+
+	{
+		PROFILE_BLOCK_BEGIN("pair dict lookups");
+		for (size_t i=0; i < pairs->array.num_items; ++i) {
+			JsonExpr *item = pairs->array.items[i];
+			assert(item->kind == EXPR_DICT);
+			JsonExpr *x0 = dict_lookup(item->dict, &x0_key);
+			if (x0) input.x0[i] = x0->float_val;
+			JsonExpr *y0 = dict_lookup(item->dict, &y0_key);
+			if (y0) input.y0[i] = y0->float_val;
+			JsonExpr *x1 = dict_lookup(item->dict, &x1_key);
+			if (x1) input.x1[i] = x1->float_val;
+			JsonExpr *y1 = dict_lookup(item->dict, &y1_key);
+			if (y1) input.y1[i] = y1->float_val;
+		}
+		PROFILE_BLOCK_END;
 	}
 
 	PROFILE_FUNCTION_END;
 	return input;
 }
 
+HaversineInput parse_haversine_input(void) {
+	return haversine_input_from_json(parse_json());
+}
+
 
 //------------------------------------------------------------------------------
-// from LISTING 65 - Reference Haversine Distance Formula
+// Binary Input
 //------------------------------------------------------------------------------
-static F64 square(F64 a) {
-	return a*a;
-}
-
-static F64 radians_from_degrees(F64 degrees) {
-	return 0.01745329251994329577f * degrees;
-}
-
-// NOTE(casey): earth_radius is generally expected to be 6372.8
-static F64 reference_haversine(F64 x0, F64 y0, F64 x1, F64 y1, F64 earth_radius)
-{
-	/* NOTE(casey): This is not meant to be a "good" way to calculate the Haversine distance.
-	   Instead, it attempts to follow, as closely as possible, the formula used in the real-world
-	   question on which these homework exercises are loosely based.
-	*/
-	
-	F64 lat1 = y0;
-	F64 lat2 = y1;
-	F64 lon1 = x0;
-	F64 lon2 = x1;
-	
-	F64 dLat = radians_from_degrees(lat2 - lat1);
-	F64 dLon = radians_from_degrees(lon2 - lon1);
-	lat1 = radians_from_degrees(lat1);
-	lat2 = radians_from_degrees(lat2);
-	
-	F64 a = square(sin(dLat/2.0)) + cos(lat1)*cos(lat2)*square(sin(dLon/2));
-	F64 c = 2.0*asin(sqrt(a));
-	
-	F64 result = earth_radius * c;
-	
-	return result;
+bool is_binary_input(char *filepath) {
+	U64 magic = 0;
+	FILE *f = fopen(filepath, "rb");
+	if (f) {
+		fread(&magic, sizeof(magic), 1, f);
+		fclose(f);
+	}
+	return magic == PAIRS_MAGIC;
 }
 
-#define EPSILON 0.00000000001
-void validate(char *answers_filepath, HaversineInput input) {
+// points the input at the columns of a pairs image already in memory, returns
+// NULL if it is good or what is wrong with it
+char *pairs_input_from_memory(void *data, U64 size, HaversineInput *input) {
+	PairsHeader *header = data;
+	if (size < sizeof(PairsHeader) || header->magic != PAIRS_MAGIC) {
+		return "not a binary pairs file";
+	}
+	if (header->version != PAIRS_VERSION || 
+		(header->column_type != PAIRS_COLUMN_F64 && header->column_type != PAIRS_COLUMN_S32))
+	{
+		return "unsupported version or column type";
+	}
+
+	// every column has to lie inside the image on its own, the offsets come
+	// from the file and nothing says they are in order. num_pairs is checked
+	// by division first so the column size can't wrap around.
+	U64 element_size = header->column_type == PAIRS_COLUMN_S32 ? sizeof(S32) : sizeof(F64);
+	if (header->num_pairs > size / element_size) {
+		return "truncated";
+	}
+	U64 column_size = header->num_pairs * element_size;
+	void *columns[PAIRS_COLUMN_COUNT];
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		U64 offset = header->column_offsets[column];
+		if (offset < sizeof(PairsHeader)) {
+			return "column overlaps the header";
+		}
+		if (offset > size || column_size > size - offset) {
+			return "truncated";
+		}
+		columns[column] = (U8*)data + offset;
+		if (offset % PAIRS_ALIGN != 0 || (uintptr_t)columns[column] % element_size != 0) {
+			return "misaligned column";
+		}
+	}
+	*input = (HaversineInput){0};
+	input->num_pairs = header->num_pairs;
+	if (header->column_type == PAIRS_COLUMN_S32) {
+		input->qx0 = columns[PAIRS_X0];
+		input->qy0 = columns[PAIRS_Y0];
+		input->qx1 = columns[PAIRS_X1];
+		input->qy1 = columns[PAIRS_Y1];
+	} else {
+		input->x0 = columns[PAIRS_X0];
+		input->y0 = columns[PAIRS_Y0];
+		input->x1 = columns[PAIRS_X1];
+		input->y1 = columns[PAIRS_Y1];
+	}
+	return NULL;
+}
+
+// the columns point straight into the mapped file, nothing is copied
+HaversineInput map_binary_input(char *filepath) {
 	PROFILE_FUNCTION_BEGIN;
-	char *file_data;
-	size_t file_size;
-	bool ok = read_entire_file(answers_filepath, &file_data, &file_size);
-	if (!ok) {
-		fprintf(stderr, "error: failed to read file %s\n", answers_filepath);
-		exit(1);
+	HaversineInput input = {0};
+	void *file_data;
+	U64 file_size;
+	if (!os_map_file(filepath, &file_data, &file_size)) {
+		fatal("failed to map file %s", filepath);
 	}
 
-	BUF(char *failures) = NULL;
+	char *error = pairs_input_from_memory(file_data, file_size, &input);
+	if (error) {
+		fatal("%s: %s", filepath, error);
+	}
+
+	PROFILE_FUNCTION_END;
+	return input;
+}
 
-	F64 *distances = (F64*)file_data;
+PairsHeader input_pairs_header(HaversineInput input) {
+	return pairs_header(input.qx0 ? PAIRS_COLUMN_S32 : PAIRS_COLUMN_F64, input.num_pairs);
+}
+
+bool write_pairs(FILE *f, HaversineInput input) {
+	PairsHeader header = input_pairs_header(input);
+	void *columns[PAIRS_COLUMN_COUNT] = { input.x0, input.y0, input.x1, input.y1 };
+	U64 element_size = sizeof(F64);
+	if (input.qx0) {
+		columns[PAIRS_X0] = input.qx0;
+		columns[PAIRS_Y0] = input.qy0;
+		columns[PAIRS_X1] = input.qx1;
+		columns[PAIRS_Y1] = input.qy1;
+		element_size = sizeof(S32);
+	}
+	U8 padding[PAIRS_ALIGN] = {0};
+	size_t written = fwrite(&header, sizeof(header), 1, f);
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		U64 size = input.num_pairs * element_size;
+		written += fwrite(columns[column], size, 1, f) || size == 0;
+		fwrite(padding, pairs_column_size(header.column_type, input.num_pairs) - size, 1, f);
+	}
+	return written == 1 + PAIRS_COLUMN_COUNT;
+}
+
+void write_binary_input(char *filepath, HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	FILE *f = fopen(filepath, "wb");
+	if (!f) {
+		fatal("failed to open %s for writing", filepath);
+	}
+	bool ok = write_pairs(f, input);
+	if (fclose(f) != 0 || !ok) {
+		fatal("failed to write %s", filepath);
+	}
+
+	printf("Wrote %zu pairs to %s\n", input.num_pairs, filepath);
+	PROFILE_BLOCK_END_THROUGHPUT(pairs_file_size(input_pairs_header(input)));
+}
+
+
+//------------------------------------------------------------------------------
+// Parse Cache
+//------------------------------------------------------------------------------
+// With -cache, the parsed input is saved next to the json as <input>.cache, a
+// ParseCacheKey followed by the input in the binary pairs format. Later runs
+// map it instead of reading and parsing the json, as long as the key still
+// matches the json on disk.
+//
+// NOTE(shaw): hashing all of a multi gigabyte json would cost about as much
+// as reading it, which is the thing the cache is there to skip, so the
+// content hash only covers PARSE_CACHE_SAMPLE_COUNT evenly spread samples.
+// Together with the size and mtime that catches any edit short of one that
+// keeps the size, restores the mtime and misses every sample.
+#define PARSE_CACHE_MAGIC        0x0045484341435648ull // "HVCACHE"
+#define PARSE_CACHE_VERSION      1
+#define PARSE_CACHE_SAMPLE_SIZE  4096
+#define PARSE_CACHE_SAMPLE_COUNT 64
+
+typedef struct {
+	U64 magic;
+	U64 version;
+	U64 path_hash;
+	U64 source_size;
+	U64 source_mtime;
+	U64 content_hash;
+	U64 reserved[2]; // pad to 64 so the pairs columns stay aligned
+} ParseCacheKey;
+
+typedef enum {
+	PARSE_CACHE_HIT,
+	PARSE_CACHE_MISSING,
+	PARSE_CACHE_STALE,
+} ParseCacheStatus;
+
+char *parse_cache_status_names[] = {
+	[PARSE_CACHE_HIT]     = "hit",
+	[PARSE_CACHE_MISSING] = "missing, building it",
+	[PARSE_CACHE_STALE]   = "stale, rebuilding it",
+};
+
+// FNV-1a, continuing from hash
+U64 hash_bytes(U64 hash, void *data, U64 size) {
+	for (U8 *at = data; size--; ++at) {
+		hash ^= *at;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+ParseCacheKey parse_cache_key(char *filepath) {
+	PROFILE_FUNCTION_BEGIN;
+	ParseCacheKey key = {0};
+	key.magic = PARSE_CACHE_MAGIC;
+	key.version = PARSE_CACHE_VERSION;
+	key.path_hash = hash_key(filepath);
+	key.source_size = os_file_size(filepath);
+	key.source_mtime = os_file_mtime(filepath);
+
+	U64 hash = 0xcbf29ce484222325ull;
+	FILE *f = fopen(filepath, "rb");
+	if (f) {
+		static U8 sample[PARSE_CACHE_SAMPLE_SIZE];
+		U64 sample_size = MIN(PARSE_CACHE_SAMPLE_SIZE, key.source_size);
+		U64 stride = (key.source_size - sample_size) / (PARSE_CACHE_SAMPLE_COUNT - 1);
+		for (U64 i=0; i < PARSE_CACHE_SAMPLE_COUNT; ++i) {
+			if (_fseeki64(f, i*stride, SEEK_SET) != 0) break;
+			U64 read = fread(sample, 1, sample_size, f);
+			hash = hash_bytes(hash, sample, read);
+		}
+		fclose(f);
+	}
+	key.content_hash = hash;
+
+	PROFILE_FUNCTION_END;
+	return key;
+}
+
+char *parse_cache_filepath(char *filepath) {
+	return buf__printf(NULL, "%s.cache", filepath);
+}
+
+ParseCacheStatus load_parse_cache(char *filepath, ParseCacheKey key, HaversineInput *input) {
+	PROFILE_FUNCTION_BEGIN;
+	ParseCacheStatus status = PARSE_CACHE_MISSING;
+	char *cache_filepath = parse_cache_filepath(filepath);
+	void *file_data;
+	U64 file_size;
+	if (os_map_file(cache_filepath, &file_data, &file_size)) {
+		status = PARSE_CACHE_STALE;
+		if (file_size >= sizeof(ParseCacheKey) && 0 == memcmp(file_data, &key, sizeof(key)) &&
+			!pairs_input_from_memory((U8*)file_data + sizeof(key), file_size - sizeof(key), input))
+		{
+			status = PARSE_CACHE_HIT;
+		} else {
+			os_unmap_file(file_data, file_size);
+		}
+	}
+	buf_free(cache_filepath);
+	PROFILE_FUNCTION_END;
+	return status;
+}
+
+// written to a temporary file first so a crash can't leave a half written
+// cache with a valid key behind
+void write_parse_cache(char *filepath, ParseCacheKey key, HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	char *cache_filepath = parse_cache_filepath(filepath);
+	char *temp_filepath = buf__printf(NULL, "%s.tmp", cache_filepath);
+	FILE *f = fopen(temp_filepath, "wb");
+	bool ok = f && fwrite(&key, sizeof(key), 1, f) == 1 && write_pairs(f, input);
+	if (f && fclose(f) != 0) ok = false;
+	remove(cache_filepath);
+	if (!ok || rename(temp_filepath, cache_filepath) != 0) {
+		fprintf(stderr, "warning: failed to write parse cache %s\n", cache_filepath);
+		remove(temp_filepath);
+	}
+	buf_free(temp_filepath);
+	buf_free(cache_filepath);
+	PROFILE_BLOCK_END_THROUGHPUT(sizeof(key) + pairs_file_size(input_pairs_header(input)));
+}
+
+
+#include "haversine_kernel.c"
+#include "haversine_analytics.c"
+
+//------------------------------------------------------------------------------
+// Compute
+//------------------------------------------------------------------------------
+// pairs are pushed through the kernel this many at a time, small enough for
+// the distances to stay in L1
+#define KERNEL_BLOCK_COUNT 1024
+
+// NOTE(shaw): the sum has to come out bit-identical however many threads do
+// the work, so the pairs are cut into fixed blocks of KERNEL_BLOCK_COUNT, each
+// block is summed left to right, and the block sums are combined by a pairwise
+// tree whose shape only depends on the number of blocks. Threads only change
+// who computes a block sum, never the order anything is added in.
+//
+// The tree is built like incrementing a binary counter: levels[k] holds the
+// sum of the last complete run of 2^k values, and every carry adds two equal
+// sized neighbours. Feeding it values one at a time in order gives the same
+// result as having them all up front, which the streaming paths rely on.
+typedef struct {
+	F64 levels[64];
+	U64 count;
+} PairwiseSum;
+
+void pairwise_add(PairwiseSum *sum, F64 value) {
+	U64 count = sum->count++;
+	int level = 0;
+	for (; count & 1; count >>= 1, ++level) {
+		value = sum->levels[level] + value;
+	}
+	sum->levels[level] = value;
+}
+
+// the partial levels are folded smallest first, so the result is
+// sum(first 2^k) + sum(rest) all the way down
+F64 pairwise_total(PairwiseSum *sum) {
+	F64 total = 0;
+	bool first = true;
+	for (int level=0; level < 64; ++level) {
+		if (sum->count & (1ull << level)) {
+			total = first ? sum->levels[level] : sum->levels[level] + total;
+			first = false;
+		}
+	}
+	return total;
+}
+
+void run_kernel(HaversineKernel *kernel, HaversineInput input, U64 first, U64 count, F64 *distances) {
+	if (input.qx0) {
+		kernel->func_q32(input.qx0 + first, input.qy0 + first, input.qx1 + first, input.qy1 + first, count, distances);
+	} else {
+		kernel->func(input.x0 + first, input.y0 + first, input.x1 + first, input.y1 + first, count, distances);
+	}
+}
+
+U64 input_bytes_per_pair(HaversineInput input) {
+	return input.qx0 ? 4*sizeof(S32) : 4*sizeof(F64);
+}
+
+F64 sum_block(HaversineKernel *kernel, HaversineInput input, U64 block, F64 *distances) {
+	U64 first = block * KERNEL_BLOCK_COUNT;
+	U64 count = MIN(KERNEL_BLOCK_COUNT, input.num_pairs - first);
+	run_kernel(kernel, input, first, count, distances);
 	F64 sum = 0;
-	for (size_t i=0; i<input.num_pairs; ++i) {
-		Pair pair = input.pairs[i];
-		F64 distance = reference_haversine(pair.x0, pair.y0, pair.x1, pair.y1, EARTH_RADIUS_KM);
-		sum += distance;
-		F64 error = distance - distances[i];
-		if (error > EPSILON) {
-			buf_printf(failures, "pair %zu: expected %.16f, got %.16f, difference %.16f\n", 
-				i, distances[i], distance, error);
+	for (U64 i=0; i < count; ++i) {
+		sum += distances[i];
+	}
+	return sum;
+}
+
+U64 block_count(size_t num_pairs) {
+	return (num_pairs + KERNEL_BLOCK_COUNT - 1) / KERNEL_BLOCK_COUNT;
+}
+
+typedef struct {
+	HaversineKernel *kernel;
+	HaversineInput input;
+	F64 *block_sums;
+	U64 block_count;
+	DistanceStats *stats; // one per thread, or NULL
+	volatile U64 next_block;
+} SumJob;
+
+// blocks are handed out one at a time so a slow thread doesn't hold up the rest
+static void sum_job_thread(void *params, U32 thread_index, U32 thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	SumJob *job = params;
+	F64 distances[KERNEL_BLOCK_COUNT];
+	U64 pair_count = 0;
+	for (;;) {
+		U64 block = os_atomic_add_u64(&job->next_block, 1);
+		if (block >= job->block_count) break;
+		job->block_sums[block] = sum_block(job->kernel, job->input, block, distances);
+		U64 first = block * KERNEL_BLOCK_COUNT;
+		U64 count = MIN(KERNEL_BLOCK_COUNT, job->input.num_pairs - first);
+		if (job->stats) {
+			distance_stats_add(&job->stats[thread_index], distances, first, count);
+		}
+		pair_count += count;
+	}
+	PROFILE_BLOCK_END_THROUGHPUT(pair_count * input_bytes_per_pair(job->input));
+}
+
+// stats, when not NULL, gets the analytics of every distance in the same sweep
+F64 sum_haversine(ThreadPool *pool, HaversineKernel *kernel, HaversineInput input, DistanceStats *stats) {
+	SumJob job = {0};
+	job.kernel = kernel;
+	job.input = input;
+	job.block_count = block_count(input.num_pairs);
+	job.block_sums = xmalloc(MAX(job.block_count, 1) * sizeof(F64));
+	if (stats) {
+		job.stats = xmalloc(pool->thread_count * sizeof(DistanceStats));
+		for (U32 t=0; t < pool->thread_count; ++t) {
+			distance_stats_init(&job.stats[t], stats->top_k);
+		}
+	}
+	thread_pool_run(pool, sum_job_thread, &job);
+
+	if (stats) {
+		for (U32 t=0; t < pool->thread_count; ++t) {
+			distance_stats_merge(stats, &job.stats[t]);
+		}
+		free(job.stats);
+	}
+
+	PairwiseSum sum = {0};
+	for (U64 block=0; block < job.block_count; ++block) {
+		pairwise_add(&sum, job.block_sums[block]);
+	}
+	free(job.block_sums);
+	return pairwise_total(&sum);
+}
+
+// runs the sum on 1, 2, 4, ... threads up to the number of logical processors
+// and checks every thread count gets exactly the same bits
+void report_thread_scaling(HaversineKernel *kernel, HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	enum { repetitions = 5 };
+	U64 cpu_freq = estimate_cpu_freq();
+	U32 max_threads = os_logical_processor_count();
+
+	printf("\nThread scaling (%zu pairs, %s, best of %d):\n", 
+		input.num_pairs, kernel->label, repetitions);
+
+	F64 single_seconds = 0;
+	F64 single_sum = 0;
+	for (U32 threads=1; threads <= max_threads; threads = threads < max_threads && threads*2 > max_threads ? max_threads : threads*2) {
+		ThreadPool *pool = thread_pool_create(threads);
+		F64 sum = 0;
+		U64 best_ticks = (U64)-1;
+		for (int rep=0; rep < repetitions; ++rep) {
+			U64 start = read_cpu_timer();
+			sum = sum_haversine(pool, kernel, input, NULL);
+			best_ticks = MIN(best_ticks, read_cpu_timer() - start);
 		}
+		thread_pool_destroy(pool);
+
+		F64 seconds = best_ticks / (F64)cpu_freq;
+		if (threads == 1) {
+			single_seconds = seconds;
+			single_sum = sum;
+		}
+		F64 pairs_per_second = seconds > 0 ? input.num_pairs / seconds : 0;
+		F64 speedup = seconds > 0 ? single_seconds / seconds : 0;
+		printf("\t%3u threads  %9.3f ms  %8.2f mpairs/s  %5.2fx  average %.16f  %s\n",
+			threads, seconds * 1000, pairs_per_second / 1e6, speedup,
+			input.num_pairs > 0 ? sum / input.num_pairs : 0,
+			memcmp(&sum, &single_sum, sizeof(F64)) == 0 ? "identical" : "MISMATCH");
+
+		if (threads == max_threads) break;
 	}
-	F64 average = input.num_pairs > 0 ? sum / input.num_pairs : 0;
-	F64 generated_average = distances[input.num_pairs];
+	PROFILE_FUNCTION_END;
+}
+
+#define EPSILON 0.00000000001
 
+void print_validation(U64 num_pairs, F64 average, F64 generated_average) {
 	F64 difference = 0;
 	if (generated_average > 0) {
 		difference = average - generated_average;
 	}
 
-	printf("Number of pairs: %zu\n", input.num_pairs);
+	printf("Number of pairs: %llu\n", num_pairs);
 	printf("Average haversine distance: %.16f\n", average);
 	printf("\nValidation:\n");
 	printf("Generated average haversine distance: %.16f\n", generated_average);
 	printf("Difference: %.16f\n", difference);
-	if (failures) {
-		printf("Failures:\n%s\n", failures);
+}
+
+// NOTE(shaw): errors are binned by their power of two. Bucket 0 only holds
+// exact matches, bucket 1 holds everything below the smallest bin and the
+// last bucket everything above the largest, so the tables stay a fixed size.
+#define ERROR_BUCKET_COUNT   48
+#define ABS_ERROR_MIN_LOG2  -50 // bucket 1 is < 2^-49, about 1.8e-15 km
+#define ULP_ERROR_MIN_LOG2   -1 // bucket 1 is < 1 ulp
+
+typedef struct {
+	U64 abs_buckets[ERROR_BUCKET_COUNT];
+	U64 ulp_buckets[ERROR_BUCKET_COUNT];
+	U64 over_epsilon;
+	F64 max_abs_error;
+	U64 max_abs_error_index;
+	F64 max_ulp_error;
+	U8 pad[64]; // each thread writes its own, keep them off each other's cache lines
+} ErrorStats;
+
+static int error_bucket(F64 error, int min_log2) {
+	if (error == 0) return 0;
+	U64 bits;
+	memcpy(&bits, &error, sizeof(bits));
+	int log2 = (int)((bits >> 52) & 0x7ff) - 1023;
+	int bucket = 1 + log2 - min_log2;
+	return bucket < 1 ? 1 : bucket >= ERROR_BUCKET_COUNT ? ERROR_BUCKET_COUNT - 1 : bucket;
+}
+
+typedef struct {
+	HaversineKernel *kernel;
+	DistanceErrorsFunc *distance_errors;
+	HaversineInput input;
+	F64 *expected;
+	F64 *block_sums;
+	U64 block_count;
+	ErrorStats *stats; // one per thread
+	volatile U64 next_block;
+} ValidateJob;
+
+// the errors are of the pairs first..first+count, or of indices[0..count] when
+// indices isn't NULL
+static void error_stats_add(ErrorStats *stats, F64 *abs_errors, F64 *ulp_errors, U64 count, U64 first, U64 *indices) {
+	for (U64 i=0; i < count; ++i) {
+		U64 index = indices ? indices[i] : first + i;
+		++stats->abs_buckets[error_bucket(abs_errors[i], ABS_ERROR_MIN_LOG2)];
+		++stats->ulp_buckets[error_bucket(ulp_errors[i], ULP_ERROR_MIN_LOG2)];
+		stats->over_epsilon += abs_errors[i] > EPSILON;
+		// blocks arrive in any order, ties go to the lowest pair so the
+		// report doesn't depend on the threads
+		if (abs_errors[i] > stats->max_abs_error ||
+			(abs_errors[i] == stats->max_abs_error && index < stats->max_abs_error_index))
+		{
+			stats->max_abs_error = abs_errors[i];
+			stats->max_abs_error_index = index;
+		}
+		stats->max_ulp_error = MAX(stats->max_ulp_error, ulp_errors[i]);
+	}
+}
+
+static void error_stats_merge(ErrorStats *into, ErrorStats *from) {
+	for (int bucket=0; bucket < ERROR_BUCKET_COUNT; ++bucket) {
+		into->abs_buckets[bucket] += from->abs_buckets[bucket];
+		into->ulp_buckets[bucket] += from->ulp_buckets[bucket];
+	}
+	into->over_epsilon += from->over_epsilon;
+	if (from->max_abs_error > into->max_abs_error ||
+		(from->max_abs_error == into->max_abs_error && from->max_abs_error_index < into->max_abs_error_index))
+	{
+		into->max_abs_error = from->max_abs_error;
+		into->max_abs_error_index = from->max_abs_error_index;
 	}
+	into->max_ulp_error = MAX(into->max_ulp_error, from->max_ulp_error);
+}
 
+static void validate_job_thread(void *params, U32 thread_index, U32 thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	ValidateJob *job = params;
+	ErrorStats *stats = &job->stats[thread_index];
+	F64 computed[KERNEL_BLOCK_COUNT];
+	F64 abs_errors[KERNEL_BLOCK_COUNT];
+	F64 ulp_errors[KERNEL_BLOCK_COUNT];
+	for (;;) {
+		U64 block = os_atomic_add_u64(&job->next_block, 1);
+		if (block >= job->block_count) break;
+
+		U64 first = block * KERNEL_BLOCK_COUNT;
+		U64 count = MIN(KERNEL_BLOCK_COUNT, job->input.num_pairs - first);
+		job->block_sums[block] = sum_block(job->kernel, job->input, block, computed);
+		job->distance_errors(computed, job->expected + first, count, abs_errors, ulp_errors);
+		error_stats_add(stats, abs_errors, ulp_errors, count, first, NULL);
+	}
+	PROFILE_FUNCTION_END;
+}
+
+static void print_error_histogram(char *title, U64 *buckets, int min_log2, U64 num_pairs, char *unit) {
+	printf("%s:\n", title);
+	for (int bucket=0; bucket < ERROR_BUCKET_COUNT; ++bucket) {
+		if (!buckets[bucket]) continue;
+		char range[64];
+		if (bucket == 0) {
+			snprintf(range, sizeof(range), "exact");
+		} else if (bucket == 1) {
+			snprintf(range, sizeof(range), "< %.3g %s", ldexp(1, min_log2 + 1), unit);
+		} else if (bucket == ERROR_BUCKET_COUNT - 1) {
+			snprintf(range, sizeof(range), ">= %.3g %s", ldexp(1, min_log2 + bucket - 1), unit);
+		} else {
+			snprintf(range, sizeof(range), "[%.3g, %.3g) %s", ldexp(1, min_log2 + bucket - 1), ldexp(1, min_log2 + bucket), unit);
+		}
+		printf("\t%-28s %12llu  %6.2f%%\n", range, buckets[bucket], 100.0 * buckets[bucket] / MAX(num_pairs, 1));
+	}
+}
+
+// checked is how many pairs the stats cover, worst_expected the answer of the
+// pair with the largest error
+static void print_error_stats(ErrorStats *stats, U64 checked, F64 worst_expected) {
+	printf("Over epsilon (|error| > %g): %llu of %llu\n", EPSILON, stats->over_epsilon, checked);
+	if (checked) {
+		printf("Max error: %.3e km at pair %llu (expected %.16f), %.3g ulp max\n",
+			stats->max_abs_error, stats->max_abs_error_index, worst_expected, stats->max_ulp_error);
+	}
+	print_error_histogram("Absolute error", stats->abs_buckets, ABS_ERROR_MIN_LOG2, checked, "km");
+	print_error_histogram("ULP error", stats->ulp_buckets, ULP_ERROR_MIN_LOG2, checked, "ulp");
+}
+
+// computes every distance again and checks it against the answers the
+// generator wrote, spread over the threads of the pool
+void validate(ThreadPool *pool, char *answers_filepath, HaversineKernel *kernel, HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	void *file_data;
+	U64 file_size;
+	if (!os_map_file(answers_filepath, &file_data, &file_size)) {
+		fatal("failed to map file %s", answers_filepath);
+	}
+	if (file_size < (input.num_pairs + 1) * sizeof(F64)) {
+		fatal("%s holds %llu answers, expected %llu and the average", 
+			answers_filepath, file_size / sizeof(F64), input.num_pairs);
+	}
+
+	ValidateJob job = {0};
+	job.kernel = kernel;
+	job.distance_errors = find_distance_errors();
+	job.input = input;
+	job.expected = file_data;
+	job.block_count = block_count(input.num_pairs);
+	job.block_sums = xmalloc(MAX(job.block_count, 1) * sizeof(F64));
+	job.stats = xcalloc(pool->thread_count, sizeof(ErrorStats));
+	thread_pool_run(pool, validate_job_thread, &job);
+
+	PairwiseSum sum = {0};
+	for (U64 block=0; block < job.block_count; ++block) {
+		pairwise_add(&sum, job.block_sums[block]);
+	}
+
+	ErrorStats total = {0};
+	for (U32 t=0; t < pool->thread_count; ++t) {
+		error_stats_merge(&total, &job.stats[t]);
+	}
+
+	F64 average = input.num_pairs > 0 ? pairwise_total(&sum) / input.num_pairs : 0;
+	F64 generated_average = job.expected[input.num_pairs];
+	print_validation(input.num_pairs, average, generated_average);
+	print_error_stats(&total, input.num_pairs, input.num_pairs ? job.expected[total.max_abs_error_index] : 0);
+
+	free(job.stats);
+	free(job.block_sums);
+	os_unmap_file(file_data, file_size);
+	PROFILE_FUNCTION_END;
+}
+
+// runs every kernel the cpu supports over the whole input a few times and
+// reports the best throughput and the error against the reference kernel
+void compare_kernels(HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	enum { repetitions = 5 };
+	U64 cpu_freq = estimate_cpu_freq();
+	F64 *reference = xmalloc(input.num_pairs * sizeof(F64));
+	F64 *computed = xmalloc(input.num_pairs * sizeof(F64));
+	run_kernel(&haversine_kernels[KERNEL_REFERENCE][0], input, 0, input.num_pairs, reference);
+
+	printf("\nKernels (%zu pairs, best of %d):\n", input.num_pairs, repetitions);
+	for (int kind = 0; kind < KERNEL_COUNT; ++kind) {
+		if (!haversine_kernel_supported(kind)) {
+			printf("\t%-10s not supported on this cpu\n", haversine_kernels[kind][0].name);
+			continue;
+		}
+		int tier_count = kind == KERNEL_REFERENCE ? 1 : MATH_TIER_COUNT;
+		for (int tier = 0; tier < tier_count; ++tier) {
+			HaversineKernel *kernel = &haversine_kernels[kind][tier];
+
+			U64 best_ticks = (U64)-1;
+			for (int rep=0; rep < repetitions; ++rep) {
+				U64 start = read_cpu_timer();
+				run_kernel(kernel, input, 0, input.num_pairs, computed);
+				best_ticks = MIN(best_ticks, read_cpu_timer() - start);
+			}
+
+			F64 max_error = 0;
+			U64 over_epsilon = 0;
+			for (size_t i=0; i < input.num_pairs; ++i) {
+				F64 error = fabs(computed[i] - reference[i]);
+				max_error = MAX(max_error, error);
+				if (error > EPSILON) ++over_epsilon;
+			}
+
+			F64 seconds = best_ticks / (F64)cpu_freq;
+			F64 pairs_per_second = seconds > 0 ? input.num_pairs / seconds : 0;
+			printf("\t%-10s %-9s %8.2f mpairs/s  %6.2f cycles/pair  max error %.3e  over epsilon %llu\n",
+				kernel->name, kind == KERNEL_REFERENCE ? "libm" : math_tier_names[tier], pairs_per_second / 1e6,
+				best_ticks / (F64)MAX(input.num_pairs, 1), max_error, over_epsilon);
+		}
+	}
+
+	free(computed);
+	free(reference);
 	PROFILE_FUNCTION_END;
 }
-#undef EPSILON
+
+//------------------------------------------------------------------------------
+// Quantization
+//------------------------------------------------------------------------------
+// S32 columns only reach +-180 degrees, a coordinate past that (or a NaN)
+// would overflow the conversion, so it stops the run instead
+S32 quantize_degrees(F64 degrees, size_t pair_index) {
+	if (!(fabs(degrees) <= 180)) {
+		fatal("pair %zu has coordinate %f, 32 bit fixed point only holds -180 to 180 degrees", pair_index, degrees);
+	}
+	return (S32)floor(degrees * PAIRS_S32_UNITS_PER_DEGREE + 0.5);
+}
+
+// returns a copy holding only S32 columns, the F64 ones are left alone
+HaversineInput quantize_input(HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	assert(input.x0);
+	HaversineInput result = {0};
+	result.num_pairs = input.num_pairs;
+	result.qx0 = xcalloc(4*MAX(input.num_pairs, 1), sizeof(S32));
+	result.qy0 = result.qx0 + input.num_pairs;
+	result.qx1 = result.qy0 + input.num_pairs;
+	result.qy1 = result.qx1 + input.num_pairs;
+	for (size_t i=0; i < input.num_pairs; ++i) {
+		result.qx0[i] = quantize_degrees(input.x0[i], i);
+		result.qy0[i] = quantize_degrees(input.y0[i], i);
+		result.qx1[i] = quantize_degrees(input.x1[i], i);
+		result.qy1[i] = quantize_degrees(input.y1[i], i);
+	}
+	PROFILE_BLOCK_END_THROUGHPUT(input.num_pairs * 4*sizeof(F64));
+	return result;
+}
+
+// runs the kernel over the F64 and the quantized columns and reports what the
+// quantization costs in distance error and gains in throughput
+void report_quantization(HaversineKernel *kernel, HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	enum { repetitions = 5 };
+	U64 cpu_freq = estimate_cpu_freq();
+	HaversineInput quantized = quantize_input(input);
+	HaversineInput inputs[2] = { input, quantized };
+	char *names[2] = { "f64", "s32" };
+	F64 *distances[2];
+	U64 best_ticks[2];
+
+	for (int i=0; i < 2; ++i) {
+		distances[i] = xmalloc(MAX(input.num_pairs, 1) * sizeof(F64));
+		best_ticks[i] = (U64)-1;
+		for (int rep=0; rep < repetitions; ++rep) {
+			U64 start = read_cpu_timer();
+			run_kernel(kernel, inputs[i], 0, input.num_pairs, distances[i]);
+			best_ticks[i] = MIN(best_ticks[i], read_cpu_timer() - start);
+		}
+	}
+
+	F64 max_coordinate_error = 0;
+	for (size_t i=0; i < input.num_pairs; ++i) {
+		max_coordinate_error = MAX(max_coordinate_error, fabs(quantized.qx0[i]*PAIRS_S32_DEGREES_PER_UNIT - input.x0[i]));
+		max_coordinate_error = MAX(max_coordinate_error, fabs(quantized.qy0[i]*PAIRS_S32_DEGREES_PER_UNIT - input.y0[i]));
+		max_coordinate_error = MAX(max_coordinate_error, fabs(quantized.qx1[i]*PAIRS_S32_DEGREES_PER_UNIT - input.x1[i]));
+		max_coordinate_error = MAX(max_coordinate_error, fabs(quantized.qy1[i]*PAIRS_S32_DEGREES_PER_UNIT - input.y1[i]));
+	}
+
+	F64 max_error = 0;
+	F64 total_error = 0;
+	for (size_t i=0; i < input.num_pairs; ++i) {
+		F64 error = fabs(distances[1][i] - distances[0][i]);
+		max_error = MAX(max_error, error);
+		total_error += error;
+	}
+
+	printf("\nQuantization (%zu pairs, %s, best of %d):\n", 
+		input.num_pairs, kernel->label, repetitions);
+	printf("\tmax coordinate error %.3e degrees\n", max_coordinate_error);
+	printf("\tdistance error against f64: max %.3e km, mean %.3e km\n", 
+		max_error, total_error / MAX(input.num_pairs, 1));
+	for (int i=0; i < 2; ++i) {
+		F64 seconds = best_ticks[i] / (F64)cpu_freq;
+		U64 bytes = input.num_pairs * input_bytes_per_pair(inputs[i]);
+		printf("\t%s  %2llu bytes/pair  %8.3fmb  %8.2f mpairs/s  %6.2f gb/s read  %5.2fx\n",
+			names[i], input_bytes_per_pair(inputs[i]), bytes / (F64)(1024*1024),
+			seconds > 0 ? input.num_pairs / seconds / 1e6 : 0,
+			seconds > 0 ? bytes / seconds / (1024.0*1024*1024) : 0,
+			best_ticks[0] / (F64)MAX(best_ticks[i], 1));
+	}
+
+	free(distances[0]);
+	free(distances[1]);
+	free(quantized.qx0);
+	PROFILE_FUNCTION_END;
+}
+
+// the generator appends the average of all its answers after the last one
+F64 read_generated_average(char *answers_filepath) {
+	F64 average = 0;
+	FILE *f = fopen(answers_filepath, "rb");
+	if (!f || _fseeki64(f, -(S64)sizeof(F64), SEEK_END) != 0 || fread(&average, sizeof(average), 1, f) != 1) {
+		fatal("failed to read the generated average from %s", answers_filepath);
+	}
+	fclose(f);
+	return average;
+}
+
+#include "haversine_pipeline.c"
+#include "haversine_matrix.c"
+#include "haversine_index.c"
+#include "haversine_shards.c"
+#include "haversine_regenerate.c"
 
 //------------------------------------------------------------------------------
 // Entry Point
 //------------------------------------------------------------------------------
+#ifndef HAVERSINE_BENCH
+typedef struct {
+	char *input_filepath;
+	char *answers_filepath;
+	char *binary_output_filepath;
+	HaversineKernel *kernel;
+	U32 threads;
+	bool compare_kernels;
+	bool math_sweep;
+	bool thread_scaling;
+	bool pipeline;
+	bool stream;
+	bool fused;
+	bool cache;
+	bool quantize;
+	bool quantize_report;
+	bool matrix;
+	U64 matrix_rows;
+	U64 matrix_cols;
+	char *matrix_output_filepath;
+	bool spatial_index;
+	U64 index_queries;
+	F64 index_radius;
+	U32 index_k;
+	bool analytics;
+	U32 top_pairs;
+	bool regenerate;
+	bool regenerate_cluster_mode;
+	U64 regenerate_seed;
+	U64 spot_check_count;
+	char *trace_path;
+	U64 trace_events;
+	bool counters;
+} Options;
+
+void print_usage(char *program) {
+	printf("Usage: %s [options] [haversine_input.json|.bin|.manifest]\n", program);
+	printf("       %s [options] [haversine_input.json|.bin|.manifest] [answers.f64]\n", program);
+	printf("A .manifest from generate_points lists shards, which are loaded one per thread\n");
+	printf("Options:\n");
+	printf("  -write-binary <path>  convert the input to the binary pairs format\n");
+	printf("  -cache            keep the parsed json in <input>.cache and reuse it while it is current\n");
+	printf("  -quantize         store coordinates as 32 bit fixed point, also for -write-binary\n");
+	printf("  -quantize-report  compare the error and speed of quantized coordinates against f64\n");
+	printf("  -kernel <name>    reference, scalar, avx2, avx512 or auto (default) for the widest the cpu\n");
+	printf("                    supports. Nearly antipodal pairs go through libm like reference, so\n");
+	printf("                    every kernel stays within epsilon of the answers\n");
+	printf("  -tier <name>      math precision of the kernels but reference: precise, standard (default)\n");
+	printf("                    or fast, which never validates\n");
+	printf("  -threads <n>      threads to compute with, 0 for one per logical processor (default 1)\n");
+	printf("  -thread-scaling   time the compute on 1, 2, 4, ... threads\n");
+	printf("  -pipeline         stream json through overlapped read, parse and compute threads\n");
+	printf("  -stream           parse, reduce and validate json in constant memory\n");
+	printf("  -fused            run the kernel on each pair as soon as it is parsed\n");
+	printf("  -matrix <n> <m>   distances from each of the first n start points to each of the first m\n");
+	printf("                    end points instead of pair by pair, 0 for all of them\n");
+	printf("  -matrix-output <path>  also write the -matrix distances as row major f64\n");
+	printf("  -analytics        min, max, percentiles, a histogram and the longest pairs in the same pass\n");
+	printf("  -top <n>          longest pairs for -analytics to list, up to %d (default 10)\n", TOP_PAIRS_MAX);
+	printf("  -spatial-index    time radius and nearest neighbor queries of the start points against the\n");
+	printf("                    end points, through a k-d tree and by brute force\n");
+	printf("  -index-queries <n>  queries to run, 0 for one per pair (default 10000)\n");
+	printf("  -index-radius <km>  radius of the radius queries (default 100)\n");
+	printf("  -index-k <n>      neighbors to find in the nearest neighbor queries (default 8)\n");
+	printf("  -regenerate <uniform|cluster> <seed>  validate against answers made again from the mode and\n");
+	printf("                    seed the input was generated with, instead of an answers file\n");
+	printf("  -spot-check <n>   with -regenerate, compute everything but only check n random pairs\n");
+	printf("  -compare-kernels  time every supported kernel against the reference\n");
+	printf("  -math-sweep       report the error of libm and each math tier over its input\n");
+	printf("                    domain, against a double-double reference\n");
+	printf("  -trace <path>     log every profile block's begin and end, then write them out as a\n");
+	printf("                    Chrome trace to <path>.json and as folded stacks to <path>.folded\n");
+	printf("  -trace-events <n> events each thread keeps for -trace, the oldest are overwritten past\n");
+	printf("                    that (default 1048576, 16 bytes each)\n");
+	printf("  -counters         count instructions, cycles and misses in every profile block (linux perf\n");
+	printf("                    events), reported as IPC and misses per 1k instructions and per kb\n");
+	exit(1);
+}
+
+Options parse_options(int argc, char **argv) {
+	Options options = {0};
+	options.threads = 1;
+	options.index_queries = 10000;
+	options.index_radius = 100;
+	options.index_k = 8;
+	options.top_pairs = 10;
+	options.trace_events = 1 << 20;
+	char *kernel_name = "auto";
+	char *tier_name = "standard";
+
+	for (int i=1; i < argc; ++i) {
+		char *arg = argv[i];
+		if (0 == strcmp(arg, "-kernel") && i+1 < argc) {
+			kernel_name = argv[++i];
+		} else if (0 == strcmp(arg, "-tier") && i+1 < argc) {
+			tier_name = argv[++i];
+		} else if (0 == strcmp(arg, "-cache")) {
+			options.cache = true;
+		} else if (0 == strcmp(arg, "-quantize")) {
+			options.quantize = true;
+		} else if (0 == strcmp(arg, "-quantize-report")) {
+			options.quantize_report = true;
+		} else if (0 == strcmp(arg, "-write-binary") && i+1 < argc) {
+			options.binary_output_filepath = argv[++i];
+		} else if (0 == strcmp(arg, "-threads") && i+1 < argc) {
+			options.threads = atoi(argv[++i]);
+		} else if (0 == strcmp(arg, "-thread-scaling")) {
+			options.thread_scaling = true;
+		} else if (0 == strcmp(arg, "-pipeline")) {
+			options.pipeline = true;
+		} else if (0 == strcmp(arg, "-stream")) {
+			options.stream = true;
+		} else if (0 == strcmp(arg, "-fused")) {
+			options.fused = true;
+		} else if (0 == strcmp(arg, "-matrix") && i+2 < argc) {
+			options.matrix = true;
+			options.matrix_rows = strtoull(argv[++i], NULL, 10);
+			options.matrix_cols = strtoull(argv[++i], NULL, 10);
+		} else if (0 == strcmp(arg, "-matrix-output") && i+1 < argc) {
+			options.matrix_output_filepath = argv[++i];
+		} else if (0 == strcmp(arg, "-analytics")) {
+			options.analytics = true;
+		} else if (0 == strcmp(arg, "-top") && i+1 < argc) {
+			options.top_pairs = atoi(argv[++i]);
+		} else if (0 == strcmp(arg, "-spatial-index")) {
+			options.spatial_index = true;
+		} else if (0 == strcmp(arg, "-index-queries") && i+1 < argc) {
+			options.index_queries = strtoull(argv[++i], NULL, 10);
+		} else if (0 == strcmp(arg, "-index-radius") && i+1 < argc) {
+			options.index_radius = atof(argv[++i]);
+		} else if (0 == strcmp(arg, "-index-k") && i+1 < argc) {
+			options.index_k = atoi(argv[++i]);
+		} else if (0 == strcmp(arg, "-regenerate") && i+2 < argc) {
+			options.regenerate = true;
+			options.regenerate_cluster_mode = cluster_flag_from_mode_string(argv[++i]);
+			options.regenerate_seed = strtoull(argv[++i], NULL, 10);
+		} else if (0 == strcmp(arg, "-spot-check") && i+1 < argc) {
+			options.spot_check_count = strtoull(argv[++i], NULL, 10);
+		} else if (0 == strcmp(arg, "-compare-kernels")) {
+			options.compare_kernels = true;
+		} else if (0 == strcmp(arg, "-math-sweep")) {
+			options.math_sweep = true;
+		} else if (0 == strcmp(arg, "-trace") && i+1 < argc) {
+			options.trace_path = argv[++i];
+		} else if (0 == strcmp(arg, "-trace-events") && i+1 < argc) {
+			options.trace_events = strtoull(argv[++i], NULL, 10);
+		} else if (0 == strcmp(arg, "-counters")) {
+			options.counters = true;
+		} else if (arg[0] == '-') {
+			printf("Unknown option '%s'\n", arg);
+			print_usage(argv[0]);
+		} else if (!options.input_filepath) {
+			options.input_filepath = arg;
+		} else if (!options.answers_filepath) {
+			options.answers_filepath = arg;
+		} else {
+			print_usage(argv[0]);
+		}
+	}
+
+	if (!options.input_filepath) {
+		print_usage(argv[0]);
+	}
+
+	if ((options.pipeline || options.stream || options.fused) && 
+		(options.binary_output_filepath || options.thread_scaling || options.compare_kernels || options.quantize || options.quantize_report || options.matrix || options.spatial_index))
+	{
+		printf("-pipeline, -stream and -fused never hold the whole input, so they can't be used with -write-binary, -thread-scaling, -compare-kernels, -quantize, -matrix or -spatial-index\n");
+		exit(1);
+	}
+
+	if (options.analytics && (options.pipeline || options.stream || options.fused || options.matrix || options.answers_filepath)) {
+		printf("-analytics runs in the in memory compute, so it can't be used with -pipeline, -stream, -fused, -matrix or an answers file\n");
+		exit(1);
+	}
+
+	if (options.matrix_output_filepath && !options.matrix) {
+		printf("-matrix-output needs -matrix\n");
+		exit(1);
+	}
+
+	if (options.matrix && (options.quantize || options.answers_filepath)) {
+		printf("-matrix needs f64 coordinates and has no answers file, so it can't be used with -quantize or an answers file\n");
+		exit(1);
+	}
+
+	if (options.regenerate && (options.pipeline || options.stream || options.fused || options.matrix || options.analytics || options.answers_filepath)) {
+		printf("-regenerate checks the in memory compute in place of an answers file, so it can't be used with -pipeline, -stream, -fused, -matrix, -analytics or an answers file\n");
+		exit(1);
+	}
+
+	if (options.spot_check_count && !options.regenerate) {
+		printf("-spot-check needs -regenerate\n");
+		exit(1);
+	}
+
+	MathTier tier = find_math_tier(tier_name);
+	if (tier == MATH_TIER_COUNT) {
+		printf("Unknown math tier '%s'\n", tier_name);
+		exit(1);
+	}
+
+	options.kernel = find_haversine_kernel(kernel_name, tier);
+	if (!options.kernel) {
+		printf("Kernel '%s' is unknown or not supported on this cpu\n", kernel_name);
+		exit(1);
+	}
+
+	return options;
+}
+
 int main(int argc, char **argv) {
 	begin_profile();
 
 	// setup
-	if (argc < 2) {
-		printf("Usage: %s [haversine_input.json]\n", argv[0]);
-		printf("       %s [haversine_input.json] [answers.f64]\n", argv[0]);
+	Options options = parse_options(argc, argv);
+	if (options.trace_path) {
+		profile_record_events(options.trace_path, options.trace_events);
+	}
+	if (options.counters) {
+		profile_count_hardware();
+	}
+
+	bool sharded_input = is_shard_manifest(options.input_filepath);
+	if (sharded_input && (options.pipeline || options.stream || options.fused || options.cache)) {
+		printf("sharded input is loaded shard by shard into memory, so it can't be used with -pipeline, -stream, -fused or -cache\n");
 		exit(1);
 	}
-	char *input_filepath = argv[1];
-	char *answers_filepath = argc > 2 ? argv[2] : NULL;
 
-	// reading json input file
-	PROFILE_BLOCK_BEGIN("reading json input file");
-	char *file_data;
-	size_t file_size;
-	bool ok = read_entire_file(input_filepath, &file_data, &file_size);
-	if (!ok) {
-		fprintf(stderr, "error: failed to read file %s\n", input_filepath);
+	bool binary_input = !sharded_input && is_binary_input(options.input_filepath);
+	if (binary_input && (options.pipeline || options.stream || options.fused)) {
+		printf("binary input is used in place with no json to parse, so it can't be used with -pipeline, -stream or -fused\n");
 		exit(1);
 	}
-	PROFILE_BLOCK_END_THROUGHPUT(file_size);
 
-	// parsing json
-	init_parse(file_data);
-	HaversineInput input = parse_haversine_input();
+	if (options.pipeline) {
+		printf("Kernel: %s\n", options.kernel->label);
+		printf("Threads: %u compute + reader + parser\n", options.threads ? options.threads : os_logical_processor_count());
+
+		PipelineResult result = run_pipeline(options.input_filepath, options.kernel, options.threads);
+		F64 average = result.num_pairs > 0 ? result.sum / result.num_pairs : 0;
+
+		// pairs aren't kept around, so only the average can be checked
+		if (options.answers_filepath) {
+			print_validation(result.num_pairs, average, read_generated_average(options.answers_filepath));
+		} else {
+			printf("Number of pairs: %llu\n", result.num_pairs);
+			printf("Average haversine distance: %.16f\n", average);
+		}
+
+		end_profile();
+		return 0;
+	}
+
+	if (options.stream) {
+		printf("Kernel: %s\n", options.kernel->label);
+		stream_haversine(options.input_filepath, options.answers_filepath, options.kernel);
+		end_profile();
+		return 0;
+	}
+
+	if (options.fused) {
+		printf("Kernel: %s\n", options.kernel->label);
+		fused_haversine(options.input_filepath, options.answers_filepath, options.kernel);
+		end_profile();
+		return 0;
+	}
+
+	ThreadPool *pool = thread_pool_create(options.threads);
+
+	U64 startup_start = os_read_timer();
+	HaversineInput input;
+	ParseCacheKey cache_key;
+	ParseCacheStatus cache_status = PARSE_CACHE_MISSING;
+	if (sharded_input) {
+		input = load_sharded_input(pool, options.input_filepath);
+	} else if (binary_input) {
+		// binary input is used in place, there is nothing to read or parse
+		input = map_binary_input(options.input_filepath);
+	} else {
+		if (options.cache) {
+			cache_key = parse_cache_key(options.input_filepath);
+			cache_status = load_parse_cache(options.input_filepath, cache_key, &input);
+		}
+
+		// a current cache means the json is never opened
+		if (cache_status != PARSE_CACHE_HIT) {
+			// reading json input file
+			PROFILE_BLOCK_BEGIN("reading json input file");
+			char *file_data;
+			size_t file_size;
+			bool ok = read_entire_file(options.input_filepath, &file_data, &file_size);
+			if (!ok) {
+				fprintf(stderr, "error: failed to read file %s\n", options.input_filepath);
+				exit(1);
+			}
+			PROFILE_BLOCK_END_THROUGHPUT(file_size);
+
+			// parsing json
+			init_parse(file_data);
+			input = parse_haversine_input();
+
+			if (options.cache) {
+				write_parse_cache(options.input_filepath, cache_key, input);
+			}
+		}
+	}
+	if (options.cache) {
+		F64 startup_ms = 1000.0 * (os_read_timer() - startup_start) / os_timer_freq();
+		printf("Parse cache: %s\n", parse_cache_status_names[cache_status]);
+		printf("Startup: %.3f ms\n", startup_ms);
+	}
+
+	if (options.quantize_report) {
+		if (input.x0) {
+			report_quantization(options.kernel, input);
+		} else {
+			printf("-quantize-report needs f64 input, skipping it\n");
+		}
+	}
+
+	if (options.quantize && !input.qx0) {
+		input = quantize_input(input);
+	}
+
+	if (options.binary_output_filepath) {
+		write_binary_input(options.binary_output_filepath, input);
+	}
 
 	// computing haversine distances
-	if (answers_filepath) {
-		validate(answers_filepath, input);
+	printf("Kernel: %s\n", options.kernel->label);
+	printf("Threads: %u\n", pool->thread_count);
+	if (options.matrix) {
+		haversine_matrix(pool, options.kernel, input, options.matrix_rows, options.matrix_cols, options.matrix_output_filepath);
+	} else if (options.answers_filepath) {
+		validate(pool, options.answers_filepath, options.kernel, input);
+	} else if (options.regenerate) {
+		PairGenerator generator = pair_generator(options.regenerate_seed, options.regenerate_cluster_mode);
+		if (options.spot_check_count) {
+			spot_check(pool, options.kernel, input, &generator, options.spot_check_count);
+		} else {
+			validate_regenerated(pool, options.kernel, input, &generator);
+		}
 	} else {
 		PROFILE_BLOCK_BEGIN("compute haversine");
 
-		F64 sum = 0;
-		for (int i=0; i<input.num_pairs; ++i) {
-			Pair pair = input.pairs[i];
-			F64 distance = reference_haversine(pair.x0, pair.y0, pair.x1, pair.y1, EARTH_RADIUS_KM);
-			sum += distance;
+		DistanceStats *stats = NULL;
+		if (options.analytics) {
+			stats = xmalloc(sizeof(DistanceStats));
+			distance_stats_init(stats, options.top_pairs);
 		}
+
+		F64 sum = sum_haversine(pool, options.kernel, input, stats);
 		F64 average = input.num_pairs > 0 ? sum / input.num_pairs : 0;
 
 		printf("Number of pairs: %zu\n", input.num_pairs);
 		printf("Average haversine distance: %.16f\n", average);
 
-		PROFILE_BLOCK_END_THROUGHPUT(input.num_pairs * sizeof(*input.pairs));
+		PROFILE_BLOCK_END_THROUGHPUT(input.num_pairs * input_bytes_per_pair(input));
+
+		if (stats) {
+			print_distance_stats(stats, input);
+			free(stats);
+		}
+	}
+
+	thread_pool_destroy(pool);
+
+	if (options.thread_scaling) {
+		report_thread_scaling(options.kernel, input);
+	}
+
+	if (options.compare_kernels) {
+		compare_kernels(input);
+	}
+
+	if (options.spatial_index) {
+		benchmark_spatial_index(input, options.index_queries, options.index_radius, options.index_k);
+	}
+
+	if (options.math_sweep) {
+		KernelKind kind = options.kernel->kind == KERNEL_REFERENCE ? KERNEL_SCALAR : options.kernel->kind;
+		math_error_sweep(kind);
 	}
 
 	end_profile();
 	return 0;
 }
+#endif // HAVERSINE_BENCH
 
 PROFILE_TRANSLATION_UNIT_END;
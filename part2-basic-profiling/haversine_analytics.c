@@ -0,0 +1,245 @@
+//------------------------------------------------------------------------------
+// Distance analytics
+//
+// Min, max, percentiles, a histogram and the longest pairs, gathered in the
+// same sweep as the average. Every thread fills its own DistanceStats from the
+// blocks it computes while they are still in L1, and the per-thread stats are
+// merged at the end. Everything in them merges exactly, so the report doesn't
+// depend on the thread count or on which thread got which block.
+//
+// Percentiles come from a fixed-bin histogram over every distance the sphere
+// allows, so they are good to within one bin (DISTANCE_BIN_KM).
+//------------------------------------------------------------------------------
+#define DISTANCE_MAX_KM   (3.14159265358979323846 * EARTH_RADIUS_KM)
+#define DISTANCE_BIN_COUNT 2048
+#define DISTANCE_BIN_KM   (DISTANCE_MAX_KM / DISTANCE_BIN_COUNT)
+#define DISTANCE_BIN_LANES 4
+#define TOP_PAIRS_MAX     64
+
+typedef struct {
+	F64 distance;
+	U64 index;
+} TopPair;
+
+typedef struct {
+	U64 count;
+	F64 min, max;
+	U64 min_index, max_index;
+	U32 top_k;
+	U32 top_count;
+	TopPair top[TOP_PAIRS_MAX]; // min heap, the shortest of the longest on top
+	U64 bins[DISTANCE_BIN_LANES][DISTANCE_BIN_COUNT]; // summed by distance_bin_count
+} DistanceStats;
+
+void distance_stats_init(DistanceStats *stats, U32 top_k) {
+	memset(stats, 0, sizeof(*stats));
+	stats->min = DBL_MAX;
+	stats->max = -DBL_MAX;
+	stats->top_k = MIN(top_k, TOP_PAIRS_MAX);
+}
+
+// longer first, and the lower index first between equal distances so the top
+// pairs come out the same whatever order they were offered in
+static bool top_pair_before(TopPair a, TopPair b) {
+	return a.distance > b.distance || (a.distance == b.distance && a.index < b.index);
+}
+
+static void top_pairs_offer(DistanceStats *stats, TopPair pair) {
+	TopPair *heap = stats->top;
+	U32 i;
+	if (stats->top_count < stats->top_k) {
+		i = stats->top_count++;
+		while (i > 0 && top_pair_before(heap[(i-1)/2], pair)) {
+			heap[i] = heap[(i-1)/2];
+			i = (i-1)/2;
+		}
+		heap[i] = pair;
+		return;
+	}
+	if (!stats->top_k || !top_pair_before(pair, heap[0])) {
+		return;
+	}
+	i = 0;
+	for (;;) {
+		U32 child = 2*i + 1;
+		if (child >= stats->top_count) break;
+		if (child+1 < stats->top_count && top_pair_before(heap[child], heap[child+1])) {
+			++child;
+		}
+		if (!top_pair_before(pair, heap[child])) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = pair;
+}
+
+static U32 distance_bin(F64 distance) {
+	U32 bin = (U32)(S32)(distance * (DISTANCE_BIN_COUNT / DISTANCE_MAX_KM));
+	return MIN(bin, DISTANCE_BIN_COUNT - 1);
+}
+
+// pairs in the bin over all the lanes
+static U64 distance_bin_count(DistanceStats *stats, U32 bin) {
+	U64 count = 0;
+	for (U32 lane=0; lane < DISTANCE_BIN_LANES; ++lane) {
+		count += stats->bins[lane][bin];
+	}
+	return count;
+}
+
+// first is the index of the pair distances[0] belongs to
+void distance_stats_add(DistanceStats *stats, F64 *distances, U64 first, U64 count) {
+	// NOTE(shaw): neighbouring pairs often land in the same bin, and with one
+	// array each increment would wait on the store of the one before it. Every
+	// fourth pair goes to the same lane instead, so four increments are in
+	// flight, and the lanes are only summed when the bins are read.
+	U64 i = 0;
+	for (; i + DISTANCE_BIN_LANES <= count; i += DISTANCE_BIN_LANES) {
+		++stats->bins[0][distance_bin(distances[i+0])];
+		++stats->bins[1][distance_bin(distances[i+1])];
+		++stats->bins[2][distance_bin(distances[i+2])];
+		++stats->bins[3][distance_bin(distances[i+3])];
+	}
+	for (; i < count; ++i) {
+		++stats->bins[0][distance_bin(distances[i])];
+	}
+	stats->count += count;
+
+	// NOTE(shaw): a block rarely holds a new min or max or makes the top
+	// pairs, so the extremes of the block are found first, four at a time to
+	// keep the min and max latency off the critical path, and the pairs are
+	// only looked at one by one when the block does
+	F64 min0 = DBL_MAX, min1 = DBL_MAX, min2 = DBL_MAX, min3 = DBL_MAX;
+	F64 max0 = -DBL_MAX, max1 = -DBL_MAX, max2 = -DBL_MAX, max3 = -DBL_MAX;
+	for (i=0; i + 4 <= count; i += 4) {
+		min0 = MIN(min0, distances[i+0]);
+		min1 = MIN(min1, distances[i+1]);
+		min2 = MIN(min2, distances[i+2]);
+		min3 = MIN(min3, distances[i+3]);
+		max0 = MAX(max0, distances[i+0]);
+		max1 = MAX(max1, distances[i+1]);
+		max2 = MAX(max2, distances[i+2]);
+		max3 = MAX(max3, distances[i+3]);
+	}
+	for (; i < count; ++i) {
+		min0 = MIN(min0, distances[i]);
+		max0 = MAX(max0, distances[i]);
+	}
+	F64 block_min = MIN(MIN(min0, min1), MIN(min2, min3));
+	F64 block_max = MAX(MAX(max0, max1), MAX(max2, max3));
+
+	// pairs come in increasing index, so the first match has the lowest index
+	if (block_min < stats->min) {
+		i = 0;
+		while (distances[i] != block_min) ++i;
+		stats->min = block_min;
+		stats->min_index = first + i;
+	}
+	if (block_max > stats->max) {
+		i = 0;
+		while (distances[i] != block_max) ++i;
+		stats->max = block_max;
+		stats->max_index = first + i;
+	}
+	if (stats->top_k && (stats->top_count < stats->top_k || block_max > stats->top[0].distance)) {
+		for (i=0; i < count; ++i) {
+			if (stats->top_count < stats->top_k || distances[i] > stats->top[0].distance) {
+				top_pairs_offer(stats, (TopPair){ distances[i], first + i });
+			}
+		}
+	}
+}
+
+void distance_stats_merge(DistanceStats *into, DistanceStats *from) {
+	into->count += from->count;
+	for (U32 lane=0; lane < DISTANCE_BIN_LANES; ++lane) {
+		for (U32 bin=0; bin < DISTANCE_BIN_COUNT; ++bin) {
+			into->bins[lane][bin] += from->bins[lane][bin];
+		}
+	}
+	if (from->min < into->min || (from->min == into->min && from->min_index < into->min_index)) {
+		into->min = from->min;
+		into->min_index = from->min_index;
+	}
+	if (from->max > into->max || (from->max == into->max && from->max_index < into->max_index)) {
+		into->max = from->max;
+		into->max_index = from->max_index;
+	}
+	for (U32 i=0; i < from->top_count; ++i) {
+		top_pairs_offer(into, from->top[i]);
+	}
+}
+
+// interpolated within the bin the percentile falls in
+F64 distance_percentile(DistanceStats *stats, F64 percentile) {
+	if (!stats->count) return 0;
+	F64 rank = percentile / 100.0 * stats->count;
+	U64 below = 0;
+	for (U32 bin=0; bin < DISTANCE_BIN_COUNT; ++bin) {
+		U64 bin_count = distance_bin_count(stats, bin);
+		if (below + bin_count >= rank && bin_count) {
+			F64 fraction = (rank - below) / bin_count;
+			F64 distance = (bin + fraction) * DISTANCE_BIN_KM;
+			return MIN(MAX(distance, stats->min), stats->max);
+		}
+		below += bin_count;
+	}
+	return stats->max;
+}
+
+static void print_pair(HaversineInput input, U64 index, F64 distance) {
+	F64 scale = input.qx0 ? PAIRS_S32_DEGREES_PER_UNIT : 1;
+	F64 x0 = input.qx0 ? input.qx0[index] * scale : input.x0[index];
+	F64 y0 = input.qx0 ? input.qy0[index] * scale : input.y0[index];
+	F64 x1 = input.qx0 ? input.qx1[index] * scale : input.x1[index];
+	F64 y1 = input.qx0 ? input.qy1[index] * scale : input.y1[index];
+	printf("%12llu  %12.6f km  (%.6f, %.6f) -> (%.6f, %.6f)\n", index, distance, x0, y0, x1, y1);
+}
+
+void print_distance_stats(DistanceStats *stats, HaversineInput input) {
+	enum { histogram_rows = 16 };
+	static F64 percentiles[] = { 1, 10, 25, 50, 75, 90, 99, 99.9 };
+
+	printf("\nDistance analytics (%llu pairs):\n", stats->count);
+	if (!stats->count) return;
+	printf("\tmin  %12.6f km  pair %llu\n", stats->min, stats->min_index);
+	printf("\tmax  %12.6f km  pair %llu\n", stats->max, stats->max_index);
+
+	printf("\nPercentiles (within %.2f km):\n", DISTANCE_BIN_KM);
+	for (int i=0; i < ARRAY_COUNT(percentiles); ++i) {
+		printf("\tp%-5g %12.3f km\n", percentiles[i], distance_percentile(stats, percentiles[i]));
+	}
+
+	printf("\nHistogram:\n");
+	U32 bins_per_row = DISTANCE_BIN_COUNT / histogram_rows;
+	for (U32 row=0; row < histogram_rows; ++row) {
+		U64 count = 0;
+		for (U32 bin=row*bins_per_row; bin < (row+1)*bins_per_row; ++bin) {
+			count += distance_bin_count(stats, bin);
+		}
+		F64 percent = 100.0 * count / stats->count;
+		char bar[51] = {0};
+		memset(bar, '#', (size_t)(percent / 2));
+		printf("\t[%8.1f, %8.1f) km %12llu  %6.2f%%  %s\n",
+			row * bins_per_row * DISTANCE_BIN_KM, (row+1) * bins_per_row * DISTANCE_BIN_KM, count, percent, bar);
+	}
+
+	// the heap is only ordered at the top, so sort a copy longest first
+	if (stats->top_count) {
+		printf("\nLongest %u pairs:\n", stats->top_count);
+		TopPair sorted[TOP_PAIRS_MAX];
+		memcpy(sorted, stats->top, stats->top_count * sizeof(TopPair));
+		for (U32 i=1; i < stats->top_count; ++i) {
+			TopPair pair = sorted[i];
+			U32 j = i;
+			for (; j > 0 && top_pair_before(pair, sorted[j-1]); --j) {
+				sorted[j] = sorted[j-1];
+			}
+			sorted[j] = pair;
+		}
+		for (U32 i=0; i < stats->top_count; ++i) {
+			printf("\t");
+			print_pair(input, sorted[i].index, sorted[i].distance);
+		}
+	}
+}
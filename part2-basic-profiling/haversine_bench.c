@@ -0,0 +1,557 @@
+//------------------------------------------------------------------------------
+// Haversine stage benchmark
+//
+// Runs each stage of haversine.c on its own under part3's repetition tester,
+// so a stage's numbers are the best and average of many runs instead of the
+// one pass the profiler sees:
+//
+//   read      file to memory
+//   tokenize  the json lexer over the whole file
+//   parse     json text to tree (which tokenizes as it goes)
+//   pairs     tree to coordinate columns, plus the streaming parser which goes
+//             straight from text to columns
+//   compute   the average over the columns, once per kernel and math tier
+//
+// Every way of doing a stage is a contender, -stage and -only pick which run.
+// The text stages count bytes of json so their gb/s line up with each other,
+// compute counts bytes of coordinates.
+//
+// With -corpus the text stages run over a matrix of generated corpora instead
+// of a file, see Corpus matrix below.
+//------------------------------------------------------------------------------
+#define HAVERSINE_BENCH
+#include "haversine.c"
+#include "haversine_json_writer.c"
+#include "../part3-moving-data/repetition_tester.c"
+
+typedef enum {
+	STAGE_READ,
+	STAGE_TOKENIZE,
+	STAGE_PARSE,
+	STAGE_PAIRS,
+	STAGE_COMPUTE,
+	STAGE_COUNT,
+} BenchStage;
+
+char *bench_stage_names[STAGE_COUNT] = {
+	[STAGE_READ]     = "read",
+	[STAGE_TOKENIZE] = "tokenize",
+	[STAGE_PARSE]    = "parse",
+	[STAGE_PAIRS]    = "pairs",
+	[STAGE_COMPUTE]  = "compute",
+};
+
+typedef struct {
+	char *filepath;
+	char *source;      // the whole file plus a null terminator, never written
+	U64 source_size;   // without the terminator
+	char *scratch;     // the tree parser writes into its input, so each run parses a fresh copy
+	char *tree_text;   // what json was parsed from, its strings point into it
+	JsonExpr *json;    // parsed once up front, input to the tree walk
+	HaversineInput input;
+	HaversineInput quantized;
+	ThreadPool *pool;
+	HaversineKernel *kernel; // for the compute contenders
+	bool use_quantized;
+	U8 touched; // where read_map leaves the bytes it touched, so the touches aren't optimized out
+} BenchParams;
+
+typedef void BenchFunc(RepetitionTester *tester, BenchParams *params);
+
+typedef struct {
+	BenchStage stage;
+	char *name;
+	BenchFunc *func;
+	HaversineKernel *kernel;
+	bool use_quantized;
+	RepetitionTester tester;
+} BenchContender;
+
+//------------------------------------------------------------------------------
+// Read
+//------------------------------------------------------------------------------
+static void read_fread(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		FILE *file = fopen(params->filepath, "rb");
+		if (file) {
+			begin_time(tester);
+			size_t result = fread(params->scratch, params->source_size, 1, file);
+			end_time(tester);
+
+			if (result == 1) {
+				count_bytes(tester, params->source_size);
+			} else {
+				error(tester, "fread failed");
+			}
+			fclose(file);
+		} else {
+			error(tester, "fopen failed");
+		}
+	}
+}
+
+// what haversine.c does: allocate, open, read and close every time
+static void read_read_entire_file(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		char *data = NULL;
+		size_t size = 0;
+
+		begin_time(tester);
+		bool result = read_entire_file(params->filepath, &data, &size);
+		end_time(tester);
+
+		if (result && size - 1 == params->source_size) {
+			count_bytes(tester, params->source_size);
+		} else {
+			error(tester, "read_entire_file failed");
+		}
+		free(data);
+	}
+}
+
+// maps the file and touches every page so the timing includes bringing it in
+static void read_map(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		void *data = NULL;
+		U64 size = 0;
+
+		begin_time(tester);
+		bool result = os_map_file(params->filepath, &data, &size);
+		U8 touched = 0;
+		for (U64 i=0; result && i < size; i += 4096) {
+			touched ^= ((U8*)data)[i];
+		}
+		end_time(tester);
+
+		if (result && size == params->source_size) {
+			count_bytes(tester, params->source_size);
+			os_unmap_file(data, size);
+		} else {
+			error(tester, "os_map_file failed");
+		}
+		params->touched = touched;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Tokenize and parse
+//------------------------------------------------------------------------------
+static void fresh_scratch(BenchParams *params) {
+	memcpy(params->scratch, params->source, params->source_size + 1);
+}
+
+static void tokenize_lexer(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		fresh_scratch(params);
+
+		begin_time(tester);
+		init_parse(params->scratch);
+		while (*stream) {
+			next_token();
+		}
+		end_time(tester);
+
+		count_bytes(tester, params->source_size);
+	}
+}
+
+static void parse_tree(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		fresh_scratch(params);
+
+		begin_time(tester);
+		init_parse(params->scratch);
+		JsonExpr *json = parse_json();
+		end_time(tester);
+
+		count_bytes(tester, params->source_size);
+		free_json(json);
+	}
+}
+
+//------------------------------------------------------------------------------
+// Pairs
+//------------------------------------------------------------------------------
+static void pairs_tree_walk(RepetitionTester *tester, BenchParams *params) {
+	while (is_testing(tester)) {
+		begin_time(tester);
+		HaversineInput input = haversine_input_from_json(params->json);
+		end_time(tester);
+
+		if (input.num_pairs == params->input.num_pairs) {
+			count_bytes(tester, params->source_size);
+		} else {
+			error(tester, "tree walk found the wrong number of pairs");
+		}
+		free(input.x0);
+	}
+}
+
+typedef struct {
+	HaversineInput input;
+	U64 capacity;
+} PairCollector;
+
+static void collect_pair(void *user, F64 x0, F64 y0, F64 x1, F64 y1) {
+	PairCollector *collector = user;
+	U64 i = collector->input.num_pairs++;
+	if (i < collector->capacity) {
+		collector->input.x0[i] = x0;
+		collector->input.y0[i] = y0;
+		collector->input.x1[i] = x1;
+		collector->input.y1[i] = y1;
+	}
+}
+
+// text straight to columns, so this one covers tokenize and parse as well
+static void pairs_stream_parser(RepetitionTester *tester, BenchParams *params) {
+	PairStream *pair_stream = xmalloc(sizeof(PairStream));
+	while (is_testing(tester)) {
+		memset(pair_stream, 0, sizeof(PairStream));
+
+		begin_time(tester);
+		PairCollector collector = {0};
+		collector.capacity = params->input.num_pairs;
+		collector.input.x0 = xmalloc(4*MAX(collector.capacity, 1) * sizeof(F64));
+		collector.input.y0 = collector.input.x0 + collector.capacity;
+		collector.input.x1 = collector.input.y0 + collector.capacity;
+		collector.input.y1 = collector.input.x1 + collector.capacity;
+		pair_stream_parse(pair_stream, params->source, params->source_size, collect_pair, &collector);
+		pair_stream_parse(pair_stream, NULL, 0, collect_pair, &collector);
+		end_time(tester);
+
+		if (collector.input.num_pairs == params->input.num_pairs) {
+			count_bytes(tester, params->source_size);
+		} else {
+			error(tester, "stream parser found the wrong number of pairs");
+		}
+		free(collector.input.x0);
+	}
+	free(pair_stream);
+}
+
+//------------------------------------------------------------------------------
+// Compute
+//------------------------------------------------------------------------------
+static void compute_kernel(RepetitionTester *tester, BenchParams *params) {
+	HaversineInput input = params->use_quantized ? params->quantized : params->input;
+	while (is_testing(tester)) {
+		begin_time(tester);
+		sum_haversine(params->pool, params->kernel, input, NULL);
+		end_time(tester);
+
+		count_bytes(tester, input.num_pairs * input_bytes_per_pair(input));
+	}
+}
+
+//------------------------------------------------------------------------------
+// Setup
+//------------------------------------------------------------------------------
+static U64 contender_byte_count(BenchContender *contender, BenchParams *params) {
+	if (contender->stage != STAGE_COMPUTE) {
+		return params->source_size;
+	}
+	HaversineInput input = contender->use_quantized ? params->quantized : params->input;
+	return input.num_pairs * input_bytes_per_pair(input);
+}
+
+// everything the text stages start from, set up once outside of any timing,
+// source_size is without the null terminator source has to end in
+static void load_source(BenchParams *params, char *source, U64 source_size) {
+	params->source = source;
+	params->source_size = source_size;
+	params->scratch = xmalloc(source_size + 1);
+
+	// the tree's strings point into the text it was parsed from, so that gets
+	// its own copy which lives as long as the tree
+	params->tree_text = xmalloc(source_size + 1);
+	memcpy(params->tree_text, source, source_size + 1);
+	init_parse(params->tree_text);
+	params->json = parse_json();
+	params->input = haversine_input_from_json(params->json);
+}
+
+static void free_source(BenchParams *params) {
+	free(params->input.x0);
+	free_json(params->json);
+	free(params->tree_text);
+	free(params->scratch);
+}
+
+static void run_contender(BenchContender *contender, BenchParams *params, char *corpus, U64 cpu_timer_freq, U32 seconds_to_try) {
+	if (corpus) {
+		printf("\n--- %s: %s, %s ---\n", bench_stage_names[contender->stage], contender->name, corpus);
+	} else {
+		printf("\n--- %s: %s ---\n", bench_stage_names[contender->stage], contender->name);
+	}
+	params->kernel = contender->kernel;
+	params->use_quantized = contender->use_quantized;
+	new_test_wave(&contender->tester, contender_byte_count(contender, params), cpu_timer_freq, seconds_to_try);
+	contender->func(&contender->tester, params);
+}
+
+//------------------------------------------------------------------------------
+// Corpus matrix
+//
+// How fast the text stages go depends on what the json looks like as much as
+// on how much of it there is. -corpus generates the same uniform pairs as a
+// plain file, in each of haversine_json_writer.c's parser stress styles on its
+// own and in all of them at once, checks the tree parser gets the pairs back
+// from every one, and runs the text stages over each. The gb/s and mpairs/s of
+// every contender on every corpus come out as a matrix at the end.
+//------------------------------------------------------------------------------
+#define CORPUS_SEED 1
+
+static U32 corpus_styles[] = {
+	0,
+	JSON_STYLE_WHITESPACE,
+	JSON_STYLE_SHUFFLE,
+	JSON_STYLE_SCIENTIFIC,
+	JSON_STYLE_DIGITS,
+	JSON_STYLE_UNKNOWN,
+	JSON_STYLE_ESCAPES,
+	JSON_STYLE_ALL,
+};
+
+// the text of a corpus with its null terminator, and the pairs it holds
+static char *generate_corpus(PairGenerator *generator, U32 style, U64 num_pairs, U64 *size, HaversineInput *expected) {
+	char header[] = "{\"pairs\":[\n";
+	char footer[] = "\n]}";
+	char *text = xmalloc(sizeof(header) + num_pairs * json_pair_max_chars(style) + sizeof(footer));
+	char *at = text;
+	memcpy(at, header, sizeof(header) - 1);
+	at += sizeof(header) - 1;
+
+	expected->num_pairs = num_pairs;
+	expected->x0 = xmalloc(4*num_pairs * sizeof(F64));
+	expected->y0 = expected->x0 + num_pairs;
+	expected->x1 = expected->y0 + num_pairs;
+	expected->y1 = expected->x1 + num_pairs;
+	for (U64 i=0; i < num_pairs; ++i) {
+		F64 coords[PAIRS_COLUMN_COUNT];
+		generate_pair(generator, i, &coords[PAIRS_X0], &coords[PAIRS_Y0], &coords[PAIRS_X1], &coords[PAIRS_Y1]);
+		json_style_pair(style, generator->seed, i, coords);
+		at += write_json_pair(at, style, generator->seed, i, i == 0, coords);
+		expected->x0[i] = coords[PAIRS_X0];
+		expected->y0[i] = coords[PAIRS_Y0];
+		expected->x1[i] = coords[PAIRS_X1];
+		expected->y1[i] = coords[PAIRS_Y1];
+	}
+
+	memcpy(at, footer, sizeof(footer)); // with the terminator
+	at += sizeof(footer) - 1;
+	*size = at - text;
+	return xrealloc(text, *size + 1);
+}
+
+static bool same_pairs(HaversineInput a, HaversineInput b) {
+	U64 column_size = a.num_pairs * sizeof(F64);
+	return a.num_pairs == b.num_pairs &&
+		0 == memcmp(a.x0, b.x0, column_size) && 0 == memcmp(a.y0, b.y0, column_size) &&
+		0 == memcmp(a.x1, b.x1, column_size) && 0 == memcmp(a.y1, b.y1, column_size);
+}
+
+static void run_corpus_matrix(BenchContender *contenders, BenchParams *params, U32 stage_mask, char *only,
+	U64 num_pairs, U64 cpu_timer_freq, U32 seconds_to_try)
+{
+	enum { corpus_count = ARRAY_COUNT(corpus_styles) };
+	U64 contender_count = buf_lenu(contenders);
+	RepetitionTestResults *results = xcalloc(contender_count * corpus_count, sizeof(RepetitionTestResults));
+	U64 sizes[corpus_count];
+	char *names[corpus_count];
+
+	PairGenerator generator = pair_generator(CORPUS_SEED, false);
+	for (int corpus=0; corpus < corpus_count; ++corpus) {
+		U32 style = corpus_styles[corpus];
+		names[corpus] = json_style_string(style);
+
+		HaversineInput expected;
+		char *source = generate_corpus(&generator, style, num_pairs, &sizes[corpus], &expected);
+		load_source(params, source, sizes[corpus]);
+		if (!same_pairs(params->input, expected)) {
+			fatal("the %s corpus doesn't parse back to the pairs it was generated from", names[corpus]);
+		}
+		printf("\nCorpus: %s, %llu bytes, %.1f bytes per pair\n", names[corpus], sizes[corpus], (F64)sizes[corpus] / num_pairs);
+
+		for (U64 c=0; c < contender_count; ++c) {
+			BenchContender *contender = &contenders[c];
+			if (!(stage_mask & (1u << contender->stage))) continue;
+			if (only && !strstr(contender->name, only)) continue;
+			contender->tester = (RepetitionTester){0};
+			run_contender(contender, params, names[corpus], cpu_timer_freq, seconds_to_try);
+			if (contender->tester.mode == TEST_MODE_COMPLETED) {
+				results[c*corpus_count + corpus] = contender->tester.results;
+			}
+		}
+
+		free_source(params);
+		free(expected.x0);
+		free(source);
+	}
+
+	// best run of each contender on each corpus, in gb/s and then in mpairs/s
+	for (int unit=0; unit < 2; ++unit) {
+		printf("\n%-9s %-28s", unit ? "mpairs/s" : "gb/s", "Contender");
+		for (int corpus=0; corpus < corpus_count; ++corpus) {
+			printf(" %11s", names[corpus]);
+		}
+		printf("\n");
+		for (U64 c=0; c < contender_count; ++c) {
+			bool ran = false;
+			for (int corpus=0; corpus < corpus_count; ++corpus) {
+				ran |= results[c*corpus_count + corpus].test_count > 0;
+			}
+			if (!ran) continue;
+			printf("%-9s %-28s", bench_stage_names[contenders[c].stage], contenders[c].name);
+			for (int corpus=0; corpus < corpus_count; ++corpus) {
+				RepetitionTestResults result = results[c*corpus_count + corpus];
+				if (!result.test_count) {
+					printf(" %11s", "-");
+					continue;
+				}
+				F64 seconds = seconds_from_cpu_time((F64)result.time.min, cpu_timer_freq);
+				F64 value = unit ? num_pairs / seconds / 1e6 : sizes[corpus] / (seconds * 1024.0 * 1024.0 * 1024.0);
+				printf(" %11.3f", value);
+			}
+			printf("\n");
+		}
+	}
+
+	for (int corpus=0; corpus < corpus_count; ++corpus) {
+		buf_free(names[corpus]);
+	}
+	free(results);
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static void print_usage(char *program) {
+	printf("Usage: %s [options] haversine_input.json\n", program);
+	printf("       %s [options] -corpus <pairs>\n", program);
+	printf("Options:\n");
+	printf("  -stage <name>     only run this stage, can be given more than once:\n");
+	printf("                    read, tokenize, parse, pairs or compute\n");
+	printf("  -only <text>      only run contenders with this in their name\n");
+	printf("  -seconds <n>      stop a contender after this long without a new minimum (default 5)\n");
+	printf("  -threads <n>      threads for the compute stage, 0 for one per logical processor (default 1)\n");
+	printf("  -corpus <pairs>   instead of a file, run the text stages over generated corpora of this many\n");
+	printf("                    pairs in every parser stress style of generate_points, and print the\n");
+	printf("                    throughput of each contender on each corpus as a matrix\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	char *filepath = NULL;
+	char *only = NULL;
+	U32 stage_mask = 0;
+	U32 seconds_to_try = 5;
+	U32 threads = 1;
+	U64 corpus_pairs = 0;
+
+	for (int i=1; i < argc; ++i) {
+		char *arg = argv[i];
+		if (0 == strcmp(arg, "-stage") && i+1 < argc) {
+			char *name = argv[++i];
+			int stage = 0;
+			while (stage < STAGE_COUNT && strcmp(name, bench_stage_names[stage])) ++stage;
+			if (stage == STAGE_COUNT) {
+				printf("Unknown stage '%s'\n", name);
+				print_usage(argv[0]);
+			}
+			stage_mask |= 1u << stage;
+		} else if (0 == strcmp(arg, "-only") && i+1 < argc) {
+			only = argv[++i];
+		} else if (0 == strcmp(arg, "-seconds") && i+1 < argc) {
+			seconds_to_try = atoi(argv[++i]);
+		} else if (0 == strcmp(arg, "-threads") && i+1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (0 == strcmp(arg, "-corpus") && i+1 < argc) {
+			corpus_pairs = strtoull(argv[++i], NULL, 10);
+			if (!corpus_pairs) print_usage(argv[0]);
+		} else if (arg[0] == '-' || filepath) {
+			print_usage(argv[0]);
+		} else {
+			filepath = arg;
+		}
+	}
+	if (!filepath == !corpus_pairs) {
+		print_usage(argv[0]);
+	}
+	if (!stage_mask) {
+		stage_mask = (1u << STAGE_COUNT) - 1;
+	}
+	if (filepath && is_binary_input(filepath)) {
+		fatal("%s is binary, the stages start from json", filepath);
+	}
+
+	os_metrics_init();
+	U64 cpu_timer_freq = estimate_cpu_freq();
+	printf("CPU freq: %fGHz\n", (double)cpu_timer_freq / (double)(1000*1000*1000));
+
+	BUF(BenchContender *contenders) = NULL;
+	buf_push(contenders, (BenchContender){ STAGE_READ, "fread", read_fread });
+	buf_push(contenders, (BenchContender){ STAGE_READ, "read_entire_file", read_read_entire_file });
+	buf_push(contenders, (BenchContender){ STAGE_READ, "os_map_file", read_map });
+	buf_push(contenders, (BenchContender){ STAGE_TOKENIZE, "lexer", tokenize_lexer });
+	buf_push(contenders, (BenchContender){ STAGE_PARSE, "tree", parse_tree });
+	buf_push(contenders, (BenchContender){ STAGE_PAIRS, "tree walk", pairs_tree_walk });
+	buf_push(contenders, (BenchContender){ STAGE_PAIRS, "stream parser (from text)", pairs_stream_parser });
+	for (int kind=0; kind < KERNEL_COUNT; ++kind) {
+		if (!haversine_kernel_supported(kind)) continue;
+		// the reference kernel is libm whatever the tier
+		int tier_count = kind == KERNEL_REFERENCE ? 1 : MATH_TIER_COUNT;
+		for (int tier=0; tier < tier_count; ++tier) {
+			HaversineKernel *kernel = &haversine_kernels[kind][tier];
+			char *tier_name = kind == KERNEL_REFERENCE ? "libm" : math_tier_names[tier];
+			char *name = buf__printf(NULL, "%s %s", kernel->name, tier_name);
+			char *q32_name = buf__printf(NULL, "%s %s q32", kernel->name, tier_name);
+			buf_push(contenders, (BenchContender){ STAGE_COMPUTE, name, compute_kernel, kernel, false });
+			buf_push(contenders, (BenchContender){ STAGE_COMPUTE, q32_name, compute_kernel, kernel, true });
+		}
+	}
+
+	BenchParams params = { .filepath = filepath };
+	params.pool = thread_pool_create(threads);
+
+	if (corpus_pairs) {
+		// reading and computing don't care what the text looks like
+		stage_mask &= (1u << STAGE_TOKENIZE) | (1u << STAGE_PARSE) | (1u << STAGE_PAIRS);
+		printf("Corpus matrix: %llu pairs per corpus\n", corpus_pairs);
+		run_corpus_matrix(contenders, &params, stage_mask, only, corpus_pairs, cpu_timer_freq, seconds_to_try);
+		thread_pool_destroy(params.pool);
+		return 0;
+	}
+
+	char *source;
+	size_t source_size = 0;
+	if (!read_entire_file(filepath, &source, &source_size)) {
+		fatal("failed to read %s", filepath);
+	}
+	load_source(&params, source, source_size - 1);
+	params.quantized = quantize_input(params.input);
+	printf("Input: %s, %llu bytes, %zu pairs\n", filepath, params.source_size, params.input.num_pairs);
+	printf("Threads: %u\n", params.pool->thread_count);
+
+	for (BenchContender *contender = contenders; contender != buf_end(contenders); ++contender) {
+		if (!(stage_mask & (1u << contender->stage))) continue;
+		if (only && !strstr(contender->name, only)) continue;
+		run_contender(contender, &params, NULL, cpu_timer_freq, seconds_to_try);
+	}
+
+	printf("\n%-9s %-28s %10s %10s %10s %8s\n", "Stage", "Contender", "min ms", "avg ms", "gb/s", "runs");
+	for (BenchContender *contender = contenders; contender != buf_end(contenders); ++contender) {
+		RepetitionTestResults results = contender->tester.results;
+		if (contender->tester.mode != TEST_MODE_COMPLETED || !results.test_count) continue;
+		F64 min_seconds = seconds_from_cpu_time((F64)results.time.min, cpu_timer_freq);
+		F64 avg_seconds = seconds_from_cpu_time((F64)results.time.total / results.test_count, cpu_timer_freq);
+		F64 gigabyte = 1024.0 * 1024.0 * 1024.0;
+		printf("%-9s %-28s %10.3f %10.3f %10.3f %8llu\n",
+			bench_stage_names[contender->stage], contender->name, min_seconds * 1000, avg_seconds * 1000,
+			contender_byte_count(contender, &params) / (gigabyte * min_seconds), results.test_count);
+	}
+
+	thread_pool_destroy(params.pool);
+	return 0;
+}
@@ -0,0 +1,203 @@
+//------------------------------------------------------------------------------
+// Pair generator
+//
+// Shared by generate_points.c, which writes the pairs out, and haversine.c,
+// which makes any pair again from the mode, the seed and its index to check
+// answers without the .f64 file. Expects common.c to be included first.
+//------------------------------------------------------------------------------
+F64 lerp_f64(F64 min, F64 max, F64 t) {
+	return min + t * (max-min);
+}
+
+
+//------------------------------------------------------------------------------
+// Counter-based random numbers
+//
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+// Each output is a pure function of the seed and a counter, so the random
+// numbers of pair i are the same no matter which thread makes them or how many
+// pairs were made before. The counter is the pair index, which block of the
+// pair's draws this is, and a stream number keeping the clusters' draws apart
+// from the pairs'.
+//------------------------------------------------------------------------------
+enum {
+	RANDOM_STREAM_PAIRS,
+	RANDOM_STREAM_CLUSTERS,
+	RANDOM_STREAM_SAMPLES, // haversine.c picking pairs to spot check
+	RANDOM_STREAM_STYLE,   // how haversine_json_writer.c dresses pairs up
+};
+
+typedef struct {
+	U32 v[4];
+} Philox4x32;
+
+Philox4x32 philox4x32(U64 seed, U64 index, U32 block, U32 stream) {
+	U32 c0 = (U32)index, c1 = (U32)(index >> 32), c2 = block, c3 = stream;
+	U32 k0 = (U32)seed, k1 = (U32)(seed >> 32);
+	for (int round=0; round < 10; ++round) {
+		U64 p0 = (U64)0xD2511F53 * c0;
+		U64 p1 = (U64)0xCD9E8D57 * c2;
+		U32 n0 = (U32)(p1 >> 32) ^ c1 ^ k0;
+		U32 n2 = (U32)(p0 >> 32) ^ c3 ^ k1;
+		c1 = (U32)p1;
+		c3 = (U32)p0;
+		c0 = n0;
+		c2 = n2;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+	return (Philox4x32){{ c0, c1, c2, c3 }};
+}
+
+// the top 53 bits of a and b as a float in [0, 1)
+static F64 random_unit(U32 a, U32 b) {
+	U64 bits = ((U64)a << 32) | b;
+	return (bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// returns a random float from min to max, max exclusive
+F64 random_f64(U32 a, U32 b, F64 min, F64 max) {
+	return lerp_f64(min, max, random_unit(a, b));
+}
+
+
+// min is inclusive, max is exclusive
+typedef struct {
+	F64 x_min, x_max, y_min, y_max;
+} Cluster;
+
+typedef struct {
+	Cluster *clusters;
+	int count;
+	int cap;
+} ClusterArray;
+
+Cluster cluster_create(F64 x_min, F64 x_max, F64 y_min, F64 y_max) {
+	return (Cluster){ 
+		.x_min = x_min, .x_max = x_max, 
+		.y_min = y_min, .y_max = y_max
+	};
+}
+
+void cluster_append(ClusterArray *clusters, Cluster cluster) {
+	if (clusters->count + 1 >= clusters->cap) {
+		// resize
+		clusters->cap = clusters->cap == 0 ? 2 : 2 * clusters->cap;
+		size_t new_size = clusters->cap * sizeof(Cluster);
+		clusters->clusters = xrealloc(clusters->clusters, new_size);
+	}
+	clusters->clusters[clusters->count++] = cluster;
+}
+
+// r is a random 32 bit number, scaled to the cluster count rather than taken
+// modulo it so no cluster is favored
+Cluster choose_cluster(ClusterArray clusters, U32 r) {
+	U64 i = ((U64)r * (U64)clusters.count) >> 32;
+	return clusters.clusters[i];
+}
+
+// the divisions come from their own stream of the seed, so every thread that
+// asks gets the same clusters
+ClusterArray generate_clusters(U64 seed) {
+	ClusterArray result = {0};
+	F64 x = -180, y = -90;
+	U64 draw = 0;
+	enum {
+		max_x_divisions = 12,
+		max_y_divisions = 7,
+	};
+
+	// maximum step in x and y
+	F64 x_step = 60; 
+	F64 y_step = 60;
+
+	// get x divisions
+	F64 x_divisions[max_x_divisions] = {-180};
+	int x_division_count = 1;
+	for (; x_division_count < max_x_divisions-1; ++x_division_count) {
+		Philox4x32 r = philox4x32(seed, draw++, 0, RANDOM_STREAM_CLUSTERS);
+		x += random_f64(r.v[0], r.v[1], 1, x_step);
+		if (x > 180) x = 180;
+		x_divisions[x_division_count] = x;
+		if (x == 180) break;
+	}
+	if (x < 180) {
+		assert(x_division_count < max_x_divisions);
+		x_divisions[x_division_count++] = 180;
+	}
+
+	// get y divisions
+	F64 y_divisions[max_y_divisions] = {-90};
+	int y_division_count = 1;
+	for (; y_division_count < max_y_divisions-1; ++y_division_count) {
+		Philox4x32 r = philox4x32(seed, draw++, 0, RANDOM_STREAM_CLUSTERS);
+		y += random_f64(r.v[0], r.v[1], 1, y_step);
+		if (y > 90) y = 90;
+		y_divisions[y_division_count] = y;
+		if (y == 90) break;
+	}
+	if (y < 90) {
+		assert(y_division_count < max_y_divisions);
+		y_divisions[y_division_count++] = 90;
+	}
+
+	for (int j = 0; j < y_division_count - 1; ++j) {
+		F64 y_min = y_divisions[j];
+		F64 y_max = y_divisions[j+1];
+		for (int i = 0; i < x_division_count - 1; ++i) {
+			F64 x_min = x_divisions[i];
+			F64 x_max = x_divisions[i+1];
+			cluster_append(&result, cluster_create(x_min, x_max, y_min, y_max));
+		}
+	}
+
+	return result;
+}
+
+bool cluster_flag_from_mode_string(char *mode) {
+	bool cluster;
+	enum { max_mode_chars = 16 };
+	if (0 == strncmp(mode, "cluster", max_mode_chars)) {
+		cluster = true;
+	} else if (0 == strncmp(mode, "uniform", max_mode_chars)) {
+		cluster = false;
+	} else {
+		printf("Mode argument must be uniform or cluster, got '%s'\n", mode);
+		exit(1);
+	}
+	return cluster;
+}
+
+
+typedef struct {
+	U64 seed;
+	bool cluster_mode;
+	ClusterArray clusters;
+} PairGenerator;
+
+PairGenerator pair_generator(U64 seed, bool cluster_mode) {
+	PairGenerator generator = {0};
+	generator.seed = seed;
+	generator.cluster_mode = cluster_mode;
+	generator.clusters = generate_clusters(seed);
+	return generator;
+}
+
+// pair index of the dataset the generator describes, wherever it is asked for
+void generate_pair(PairGenerator *generator, U64 index, F64 *x0, F64 *y0, F64 *x1, F64 *y1) {
+	Philox4x32 r0 = philox4x32(generator->seed, index, 0, RANDOM_STREAM_PAIRS);
+	Philox4x32 r1 = philox4x32(generator->seed, index, 1, RANDOM_STREAM_PAIRS);
+	if (generator->cluster_mode) {
+		Philox4x32 r2 = philox4x32(generator->seed, index, 2, RANDOM_STREAM_PAIRS);
+		Cluster cluster = choose_cluster(generator->clusters, r2.v[0]);
+		*x0 = random_f64(r0.v[0], r0.v[1], cluster.x_min, cluster.x_max);
+		*y0 = random_f64(r0.v[2], r0.v[3], cluster.y_min, cluster.y_max);
+		*x1 = random_f64(r1.v[0], r1.v[1], cluster.x_min, cluster.x_max);
+		*y1 = random_f64(r1.v[2], r1.v[3], cluster.y_min, cluster.y_max);
+	} else {
+		*x0 = random_f64(r0.v[0], r0.v[1], -180, 180);
+		*y0 = random_f64(r0.v[2], r0.v[3], -90, 90);
+		*x1 = random_f64(r1.v[0], r1.v[1], -180, 180);
+		*y1 = random_f64(r1.v[2], r1.v[3], -90, 90);
+	}
+}
@@ -0,0 +1,448 @@
+//------------------------------------------------------------------------------
+// Spatial index
+//
+// A k-d tree over the points as unit vectors in 3D. The straight line (chord)
+// between two points on the sphere grows with the distance along it, so a
+// haversine radius turns into a chord radius, and a box of the tree whose
+// splitting plane is further away than that can't hold anything closer. The
+// exact distance of whatever survives the pruning is still reference_haversine
+// so answers match a brute force scan.
+//
+// The tree is built in place over one array of points: each node splits its
+// range at the median of the axis it spreads furthest along, down to leaves of
+// at most KD_LEAF_SIZE points.
+//------------------------------------------------------------------------------
+#define KD_LEAF_SIZE 16
+
+// NOTE(shaw): chord bounds are widened by this much so the rounding in the
+// unit vectors can never prune a point that reference_haversine would keep
+#define KD_CHORD_SLACK 1e-9
+
+typedef struct {
+	F64 p[3];   // unit vector
+	F64 lon, lat;
+	U32 index;  // into the input
+} KdPoint;
+
+typedef struct {
+	U32 begin, end;
+	U32 left, right; // 0 for a leaf, the root is never anyone's child
+	U32 axis;
+	F64 split;
+} KdNode;
+
+typedef struct {
+	KdPoint *points;
+	BUF(KdNode *nodes);
+	U64 count;
+} KdTree;
+
+typedef struct {
+	F64 distance;
+	U32 index;
+} Neighbor;
+
+static void unit_vector(F64 lon, F64 lat, F64 *p) {
+	F64 lon_rad = radians_from_degrees(lon);
+	F64 lat_rad = radians_from_degrees(lat);
+	p[0] = cos(lat_rad) * cos(lon_rad);
+	p[1] = cos(lat_rad) * sin(lon_rad);
+	p[2] = sin(lat_rad);
+}
+
+// squared chord between two points whose haversine distance is distance_km
+static F64 chord_bound_sq(F64 distance_km) {
+	F64 angle = MIN(distance_km / EARTH_RADIUS_KM, 3.14159265358979323846);
+	F64 chord = 2.0 * sin(0.5 * angle) * (1.0 + KD_CHORD_SLACK) + KD_CHORD_SLACK;
+	return chord * chord;
+}
+
+static void kd_swap(KdPoint *a, KdPoint *b) {
+	KdPoint t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// partially sorts points[begin, end) on axis so that nth holds the median.
+// Keys equal to the pivot are gathered between the smaller and the larger
+// ones, so repeated locations settle in one pass rather than one at a time.
+static void kd_select(KdPoint *points, U32 begin, U32 end, U32 nth, U32 axis) {
+	while (end - begin > 1) {
+		F64 pivot = points[begin + (end - begin) / 2].p[axis];
+		// [begin, lt) below the pivot, [lt, i) equal to it, [gt, end) above it
+		U32 lt = begin;
+		U32 gt = end;
+		for (U32 i=begin; i < gt;) {
+			F64 key = points[i].p[axis];
+			if (key < pivot) {
+				kd_swap(&points[i++], &points[lt++]);
+			} else if (key > pivot) {
+				kd_swap(&points[i], &points[--gt]);
+			} else {
+				++i;
+			}
+		}
+		if (nth < lt) {
+			end = lt;
+		} else if (nth >= gt) {
+			begin = gt;
+		} else {
+			return;
+		}
+	}
+}
+
+static U32 kd_build_node(KdTree *tree, U32 begin, U32 end) {
+	U32 node_index = buf_len(tree->nodes);
+	buf_push(tree->nodes, (KdNode){ .begin = begin, .end = end });
+	if (end - begin <= KD_LEAF_SIZE) {
+		return node_index;
+	}
+
+	F64 lo[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+	F64 hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+	for (U32 i=begin; i < end; ++i) {
+		for (int a=0; a < 3; ++a) {
+			lo[a] = MIN(lo[a], tree->points[i].p[a]);
+			hi[a] = MAX(hi[a], tree->points[i].p[a]);
+		}
+	}
+	U32 axis = 0;
+	for (U32 a=1; a < 3; ++a) {
+		if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+	}
+
+	U32 mid = begin + (end - begin) / 2;
+	kd_select(tree->points, begin, end, mid, axis);
+	F64 split = tree->points[mid].p[axis];
+
+	// NOTE(shaw): the node is only written back once the children are built
+	// since buf_push can move the nodes, and the split is read before since
+	// building the children reorders the points
+	U32 left = kd_build_node(tree, begin, mid);
+	U32 right = kd_build_node(tree, mid, end);
+	KdNode *node = &tree->nodes[node_index];
+	node->axis = axis;
+	node->split = split;
+	node->left = left;
+	node->right = right;
+	return node_index;
+}
+
+// indexes the x1/y1 end points of the input
+KdTree kd_tree_build(HaversineInput input) {
+	PROFILE_FUNCTION_BEGIN;
+	KdTree tree = {0};
+	tree.count = input.num_pairs;
+	if (tree.count > UINT32_MAX) {
+		fatal("the spatial index holds at most %u points", UINT32_MAX);
+	}
+	tree.points = xmalloc(MAX(tree.count, 1) * sizeof(KdPoint));
+	for (U64 i=0; i < tree.count; ++i) {
+		KdPoint *point = &tree.points[i];
+		point->lon = input.x1 ? input.x1[i] : input.qx1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+		point->lat = input.y1 ? input.y1[i] : input.qy1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+		point->index = (U32)i;
+		unit_vector(point->lon, point->lat, point->p);
+	}
+	if (tree.count) {
+		kd_build_node(&tree, 0, (U32)tree.count);
+	}
+	PROFILE_BLOCK_END_THROUGHPUT(tree.count * sizeof(KdPoint));
+	return tree;
+}
+
+void kd_tree_free(KdTree *tree) {
+	free(tree->points);
+	buf_free(tree->nodes);
+}
+
+//---------------------------------------------------------------------------
+// Radius queries
+//---------------------------------------------------------------------------
+typedef struct {
+	KdTree *tree;
+	F64 q[3];
+	F64 lon, lat;
+	F64 radius_km;
+	F64 bound_sq;
+	BUF(Neighbor *results);
+} RadiusQuery;
+
+static void kd_radius_node(RadiusQuery *query, U32 node_index) {
+	KdNode *node = &query->tree->nodes[node_index];
+	if (!node->left) {
+		for (U32 i=node->begin; i < node->end; ++i) {
+			KdPoint *point = &query->tree->points[i];
+			F64 distance = reference_haversine(query->lon, query->lat, point->lon, point->lat, EARTH_RADIUS_KM);
+			if (distance <= query->radius_km) {
+				buf_push(query->results, (Neighbor){ distance, point->index });
+			}
+		}
+		return;
+	}
+
+	F64 offset = query->q[node->axis] - node->split;
+	U32 near = offset < 0 ? node->left : node->right;
+	U32 far  = offset < 0 ? node->right : node->left;
+	kd_radius_node(query, near);
+	if (offset*offset <= query->bound_sq) {
+		kd_radius_node(query, far);
+	}
+}
+
+// appends every indexed point within radius_km of (lon, lat) to results, in
+// no particular order, and returns the new results buffer
+Neighbor *kd_tree_radius(KdTree *tree, F64 lon, F64 lat, F64 radius_km, BUF(Neighbor *results)) {
+	RadiusQuery query = { .tree = tree, .lon = lon, .lat = lat, .radius_km = radius_km, .results = results };
+	unit_vector(lon, lat, query.q);
+	query.bound_sq = chord_bound_sq(radius_km);
+	if (tree->count) {
+		kd_radius_node(&query, 0);
+	}
+	return query.results;
+}
+
+Neighbor *brute_force_radius(HaversineInput input, F64 lon, F64 lat, F64 radius_km, BUF(Neighbor *results)) {
+	for (U64 i=0; i < input.num_pairs; ++i) {
+		F64 x1 = input.x1 ? input.x1[i] : input.qx1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+		F64 y1 = input.y1 ? input.y1[i] : input.qy1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+		F64 distance = reference_haversine(lon, lat, x1, y1, EARTH_RADIUS_KM);
+		if (distance <= radius_km) {
+			buf_push(results, (Neighbor){ distance, (U32)i });
+		}
+	}
+	return results;
+}
+
+//---------------------------------------------------------------------------
+// Nearest neighbor queries
+//
+// The k best so far are kept in a max heap on distance, so the worst of them,
+// which sets how far the search still has to look, is always at the top.
+//---------------------------------------------------------------------------
+typedef struct {
+	Neighbor *heap;
+	U32 count;
+	U32 k;
+} NeighborHeap;
+
+static bool neighbor_worse(Neighbor a, Neighbor b) {
+	return a.distance > b.distance || (a.distance == b.distance && a.index > b.index);
+}
+
+static void neighbor_heap_offer(NeighborHeap *heap, Neighbor candidate) {
+	U32 i;
+	if (heap->count < heap->k) {
+		i = heap->count++;
+		while (i > 0 && neighbor_worse(candidate, heap->heap[(i-1)/2])) {
+			heap->heap[i] = heap->heap[(i-1)/2];
+			i = (i-1)/2;
+		}
+		heap->heap[i] = candidate;
+		return;
+	}
+	if (!neighbor_worse(heap->heap[0], candidate)) {
+		return;
+	}
+	i = 0;
+	for (;;) {
+		U32 child = 2*i + 1;
+		if (child >= heap->count) break;
+		if (child+1 < heap->count && neighbor_worse(heap->heap[child+1], heap->heap[child])) {
+			++child;
+		}
+		if (!neighbor_worse(heap->heap[child], candidate)) break;
+		heap->heap[i] = heap->heap[child];
+		i = child;
+	}
+	heap->heap[i] = candidate;
+}
+
+// sorts the heap nearest first
+static void neighbor_heap_sort(NeighborHeap *heap) {
+	for (U32 i=1; i < heap->count; ++i) {
+		Neighbor n = heap->heap[i];
+		U32 j = i;
+		for (; j > 0 && neighbor_worse(heap->heap[j-1], n); --j) {
+			heap->heap[j] = heap->heap[j-1];
+		}
+		heap->heap[j] = n;
+	}
+}
+
+typedef struct {
+	KdTree *tree;
+	F64 q[3];
+	F64 lon, lat;
+	NeighborHeap heap;
+	F64 bound_sq;
+} KnnQuery;
+
+static void kd_knn_node(KnnQuery *query, U32 node_index) {
+	KdNode *node = &query->tree->nodes[node_index];
+	if (!node->left) {
+		for (U32 i=node->begin; i < node->end; ++i) {
+			KdPoint *point = &query->tree->points[i];
+			F64 distance = reference_haversine(query->lon, query->lat, point->lon, point->lat, EARTH_RADIUS_KM);
+			neighbor_heap_offer(&query->heap, (Neighbor){ distance, point->index });
+		}
+		if (query->heap.count == query->heap.k) {
+			query->bound_sq = chord_bound_sq(query->heap.heap[0].distance);
+		}
+		return;
+	}
+
+	F64 offset = query->q[node->axis] - node->split;
+	U32 near = offset < 0 ? node->left : node->right;
+	U32 far  = offset < 0 ? node->right : node->left;
+	kd_knn_node(query, near);
+	if (offset*offset <= query->bound_sq) {
+		kd_knn_node(query, far);
+	}
+}
+
+// fills neighbors, which has room for k, nearest first and returns how many
+// were found (fewer than k only when the index holds fewer points)
+U32 kd_tree_knn(KdTree *tree, F64 lon, F64 lat, U32 k, Neighbor *neighbors) {
+	KnnQuery query = { .tree = tree, .lon = lon, .lat = lat, .bound_sq = DBL_MAX };
+	query.heap = (NeighborHeap){ .heap = neighbors, .k = k };
+	unit_vector(lon, lat, query.q);
+	if (tree->count && k) {
+		kd_knn_node(&query, 0);
+	}
+	neighbor_heap_sort(&query.heap);
+	return query.heap.count;
+}
+
+U32 brute_force_knn(HaversineInput input, F64 lon, F64 lat, U32 k, Neighbor *neighbors) {
+	NeighborHeap heap = { .heap = neighbors, .k = k };
+	if (k) {
+		for (U64 i=0; i < input.num_pairs; ++i) {
+			F64 x1 = input.x1 ? input.x1[i] : input.qx1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+			F64 y1 = input.y1 ? input.y1[i] : input.qy1[i] * PAIRS_S32_DEGREES_PER_UNIT;
+			neighbor_heap_offer(&heap, (Neighbor){ reference_haversine(lon, lat, x1, y1, EARTH_RADIUS_KM), (U32)i });
+		}
+	}
+	neighbor_heap_sort(&heap);
+	return heap.count;
+}
+
+//---------------------------------------------------------------------------
+// Query benchmark
+//
+// The x0/y0 start points are the queries and the x1/y1 end points are what is
+// indexed. Brute force only runs the first few queries since each one scans
+// every point, and those are checked against the index for the same answers.
+//---------------------------------------------------------------------------
+#define BRUTE_FORCE_QUERY_COUNT 64
+
+static bool neighbors_match(Neighbor *a, U32 a_count, Neighbor *b, U32 b_count) {
+	if (a_count != b_count) return false;
+	for (U32 i=0; i < a_count; ++i) {
+		if (a[i].index != b[i].index || a[i].distance != b[i].distance) return false;
+	}
+	return true;
+}
+
+static int compare_neighbor_index(const void *a, const void *b) {
+	U32 ia = ((Neighbor*)a)->index;
+	U32 ib = ((Neighbor*)b)->index;
+	return (ia > ib) - (ia < ib);
+}
+
+static F64 query_lon(HaversineInput input, U64 i) {
+	return input.x0 ? input.x0[i] : input.qx0[i] * PAIRS_S32_DEGREES_PER_UNIT;
+}
+
+static F64 query_lat(HaversineInput input, U64 i) {
+	return input.y0 ? input.y0[i] : input.qy0[i] * PAIRS_S32_DEGREES_PER_UNIT;
+}
+
+void benchmark_spatial_index(HaversineInput input, U64 query_count, F64 radius_km, U32 k) {
+	PROFILE_FUNCTION_BEGIN;
+	query_count = query_count ? MIN(query_count, input.num_pairs) : input.num_pairs;
+	U64 brute_count = MIN(query_count, BRUTE_FORCE_QUERY_COUNT);
+	F64 freq = (F64)estimate_cpu_freq();
+
+	U64 start = read_cpu_timer();
+	KdTree tree = kd_tree_build(input);
+	F64 build_seconds = (read_cpu_timer() - start) / freq;
+	printf("Spatial index: %llu points, %u nodes, built in %.3f ms\n",
+		tree.count, buf_len(tree.nodes), build_seconds * 1000);
+
+	// radius queries
+	BUF(Neighbor *found) = NULL;
+	U64 found_total = 0;
+	start = read_cpu_timer();
+	for (U64 i=0; i < query_count; ++i) {
+		buf_clear(found);
+		found = kd_tree_radius(&tree, query_lon(input, i), query_lat(input, i), radius_km, found);
+		found_total += buf_len(found);
+	}
+	F64 index_seconds = (read_cpu_timer() - start) / freq;
+
+	BUF(Neighbor *expected) = NULL;
+	U64 mismatches = 0;
+	U64 brute_ticks = 0;
+	for (U64 i=0; i < brute_count; ++i) {
+		buf_clear(expected);
+		start = read_cpu_timer();
+		expected = brute_force_radius(input, query_lon(input, i), query_lat(input, i), radius_km, expected);
+		brute_ticks += read_cpu_timer() - start;
+
+		buf_clear(found);
+		found = kd_tree_radius(&tree, query_lon(input, i), query_lat(input, i), radius_km, found);
+		if (buf_len(found) > 1) {
+			qsort(found, buf_len(found), sizeof(Neighbor), compare_neighbor_index);
+		}
+		if (!neighbors_match(found, buf_len(found), expected, buf_len(expected))) {
+			++mismatches;
+		}
+	}
+	F64 brute_seconds = brute_ticks / freq;
+
+	printf("\nRadius %.1f km, %llu queries, %.1f results per query:\n", radius_km, query_count, query_count ? (F64)found_total / query_count : 0);
+	printf("  index        %12.1f queries/s\n", query_count / index_seconds);
+	printf("  brute force  %12.1f queries/s  (%.0fx slower)\n", brute_count / brute_seconds,
+		(brute_seconds / brute_count) / (index_seconds / query_count));
+	printf("  %llu of the first %llu queries differ from brute force\n", mismatches, brute_count);
+
+	// nearest neighbor queries
+	Neighbor *neighbors = xmalloc(MAX(k, 1) * sizeof(Neighbor));
+	Neighbor *expected_neighbors = xmalloc(MAX(k, 1) * sizeof(Neighbor));
+	F64 nearest_total = 0;
+	start = read_cpu_timer();
+	for (U64 i=0; i < query_count; ++i) {
+		U32 n = kd_tree_knn(&tree, query_lon(input, i), query_lat(input, i), k, neighbors);
+		if (n) nearest_total += neighbors[n-1].distance;
+	}
+	index_seconds = (read_cpu_timer() - start) / freq;
+
+	mismatches = 0;
+	brute_ticks = 0;
+	for (U64 i=0; i < brute_count; ++i) {
+		start = read_cpu_timer();
+		U32 expected_n = brute_force_knn(input, query_lon(input, i), query_lat(input, i), k, expected_neighbors);
+		brute_ticks += read_cpu_timer() - start;
+
+		U32 n = kd_tree_knn(&tree, query_lon(input, i), query_lat(input, i), k, neighbors);
+		if (!neighbors_match(neighbors, n, expected_neighbors, expected_n)) {
+			++mismatches;
+		}
+	}
+	brute_seconds = brute_ticks / freq;
+
+	printf("\n%u nearest, %llu queries, %.1f km to the furthest on average:\n", k, query_count, query_count ? nearest_total / query_count : 0);
+	printf("  index        %12.1f queries/s\n", query_count / index_seconds);
+	printf("  brute force  %12.1f queries/s  (%.0fx slower)\n", brute_count / brute_seconds,
+		(brute_seconds / brute_count) / (index_seconds / query_count));
+	printf("  %llu of the first %llu queries differ from brute force\n", mismatches, brute_count);
+
+	free(neighbors);
+	free(expected_neighbors);
+	buf_free(found);
+	buf_free(expected);
+	kd_tree_free(&tree);
+	PROFILE_FUNCTION_END;
+}
@@ -0,0 +1,438 @@
+//------------------------------------------------------------------------------
+// JSON pair writer
+//
+// Shared by generate_points.c, which writes the pairs out, and
+// haversine_bench.c, which makes its corpus matrix in memory. Expects
+// haversine_generator.c to be included first.
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Float formatting
+//
+// printf("%.16f") works the digits out with arbitrary precision arithmetic and
+// was most of the generator's time. The coordinates are all under 1000 in
+// magnitude, so x * 10^digits fits in 64 bits and can be worked out exactly
+// with one 64 x 64 -> 128 bit multiply and a shift, rounded half to even the
+// way printf rounds.
+//
+// NOTE(shaw): 16 decimals is 17 or more significant digits from 1 up, which is
+// enough for strtod to give back the same double. Below 1 the leading zeros
+// eat into that, so those get as many decimals as 17 significant digits need,
+// down to 1e-40, far below the smallest coordinate the generator can make.
+// Exponent notation is left to the scientific style below.
+//------------------------------------------------------------------------------
+#define FORMAT_F64_DECIMALS      16
+#define FORMAT_F64_SIGNIFICANT   17
+#define FORMAT_F64_MAX_CHARS     64
+
+static U64 pow10_u64[] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+	100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+	10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+	100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+// a * b as hi:lo
+static U64 mul_u64(U64 a, U64 b, U64 *hi) {
+	U64 a_lo = (U32)a, a_hi = a >> 32;
+	U64 b_lo = (U32)b, b_hi = b >> 32;
+	U64 lo_lo = a_lo * b_lo;
+	U64 hi_lo = a_hi * b_lo;
+	U64 lo_hi = a_lo * b_hi;
+	U64 cross = (lo_lo >> 32) + (U32)hi_lo + lo_hi;
+	*hi = a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+	return (cross << 32) | (U32)lo_lo;
+}
+
+static char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// the low count digits of value, zero padded
+static void write_digits(char *dest, U64 value, int count) {
+	char *at = dest + count;
+	while (at - dest >= 2) {
+		at -= 2;
+		memcpy(at, digit_pairs + 2*(value % 100), 2);
+		value /= 100;
+	}
+	if (at > dest) {
+		*--at = '0' + (char)(value % 10);
+	}
+}
+
+// writes value in fixed notation, not null terminated, and returns the length
+int format_f64_fixed(char *dest, F64 value) {
+	U64 bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bool negative = bits >> 63;
+	F64 magnitude = negative ? -value : value;
+
+	// the thresholds sit a hair over each power of ten, so a magnitude right on
+	// one can only get a decimal too many, never one too few
+	int decimals = FORMAT_F64_DECIMALS;
+	if (magnitude < 1 && magnitude != 0) {
+		int leading_zeros = 0;
+		F64 threshold = 0.1 * (1 + 1e-15);
+		while (magnitude < threshold && leading_zeros < 40) {
+			threshold *= 0.1;
+			++leading_zeros;
+		}
+		decimals = FORMAT_F64_SIGNIFICANT + leading_zeros;
+	}
+
+	int exponent = (int)((bits >> 52) & 0x7FF);
+	if (magnitude != 0 && (magnitude >= 1000 || decimals >= ARRAY_COUNT(pow10_u64) || exponent == 0)) {
+		return snprintf(dest, FORMAT_F64_MAX_CHARS, "%.*f", decimals, value);
+	}
+
+	// magnitude is mantissa / 2^shift, and 42 <= shift < 64 in this range
+	U64 scaled = 0;
+	if (magnitude != 0) {
+		U64 mantissa = (bits & ((1ull << 52) - 1)) | (1ull << 52);
+		int shift = 1075 - exponent;
+		U64 hi;
+		U64 lo = mul_u64(mantissa, pow10_u64[decimals], &hi);
+		scaled = (hi << (64 - shift)) | (lo >> shift);
+		U64 remainder = lo & ((1ull << shift) - 1);
+		U64 half = 1ull << (shift - 1);
+		if (remainder > half || (remainder == half && (scaled & 1))) {
+			++scaled;
+		}
+	}
+
+	// NOTE(shaw): dividing by a constant is a multiply, by a variable it's a
+	// divide instruction, so the usual 16 decimals get their own path
+	U64 whole, fraction;
+	if (decimals == FORMAT_F64_DECIMALS) {
+		whole = scaled / 10000000000000000ull;
+		fraction = scaled % 10000000000000000ull;
+	} else {
+		whole = scaled / pow10_u64[decimals];
+		fraction = scaled % pow10_u64[decimals];
+	}
+
+	char *at = dest;
+	if (negative) *at++ = '-';
+	int whole_digits = whole >= 1000 ? 4 : whole >= 100 ? 3 : whole >= 10 ? 2 : 1;
+	write_digits(at, whole, whole_digits);
+	at += whole_digits;
+	*at++ = '.';
+	if (decimals == FORMAT_F64_DECIMALS) {
+		// two independent halves so their divide chains overlap
+		write_digits(at, fraction / 100000000, 8);
+		write_digits(at + 8, fraction % 100000000, 8);
+	} else {
+		write_digits(at, fraction, decimals);
+	}
+	at += decimals;
+	return (int)(at - dest);
+}
+
+
+//------------------------------------------------------------------------------
+// Parser stress styles
+//
+// Plain output is one fixed layout, so a parser benchmarked on it only ever
+// takes one side of each branch. The styles shake the text up in the ways real
+// JSON differs, each on its own so its cost can be told apart:
+//
+//   whitespace   random runs of spaces, tabs and newlines around every token,
+//                now and then long enough to cross a 16 or 32 byte block
+//   shuffle      the keys of every object in a random order
+//   scientific   about half the numbers in exponent notation
+//   digits       every coordinate rounded to 1 to 15 significant digits, or
+//                left at full precision, so number lengths vary
+//   unknown      extra keys, some one letter off a coordinate key, holding
+//                numbers, strings, arrays and objects the parser has to skip
+//   escapes      a string in every object full of escapes and of braces,
+//                brackets and commas a parser mustn't take for structure
+//
+// Every choice is drawn from the pair's own stream of the seed, so a styled
+// file comes out the same whatever the thread count, like a plain one.
+//
+// NOTE(shaw): digits is the one style that changes the pairs themselves, the
+// binary output and the answers hold the rounded coordinates, so -regenerate
+// in haversine.c can only check files generated without it
+//------------------------------------------------------------------------------
+enum {
+	JSON_STYLE_WHITESPACE = 1 << 0,
+	JSON_STYLE_SHUFFLE    = 1 << 1,
+	JSON_STYLE_SCIENTIFIC = 1 << 2,
+	JSON_STYLE_DIGITS     = 1 << 3,
+	JSON_STYLE_UNKNOWN    = 1 << 4,
+	JSON_STYLE_ESCAPES    = 1 << 5,
+	JSON_STYLE_COUNT      = 6,
+	JSON_STYLE_ALL        = (1 << JSON_STYLE_COUNT) - 1,
+};
+
+char *json_style_names[JSON_STYLE_COUNT] = {
+	"whitespace", "shuffle", "scientific", "digits", "unknown", "escapes",
+};
+
+// the most a plain pair can take, and a styled one
+#define JSON_PLAIN_PAIR_MAX_CHARS   (3 + 4*(7 + FORMAT_F64_MAX_CHARS))
+#define JSON_STYLED_PAIR_MAX_CHARS  2048
+
+// plain, all, or a comma separated list of style names
+U32 json_style_from_string(char *list) {
+	if (0 == strcmp(list, "plain")) return 0;
+	if (0 == strcmp(list, "all")) return JSON_STYLE_ALL;
+	U32 style = 0;
+	for (char *at = list; *at; ) {
+		U64 length = strcspn(at, ",");
+		int i = 0;
+		while (i < JSON_STYLE_COUNT && (strlen(json_style_names[i]) != length || strncmp(at, json_style_names[i], length))) ++i;
+		if (i == JSON_STYLE_COUNT) {
+			printf("Style must be plain, all or a list of whitespace, shuffle, scientific, digits, unknown and escapes, got '%s'\n", list);
+			exit(1);
+		}
+		style |= 1u << i;
+		at += length;
+		if (*at == ',') ++at;
+	}
+	return style;
+}
+
+// the names of the styles in style joined by commas, a BUF
+char *json_style_string(U32 style) {
+	if (style == 0) return buf__printf(NULL, "plain");
+	if (style == JSON_STYLE_ALL) return buf__printf(NULL, "all");
+	char *result = NULL;
+	for (int i=0; i < JSON_STYLE_COUNT; ++i) {
+		if (style & (1u << i)) {
+			result = buf__printf(result, "%s%s", result ? "," : "", json_style_names[i]);
+		}
+	}
+	return result;
+}
+
+U64 json_pair_max_chars(U32 style) {
+	return style ? JSON_STYLED_PAIR_MAX_CHARS : JSON_PLAIN_PAIR_MAX_CHARS;
+}
+
+// the pair's stream of style draws, four at a time, block 0 is kept for the
+// digit counts so they can be drawn again on their own
+typedef struct {
+	U64 seed;
+	U64 index;
+	U32 block;
+	U32 used;
+	Philox4x32 r;
+} StyleRandom;
+
+static U32 style_random(StyleRandom *random) {
+	if (random->used == 4) {
+		random->r = philox4x32(random->seed, random->index, random->block++, RANDOM_STREAM_STYLE);
+		random->used = 0;
+	}
+	return random->r.v[random->used++];
+}
+
+// from 0 to n, n exclusive
+static U32 style_random_below(StyleRandom *random, U32 n) {
+	return (U32)(((U64)style_random(random) * n) >> 32);
+}
+
+#define STYLE_FULL_DIGITS 16
+
+// significant digits of each coordinate of the pair, from 1 to 15, or
+// STYLE_FULL_DIGITS for as many as it takes to give the double back exactly
+// NOTE(shaw): up to 15 the shortest text is the digits the value was rounded
+// to whatever way it's printed, beyond that it might not be
+static void json_style_digits(U64 seed, U64 index, int digits[PAIRS_COLUMN_COUNT]) {
+	Philox4x32 r = philox4x32(seed, index, 0, RANDOM_STREAM_STYLE);
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		digits[column] = 1 + (int)(((U64)r.v[column] * STYLE_FULL_DIGITS) >> 32);
+	}
+}
+
+// rounds the pair to its digit counts when the style has digits, call it on
+// every pair between generating it and using it
+void json_style_pair(U32 style, U64 seed, U64 index, F64 coords[PAIRS_COLUMN_COUNT]) {
+	if (!(style & JSON_STYLE_DIGITS)) return;
+	int digits[PAIRS_COLUMN_COUNT];
+	json_style_digits(seed, index, digits);
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		if (digits[column] < STYLE_FULL_DIGITS) {
+			char text[FORMAT_F64_MAX_CHARS];
+			snprintf(text, sizeof(text), "%.*e", digits[column] - 1, coords[column]);
+			coords[column] = strtod(text, NULL);
+		}
+	}
+}
+
+static char *write_style_space(char *at, StyleRandom *random, U32 style, char *plain) {
+	if (!(style & JSON_STYLE_WHITESPACE)) {
+		U64 length = strlen(plain);
+		memcpy(at, plain, length);
+		return at + length;
+	}
+	static char spaces[4] = { ' ', '\t', '\n', '\r' };
+	U32 r = style_random(random);
+	U32 count = (r & 15) == 0 ? 8 + ((r >> 4) & 15) : (r >> 4) & 3;
+	r >>= 8;
+	for (U32 i=0; i < count; ++i) {
+		if (i % 12 == 0 && i) r = style_random(random);
+		*at++ = spaces[r & 3];
+		r >>= 2;
+	}
+	return at;
+}
+
+static char *write_style_number(char *at, StyleRandom *random, U32 style, F64 value, int digits) {
+	bool scientific = (style & JSON_STYLE_SCIENTIFIC) && (style_random(random) & 1);
+	char *start = at;
+	if (digits == STYLE_FULL_DIGITS) {
+		if (scientific) {
+			at += snprintf(at, FORMAT_F64_MAX_CHARS, "%.16e", value);
+		} else {
+			at += format_f64_fixed(at, value);
+		}
+	} else {
+		char text[FORMAT_F64_MAX_CHARS];
+		snprintf(text, sizeof(text), "%.*e", digits - 1, value);
+		if (scientific) {
+			at += snprintf(at, FORMAT_F64_MAX_CHARS, "%s", text);
+		} else {
+			int exponent = atoi(strchr(text, 'e') + 1);
+			int decimals = MAX(0, digits - 1 - exponent);
+			at += snprintf(at, FORMAT_F64_MAX_CHARS, "%.*f", decimals, value);
+		}
+	}
+	if (scientific && (style_random(random) & 1)) {
+		*strchr(start, 'e') = 'E';
+	}
+	return at;
+}
+
+static char *write_unknown_value(char *at, StyleRandom *random) {
+	static char *words[] = { "a", "label", "unknown", "pair of points", "x0", "}]{[" };
+	switch (style_random_below(random, 5)) {
+		case 0:
+			at += sprintf(at, "%u", style_random(random) % 1000000);
+			break;
+		case 1: {
+			U32 a = style_random(random);
+			U32 b = style_random(random);
+			at += sprintf(at, "%.6f", random_f64(a, b, -1000, 1000));
+		} break;
+		case 2:
+			at += sprintf(at, "\"%s\"", words[style_random_below(random, ARRAY_COUNT(words))]);
+			break;
+		case 3: {
+			U32 count = style_random_below(random, 4);
+			*at++ = '[';
+			for (U32 i=0; i < count; ++i) {
+				at += sprintf(at, "%s%u", i ? ", " : "", style_random(random) % 1000);
+			}
+			*at++ = ']';
+		} break;
+		default: {
+			U32 id = style_random(random) % 1000;
+			char *word = words[style_random_below(random, ARRAY_COUNT(words))];
+			at += sprintf(at, "{\"id\": %u, \"tags\": [\"%s\"], \"x0\": {}}", id, word);
+		} break;
+	}
+	return at;
+}
+
+static char *write_escaped_string(char *at, StyleRandom *random) {
+	static char *pieces[] = {
+		"text", " ", "\\\"", "\\\\", "\\/", "\\n", "\\t", "\\r", "\\b", "\\f",
+		"\\u00e9", "\\u2603", "\\ud83d\\ude00", "}", "{", "]", "[", ",", ":",
+	};
+	U32 count = 4 + style_random_below(random, 9);
+	*at++ = '"';
+	for (U32 i=0; i < count; ++i) {
+		char *piece = pieces[style_random_below(random, ARRAY_COUNT(pieces))];
+		U64 length = strlen(piece);
+		memcpy(at, piece, length);
+		at += length;
+	}
+	*at++ = '"';
+	return at;
+}
+
+// writes pair index of a file, with the separator before it unless it's the
+// first, not null terminated, and returns the length
+int write_json_pair(char *dest, U32 style, U64 seed, U64 index, bool first, F64 coords[PAIRS_COLUMN_COUNT]) {
+	char *at = dest;
+	if (!style) {
+		if (!first) {
+			*at++ = ',';
+			*at++ = '\n';
+		}
+		memcpy(at, "\t{\"x0\":", 7);   at += 7;
+		at += format_f64_fixed(at, coords[PAIRS_X0]);
+		memcpy(at, ", \"y0\":", 7);    at += 7;
+		at += format_f64_fixed(at, coords[PAIRS_Y0]);
+		memcpy(at, ", \"x1\":", 7);    at += 7;
+		at += format_f64_fixed(at, coords[PAIRS_X1]);
+		memcpy(at, ", \"y1\":", 7);    at += 7;
+		at += format_f64_fixed(at, coords[PAIRS_Y1]);
+		*at++ = '}';
+		return (int)(at - dest);
+	}
+
+	static char *coordinate_keys[PAIRS_COLUMN_COUNT] = { "x0", "y0", "x1", "y1" };
+	static char *unknown_keys[] = { "x", "y", "x00", "y10", "x0_", "X0", "xy", "id", "name", "meta" };
+	enum { member_unknown = PAIRS_COLUMN_COUNT, member_escapes, max_members = PAIRS_COLUMN_COUNT + 4 };
+
+	StyleRandom random = { seed, index, 1, 4 };
+	int digits[PAIRS_COLUMN_COUNT] = { STYLE_FULL_DIGITS, STYLE_FULL_DIGITS, STYLE_FULL_DIGITS, STYLE_FULL_DIGITS };
+	if (style & JSON_STYLE_DIGITS) {
+		json_style_digits(seed, index, digits);
+	}
+
+	// the coordinates, then whatever else the style puts in the object
+	int members[max_members];
+	int member_count = 0;
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		members[member_count++] = column;
+	}
+	if (style & JSON_STYLE_UNKNOWN) {
+		U32 count = 1 + style_random_below(&random, 3);
+		for (U32 i=0; i < count; ++i) {
+			members[member_count++] = member_unknown;
+		}
+	}
+	if (style & JSON_STYLE_ESCAPES) {
+		members[member_count++] = member_escapes;
+	}
+	if (style & JSON_STYLE_SHUFFLE) {
+		for (int i=member_count-1; i > 0; --i) {
+			int j = (int)style_random_below(&random, i + 1);
+			int swap = members[i];
+			members[i] = members[j];
+			members[j] = swap;
+		}
+	}
+
+	if (!first) *at++ = ',';
+	at = write_style_space(at, &random, style, first ? "\t" : "\n\t");
+	*at++ = '{';
+	for (int i=0; i < member_count; ++i) {
+		if (i) *at++ = ',';
+		at = write_style_space(at, &random, style, i ? " " : "");
+		int member = members[i];
+		char *key = member < PAIRS_COLUMN_COUNT ? coordinate_keys[member] :
+			member == member_escapes ? "note" : unknown_keys[style_random_below(&random, ARRAY_COUNT(unknown_keys))];
+		at += sprintf(at, "\"%s\"", key);
+		at = write_style_space(at, &random, style, "");
+		*at++ = ':';
+		at = write_style_space(at, &random, style, "");
+		if (member < PAIRS_COLUMN_COUNT) {
+			at = write_style_number(at, &random, style, coords[member], digits[member]);
+		} else if (member == member_unknown) {
+			at = write_unknown_value(at, &random);
+		} else {
+			at = write_escaped_string(at, &random);
+		}
+	}
+	at = write_style_space(at, &random, style, "");
+	*at++ = '}';
+	assert(at - dest <= JSON_STYLED_PAIR_MAX_CHARS);
+	return (int)(at - dest);
+}
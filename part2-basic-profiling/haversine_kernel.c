@@ -0,0 +1,655 @@
+#if !_MSC_VER
+#include <cpuid.h>
+#endif
+
+//------------------------------------------------------------------------------
+// from LISTING 65 - Reference Haversine Distance Formula
+//------------------------------------------------------------------------------
+static F64 square(F64 a) {
+	return a*a;
+}
+
+static F64 radians_from_degrees(F64 degrees) {
+	return 0.01745329251994329577f * degrees;
+}
+
+// NOTE(casey): earth_radius is generally expected to be 6372.8
+static F64 reference_haversine(F64 x0, F64 y0, F64 x1, F64 y1, F64 earth_radius)
+{
+	/* NOTE(casey): This is not meant to be a "good" way to calculate the Haversine distance.
+	   Instead, it attempts to follow, as closely as possible, the formula used in the real-world
+	   question on which these homework exercises are loosely based.
+	*/
+
+	F64 lat1 = y0;
+	F64 lat2 = y1;
+	F64 lon1 = x0;
+	F64 lon2 = x1;
+
+	F64 dLat = radians_from_degrees(lat2 - lat1);
+	F64 dLon = radians_from_degrees(lon2 - lon1);
+	lat1 = radians_from_degrees(lat1);
+	lat2 = radians_from_degrees(lat2);
+
+	F64 a = square(sin(dLat/2.0)) + cos(lat1)*cos(lat2)*square(sin(dLon/2));
+	F64 c = 2.0*asin(sqrt(a));
+
+	F64 result = earth_radius * c;
+
+	return result;
+}
+
+//------------------------------------------------------------------------------
+// Kernels
+//------------------------------------------------------------------------------
+// A kernel computes the distance of count pairs given as separate x0, y0, x1,
+// y1 columns and writes them to distances.
+typedef void HaversineKernelFunc(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances);
+
+static void reference_haversine_kernel(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances) {
+	for (U64 i=0; i < count; ++i) {
+		distances[i] = reference_haversine(x0[i], y0[i], x1[i], y1[i], EARTH_RADIUS_KM);
+	}
+}
+
+// Same again for coordinates quantized to PAIRS_S32_UNITS_PER_DEGREE, which
+// are turned back into degrees as they are loaded.
+typedef void HaversineKernelQ32Func(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances);
+
+static void reference_haversine_kernel_q32(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances) {
+	F64 scale = PAIRS_S32_DEGREES_PER_UNIT;
+	for (U64 i=0; i < count; ++i) {
+		distances[i] = reference_haversine(x0[i]*scale, y0[i]*scale, x1[i]*scale, y1[i]*scale, EARTH_RADIUS_KM);
+	}
+}
+
+typedef enum {
+	MATH_TIER_PRECISE,
+	MATH_TIER_STANDARD,
+	MATH_TIER_FAST,
+
+	MATH_TIER_COUNT
+} MathTier;
+
+char *math_tier_names[MATH_TIER_COUNT] = {
+	[MATH_TIER_PRECISE]  = "precise",
+	[MATH_TIER_STANDARD] = "standard",
+	[MATH_TIER_FAST]     = "fast",
+};
+
+typedef enum {
+	MATH_FUNC_SIN,
+	MATH_FUNC_COS,
+	MATH_FUNC_ASIN,
+	MATH_FUNC_SQRT,
+
+	MATH_FUNC_COUNT
+} MathFunc;
+
+#if _MSC_VER
+	#pragma STDC FP_CONTRACT OFF
+	#define FORCE_INLINE __forceinline
+	#define TARGET_SCALAR
+	#define TARGET_AVX2
+	#define TARGET_AVX512
+#else
+	// gcc would otherwise fuse the mul and add intrinsics of the haversine
+	// formula into fmas, which no longer rounds like reference_haversine. The
+	// scalar code needs it as much once -mfma or -march lets gcc fuse plain
+	// arithmetic, and the double-double code breaks outright, its error terms
+	// are only exact when every product is rounded on its own.
+	#define FORCE_INLINE inline __attribute__((always_inline))
+	#define TARGET_SCALAR __attribute__((optimize("fp-contract=off")))
+	#define TARGET_AVX2   __attribute__((target("avx2,fma"), optimize("fp-contract=off")))
+	#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+
+// Per point terms for the distance matrix, see haversine_matrix.c. The arrays
+// are padded with zeros to a multiple of MATRIX_TILE_COLS points.
+#define MATRIX_TILE_COLS 256
+
+typedef struct {
+	F64 *sin_half_lat;
+	F64 *cos_half_lat;
+	F64 *sin_half_lon;
+	F64 *cos_half_lon;
+	F64 *cos_lat;
+	U64 count;
+} MatrixPoints;
+
+// the matrix tile of the reference kernel, the same per point terms as the
+// others with libm's sqrt and asin for each distance
+static void reference_haversine_matrix_tile(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out) {
+	for (U64 r=0; r < row_count; ++r) {
+		U64 row = row_begin + r;
+		F64 *out_row = out + r*MATRIX_TILE_COLS;
+		for (U64 c=0; c < MATRIX_TILE_COLS; ++c) {
+			U64 col = col_begin + c;
+			F64 sin_dlat = cols->sin_half_lat[col]*rows->cos_half_lat[row] - cols->cos_half_lat[col]*rows->sin_half_lat[row];
+			F64 sin_dlon = cols->sin_half_lon[col]*rows->cos_half_lon[row] - cols->cos_half_lon[col]*rows->sin_half_lon[row];
+			F64 cos_lat = rows->cos_lat[row]*cols->cos_lat[col];
+			F64 a = MIN(square(sin_dlat) + cos_lat*square(sin_dlon), 1.0); // rounding can push antipodal points just over
+			out_row[c] = 2.0*EARTH_RADIUS_KM*asin(sqrt(a));
+		}
+	}
+}
+
+#define V(name) V_(name, V_SUFFIX)
+#define V_(name, suffix) V__(name, suffix)
+#define V__(name, suffix) name##suffix
+
+static F64 trunc32_f64(F64 a) {
+	U64 bits;
+	memcpy(&bits, &a, sizeof(bits));
+	bits &= 0xffffffff00000000ull;
+	memcpy(&a, &bits, sizeof(a));
+	return a;
+}
+
+// Dekker's product, exact a*b - p without needing an fma instruction
+static TARGET_SCALAR F64 mul_err_f64(F64 a, F64 b, F64 p) {
+	F64 split = 134217729.0; // 2^27 + 1
+	F64 ta = split*a;
+	F64 a_hi = ta - (ta - a);
+	F64 a_lo = a - a_hi;
+	F64 tb = split*b;
+	F64 b_hi = tb - (tb - b);
+	F64 b_lo = b - b_hi;
+	return ((a_hi*b_hi - p) + a_hi*b_lo + a_lo*b_hi) + a_lo*b_lo;
+}
+
+// keeps only the exponent, so 2^floor(log2(|a|)) for normal numbers
+static F64 exponent_f64(F64 a) {
+	U64 bits;
+	memcpy(&bits, &a, sizeof(bits));
+	bits &= 0x7ff0000000000000ull;
+	memcpy(&a, &bits, sizeof(a));
+	return a;
+}
+
+static F64 rsqrt_f64(F64 a) {
+	return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((F32)a)));
+}
+
+//------------------------------------------------------------------------------
+// Double-Double Reference
+//------------------------------------------------------------------------------
+// sin, cos, asin and sqrt to around 2^-100 relative, independent of libm's
+// rounding. Far too slow for the kernels, the error sweep measures against it
+// and the precise tier falls back to it for results it can't round itself.
+typedef struct {
+	F64 hi, lo;
+} DoubleDouble;
+
+static TARGET_SCALAR DoubleDouble dd_two_sum(F64 a, F64 b) {
+	F64 s = a + b;
+	F64 bb = s - a;
+	return (DoubleDouble){s, (a - (s - bb)) + (b - bb)};
+}
+
+// requires |a| >= |b|
+static TARGET_SCALAR DoubleDouble dd_fast_two_sum(F64 a, F64 b) {
+	F64 s = a + b;
+	return (DoubleDouble){s, b - (s - a)};
+}
+
+static TARGET_SCALAR DoubleDouble dd_add(DoubleDouble a, DoubleDouble b) {
+	DoubleDouble s = dd_two_sum(a.hi, b.hi);
+	DoubleDouble t = dd_two_sum(a.lo, b.lo);
+	s = dd_fast_two_sum(s.hi, s.lo + t.hi);
+	return dd_fast_two_sum(s.hi, s.lo + t.lo);
+}
+
+static TARGET_SCALAR DoubleDouble dd_mul(DoubleDouble a, DoubleDouble b) {
+	F64 p = a.hi*b.hi;
+	F64 e = mul_err_f64(a.hi, b.hi, p) + (a.hi*b.lo + a.lo*b.hi);
+	return dd_fast_two_sum(p, e);
+}
+
+static TARGET_SCALAR DoubleDouble dd_div_f64(DoubleDouble a, F64 b) {
+	F64 q = a.hi / b;
+	F64 p = q*b;
+	F64 r = ((a.hi - p) - mul_err_f64(q, b, p) + a.lo) / b;
+	return dd_fast_two_sum(q, r);
+}
+
+static TARGET_SCALAR DoubleDouble dd_neg(DoubleDouble a) {
+	return (DoubleDouble){-a.hi, -a.lo};
+}
+
+static TARGET_SCALAR DoubleDouble dd_sqrt(F64 x) {
+	F64 s = sqrt(x);
+	if (!(s > 0)) return (DoubleDouble){s, 0};
+	F64 p = s*s;
+	return dd_fast_two_sum(s, ((x - p) - mul_err_f64(s, s, p)) / (s + s));
+}
+
+// Taylor series on x reduced by pi/2, for |x| <= pi. shift = 1 gives cos.
+static TARGET_SCALAR DoubleDouble dd_sin_quadrant(F64 x, int shift) {
+	F64 k = round(x * 6.36619772367581382433e-01);
+	DoubleDouble r = dd_two_sum(x - k*1.5707963267948966, -k*6.123233995736766e-17);
+	r = dd_fast_two_sum(r.hi, r.lo + k*1.4973849048591698e-33);
+	DoubleDouble z = dd_mul(r, r);
+	DoubleDouble one = {1.0, 0};
+
+	int quadrant = ((int)k + shift) & 3;
+	DoubleDouble p = one;
+	if (quadrant & 1) {
+		for (int n = 14; n > 0; --n) {
+			p = dd_add(one, dd_neg(dd_div_f64(dd_mul(z, p), (2*n - 1)*(2*n))));
+		}
+	} else {
+		for (int n = 14; n > 0; --n) {
+			p = dd_add(one, dd_neg(dd_div_f64(dd_mul(z, p), (2*n)*(2*n + 1))));
+		}
+		p = dd_mul(p, r);
+	}
+	return quadrant & 2 ? dd_neg(p) : p;
+}
+
+// one newton step on libm's asin, good while tan(asin(x)) stays small
+static TARGET_SCALAR DoubleDouble dd_asin_newton(F64 x) {
+	F64 y = asin(x);
+	DoubleDouble s = dd_sin_quadrant(y, 0);
+	// x - s.hi is exact, they are within a few ulps
+	return dd_fast_two_sum(y, ((x - s.hi) - s.lo) / cos(y));
+}
+
+// 0 <= x <= 1
+static TARGET_SCALAR DoubleDouble dd_asin(F64 x) {
+	if (x < 0.5) return dd_asin_newton(x);
+
+	// asin(x) = pi/2 - 2*asin(s), s = sqrt((1-x)/2). the low part of s is
+	// small enough to go through the derivative.
+	DoubleDouble s = dd_sqrt((1.0 - x)*0.5);
+	DoubleDouble a = dd_asin_newton(s.hi);
+	a = dd_fast_two_sum(a.hi, a.lo + s.lo / sqrt(1.0 - s.hi*s.hi));
+	DoubleDouble pio2 = {1.5707963267948966, 6.123233995736766e-17};
+	return dd_add(pio2, (DoubleDouble){-2.0*a.hi, -2.0*a.lo});
+}
+
+TARGET_SCALAR DoubleDouble math_reference(MathFunc func, F64 x) {
+	DoubleDouble result;
+	switch (func) {
+		case MATH_FUNC_SIN:  result = dd_sin_quadrant(x, 0); break;
+		case MATH_FUNC_COS:  result = dd_sin_quadrant(x, 1); break;
+		case MATH_FUNC_ASIN: result = dd_asin(x);            break;
+		default:             result = dd_sqrt(x);            break;
+	}
+	return result;
+}
+
+// scalar
+#define Vec                F64
+#define VMask              bool
+#define LANES              1
+#define TARGET             TARGET_SCALAR
+#define V_SUFFIX           _scalar
+#define v_set1(a)          ((F64)(a))
+#define v_load(p)          (*(p))
+#define v_store(p, a)      (*(p) = (a))
+#define v_load_s32(p)      ((F64)*(p))
+#define v_add(a, b)        ((a) + (b))
+#define v_sub(a, b)        ((a) - (b))
+#define v_mul(a, b)        ((a) * (b))
+#define v_div(a, b)        ((a) / (b))
+#define v_fma(a, b, c)     ((a)*(b) + (c))
+#define v_mul_err(a, b, p) mul_err_f64(a, b, p)
+#define v_sqrt(a)          sqrt(a)
+#define v_rsqrt(a)         rsqrt_f64(a)
+#define v_round(a)         (((a) + 6755399441055744.0) - 6755399441055744.0) // 1.5*2^52
+#define v_trunc32(a)       trunc32_f64(a)
+#define v_abs(a)           fabs(a)
+#define v_exponent(a)      exponent_f64(a)
+#define v_lt(a, b)         ((a) < (b))
+#define v_select(m, a, b)  ((m) ? (a) : (b))
+#define v_any(m)           (m)
+#include "haversine_math.c"
+#include "haversine_simd.c"
+#undef Vec
+#undef VMask
+#undef LANES
+#undef TARGET
+#undef V_SUFFIX
+#undef v_set1
+#undef v_load
+#undef v_store
+#undef v_load_s32
+#undef v_add
+#undef v_sub
+#undef v_mul
+#undef v_div
+#undef v_fma
+#undef v_mul_err
+#undef v_sqrt
+#undef v_rsqrt
+#undef v_round
+#undef v_trunc32
+#undef v_abs
+#undef v_exponent
+#undef v_lt
+#undef v_select
+#undef v_any
+
+// AVX2
+#define Vec                __m256d
+#define VMask              __m256d
+#define LANES              4
+#define TARGET             TARGET_AVX2
+#define V_SUFFIX           _avx2
+#define v_set1(a)          _mm256_set1_pd(a)
+#define v_load(p)          _mm256_loadu_pd(p)
+#define v_store(p, a)      _mm256_storeu_pd(p, a)
+#define v_load_s32(p)      _mm256_cvtepi32_pd(_mm_loadu_si128((__m128i *)(p)))
+#define v_add(a, b)        _mm256_add_pd(a, b)
+#define v_sub(a, b)        _mm256_sub_pd(a, b)
+#define v_mul(a, b)        _mm256_mul_pd(a, b)
+#define v_div(a, b)        _mm256_div_pd(a, b)
+#define v_fma(a, b, c)     _mm256_fmadd_pd(a, b, c)
+#define v_mul_err(a, b, p) _mm256_fmsub_pd(a, b, p)
+#define v_sqrt(a)          _mm256_sqrt_pd(a)
+#define v_rsqrt(a)         _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(a)))
+#define v_round(a)         _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC)
+#define v_trunc32(a)       _mm256_and_pd(a, _mm256_castsi256_pd(_mm256_set1_epi64x(0xffffffff00000000ll)))
+#define v_abs(a)           _mm256_and_pd(a, _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffll)))
+#define v_exponent(a)      _mm256_and_pd(a, _mm256_castsi256_pd(_mm256_set1_epi64x(0x7ff0000000000000ll)))
+#define v_lt(a, b)         _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define v_select(m, a, b)  _mm256_blendv_pd(b, a, m)
+#define v_any(m)           (_mm256_movemask_pd(m) != 0)
+#include "haversine_math.c"
+#include "haversine_simd.c"
+#undef Vec
+#undef VMask
+#undef LANES
+#undef TARGET
+#undef V_SUFFIX
+#undef v_set1
+#undef v_load
+#undef v_store
+#undef v_load_s32
+#undef v_add
+#undef v_sub
+#undef v_mul
+#undef v_div
+#undef v_fma
+#undef v_mul_err
+#undef v_sqrt
+#undef v_rsqrt
+#undef v_round
+#undef v_trunc32
+#undef v_abs
+#undef v_exponent
+#undef v_lt
+#undef v_select
+#undef v_any
+
+// AVX-512
+#define Vec                __m512d
+#define VMask              __mmask8
+#define LANES              8
+#define TARGET             TARGET_AVX512
+#define V_SUFFIX           _avx512
+#define v_set1(a)          _mm512_set1_pd(a)
+#define v_load(p)          _mm512_loadu_pd(p)
+#define v_store(p, a)      _mm512_storeu_pd(p, a)
+#define v_load_s32(p)      _mm512_cvtepi32_pd(_mm256_loadu_si256((__m256i *)(p)))
+#define v_add(a, b)        _mm512_add_pd(a, b)
+#define v_sub(a, b)        _mm512_sub_pd(a, b)
+#define v_mul(a, b)        _mm512_mul_pd(a, b)
+#define v_div(a, b)        _mm512_div_pd(a, b)
+#define v_fma(a, b, c)     _mm512_fmadd_pd(a, b, c)
+#define v_mul_err(a, b, p) _mm512_fmsub_pd(a, b, p)
+#define v_sqrt(a)          _mm512_sqrt_pd(a)
+#define v_rsqrt(a)         _mm512_rsqrt14_pd(a)
+#define v_round(a)         _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC)
+#define v_trunc32(a)       _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0xffffffff00000000ll)))
+#define v_abs(a)           _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x7fffffffffffffffll)))
+#define v_exponent(a)      _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x7ff0000000000000ll)))
+#define v_lt(a, b)         _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#define v_select(m, a, b)  _mm512_mask_blend_pd(m, b, a)
+#define v_any(m)           ((m) != 0)
+#include "haversine_math.c"
+#include "haversine_simd.c"
+#undef Vec
+#undef VMask
+#undef LANES
+#undef TARGET
+#undef V_SUFFIX
+#undef v_set1
+#undef v_load
+#undef v_store
+#undef v_load_s32
+#undef v_add
+#undef v_sub
+#undef v_mul
+#undef v_div
+#undef v_fma
+#undef v_mul_err
+#undef v_sqrt
+#undef v_rsqrt
+#undef v_round
+#undef v_trunc32
+#undef v_abs
+#undef v_exponent
+#undef v_lt
+#undef v_select
+#undef v_any
+
+//------------------------------------------------------------------------------
+// Runtime Selection
+//------------------------------------------------------------------------------
+static void cpuid(U32 leaf, U32 subleaf, U32 regs[4]) {
+#if _MSC_VER
+	__cpuidex((int *)regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// which register state the os saves on context switch
+static U64 xgetbv0(void) {
+#if _MSC_VER
+	return _xgetbv(0);
+#else
+	U32 lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((U64)hi << 32) | lo;
+#endif
+}
+
+static bool cpu_has_avx2(void) {
+	U32 regs[4];
+	cpuid(1, 0, regs);
+	bool osxsave = regs[2] & (1 << 27);
+	bool avx     = regs[2] & (1 << 28);
+	bool fma     = regs[2] & (1 << 12);
+	if (!osxsave || !avx || !fma) return false;
+	if ((xgetbv0() & 0x6) != 0x6) return false; // xmm, ymm
+	cpuid(7, 0, regs);
+	return regs[1] & (1 << 5);
+}
+
+static bool cpu_has_avx512(void) {
+	if (!cpu_has_avx2()) return false;
+	if ((xgetbv0() & 0xe6) != 0xe6) return false; // xmm, ymm, opmask, zmm
+	U32 regs[4];
+	cpuid(7, 0, regs);
+	return regs[1] & (1 << 16);
+}
+
+typedef enum {
+	KERNEL_REFERENCE,
+	KERNEL_SCALAR,
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+
+	KERNEL_COUNT
+} KernelKind;
+
+// writes the distances from row_count row points to MATRIX_TILE_COLS column
+// points, one row of MATRIX_TILE_COLS after another
+typedef void MatrixTileFunc(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out);
+
+typedef struct {
+	char *name;
+	char *label; // for reports, the name and tier
+	KernelKind kind;
+	MathTier tier;
+	HaversineKernelFunc *func;
+	HaversineKernelQ32Func *func_q32;
+	MatrixTileFunc *matrix_tile;
+	U32 lanes;
+} HaversineKernel;
+
+// the reference kernel always goes through libm, whatever the tier, so its label
+// leaves the tier out
+HaversineKernel haversine_kernels[KERNEL_COUNT][MATH_TIER_COUNT] = {
+	[KERNEL_REFERENCE] = {
+		{"reference", "reference", KERNEL_REFERENCE, MATH_TIER_PRECISE,  reference_haversine_kernel, reference_haversine_kernel_q32, reference_haversine_matrix_tile, 1},
+		{"reference", "reference", KERNEL_REFERENCE, MATH_TIER_STANDARD, reference_haversine_kernel, reference_haversine_kernel_q32, reference_haversine_matrix_tile, 1},
+		{"reference", "reference", KERNEL_REFERENCE, MATH_TIER_FAST,     reference_haversine_kernel, reference_haversine_kernel_q32, reference_haversine_matrix_tile, 1},
+	},
+	[KERNEL_SCALAR] = {
+		{"scalar", "scalar precise",  KERNEL_SCALAR, MATH_TIER_PRECISE,  haversine_kernel_precise_scalar,  haversine_kernel_precise_q32_scalar,  haversine_matrix_tile_precise_scalar,  1},
+		{"scalar", "scalar standard", KERNEL_SCALAR, MATH_TIER_STANDARD, haversine_kernel_standard_scalar, haversine_kernel_standard_q32_scalar, haversine_matrix_tile_standard_scalar, 1},
+		{"scalar", "scalar fast",     KERNEL_SCALAR, MATH_TIER_FAST,     haversine_kernel_fast_scalar,     haversine_kernel_fast_q32_scalar,     haversine_matrix_tile_fast_scalar,     1},
+	},
+	[KERNEL_AVX2] = {
+		{"avx2", "avx2 precise",  KERNEL_AVX2, MATH_TIER_PRECISE,  haversine_kernel_precise_avx2,  haversine_kernel_precise_q32_avx2,  haversine_matrix_tile_precise_avx2,  4},
+		{"avx2", "avx2 standard", KERNEL_AVX2, MATH_TIER_STANDARD, haversine_kernel_standard_avx2, haversine_kernel_standard_q32_avx2, haversine_matrix_tile_standard_avx2, 4},
+		{"avx2", "avx2 fast",     KERNEL_AVX2, MATH_TIER_FAST,     haversine_kernel_fast_avx2,     haversine_kernel_fast_q32_avx2,     haversine_matrix_tile_fast_avx2,     4},
+	},
+	[KERNEL_AVX512] = {
+		{"avx512", "avx512 precise",  KERNEL_AVX512, MATH_TIER_PRECISE,  haversine_kernel_precise_avx512,  haversine_kernel_precise_q32_avx512,  haversine_matrix_tile_precise_avx512,  8},
+		{"avx512", "avx512 standard", KERNEL_AVX512, MATH_TIER_STANDARD, haversine_kernel_standard_avx512, haversine_kernel_standard_q32_avx512, haversine_matrix_tile_standard_avx512, 8},
+		{"avx512", "avx512 fast",     KERNEL_AVX512, MATH_TIER_FAST,     haversine_kernel_fast_avx512,     haversine_kernel_fast_q32_avx512,     haversine_matrix_tile_fast_avx512,     8},
+	},
+};
+
+typedef void DistanceErrorsFunc(F64 *computed, F64 *expected, U64 count, F64 *abs_errors, F64 *ulp_errors);
+
+// the widest the cpu supports, validation doesn't care which kernel is in use
+DistanceErrorsFunc *find_distance_errors(void) {
+	if (cpu_has_avx512()) return distance_errors_avx512;
+	if (cpu_has_avx2())   return distance_errors_avx2;
+	return distance_errors_scalar;
+}
+
+bool haversine_kernel_supported(KernelKind kind) {
+	bool result;
+	switch (kind) {
+		case KERNEL_AVX2:   result = cpu_has_avx2();   break;
+		case KERNEL_AVX512: result = cpu_has_avx512(); break;
+		default:            result = true;             break;
+	}
+	return result;
+}
+
+MathTier find_math_tier(char *name) {
+	for (int tier = 0; tier < MATH_TIER_COUNT; ++tier) {
+		if (0 == strcmp(name, math_tier_names[tier])) {
+			return tier;
+		}
+	}
+	return MATH_TIER_COUNT;
+}
+
+// "auto" picks the widest kernel the cpu supports, returns NULL for unknown
+// or unsupported names
+HaversineKernel *find_haversine_kernel(char *name, MathTier tier) {
+	if (0 == strcmp(name, "auto")) {
+		for (int kind = KERNEL_COUNT - 1; kind >= 0; --kind) {
+			if (haversine_kernel_supported(kind)) {
+				return &haversine_kernels[kind][tier];
+			}
+		}
+	}
+	for (int kind = 0; kind < KERNEL_COUNT; ++kind) {
+		if (0 == strcmp(name, haversine_kernels[kind][tier].name) && haversine_kernel_supported(kind)) {
+			return &haversine_kernels[kind][tier];
+		}
+	}
+	return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Error Sweeps
+//------------------------------------------------------------------------------
+typedef void MathEvalFunc(MathFunc func, MathTier tier, F64 *in, U64 count, F64 *out);
+
+MathEvalFunc *math_eval_funcs[KERNEL_COUNT] = {
+	[KERNEL_SCALAR] = math_eval_scalar,
+	[KERNEL_AVX2]   = math_eval_avx2,
+	[KERNEL_AVX512] = math_eval_avx512,
+};
+
+typedef struct {
+	char *name;
+	F64 (*libm)(F64);
+	F64 min, max;
+} MathDomain;
+
+// the inputs reference_haversine actually passes to each function
+MathDomain math_domains[MATH_FUNC_COUNT] = {
+	[MATH_FUNC_SIN]  = {"sin",  sin,  -3.14159265358979323846, 3.14159265358979323846},
+	[MATH_FUNC_COS]  = {"cos",  cos,  -1.57079632679489661923, 1.57079632679489661923},
+	[MATH_FUNC_ASIN] = {"asin", asin, 0, 1},
+	[MATH_FUNC_SQRT] = {"sqrt", sqrt, 0, 1},
+};
+
+static F64 ulp_f64(F64 a) {
+	a = fabs(a);
+	return a > 0 ? nextafter(a, INFINITY) - a : nextafter(0, 1);
+}
+
+// evaluates libm and every tier on evenly spaced points of each function's
+// domain and compares them against the double-double reference
+void math_error_sweep(KernelKind kind) {
+	PROFILE_FUNCTION_BEGIN;
+	enum { sample_count = 1 << 20 };
+	MathEvalFunc *eval = math_eval_funcs[kind];
+	assert(eval);
+
+	F64 *in = xmalloc(sample_count * sizeof(F64));
+	F64 *out = xmalloc(sample_count * sizeof(F64));
+	DoubleDouble *expected = xmalloc(sample_count * sizeof(DoubleDouble));
+
+	printf("\nMath error sweep (%s, %d samples per function, against double-double):\n", haversine_kernels[kind][0].name, sample_count);
+	printf("\t%-5s %-9s %12s %13s %9s\n", "func", "tier", "max abs", "max ulp", "rounded");
+	for (int func = 0; func < MATH_FUNC_COUNT; ++func) {
+		MathDomain domain = math_domains[func];
+		for (U64 i=0; i < sample_count; ++i) {
+			in[i] = domain.min + (domain.max - domain.min) * (i / (F64)(sample_count - 1));
+			expected[i] = math_reference(func, in[i]);
+		}
+
+		// libm first, as the baseline the tiers are up against
+		for (int tier = -1; tier < MATH_TIER_COUNT; ++tier) {
+			if (tier < 0) {
+				for (U64 i=0; i < sample_count; ++i) {
+					out[i] = domain.libm(in[i]);
+				}
+			} else {
+				eval(func, tier, in, sample_count, out);
+			}
+
+			F64 max_abs = 0;
+			F64 max_ulp = 0;
+			U64 rounded = 0;
+			for (U64 i=0; i < sample_count; ++i) {
+				// out - hi is exact whenever the error is anywhere near an ulp
+				F64 error = fabs((out[i] - expected[i].hi) - expected[i].lo);
+				max_abs = MAX(max_abs, error);
+				max_ulp = MAX(max_ulp, error / ulp_f64(expected[i].hi));
+				if (out[i] == expected[i].hi) ++rounded;
+			}
+			printf("\t%-5s %-9s %12.3e %13.3f %8.4f%%\n", domain.name, tier < 0 ? "libm" : math_tier_names[tier],
+				max_abs, max_ulp, 100.0 * rounded / sample_count);
+		}
+	}
+
+	free(expected);
+	free(out);
+	free(in);
+	PROFILE_FUNCTION_END;
+}
@@ -0,0 +1,399 @@
+//------------------------------------------------------------------------------
+// Haversine math template
+//
+// sin, cos, asin and sqrt specialized for the ranges reference_haversine feeds
+// them: sin of half a latitude or longitude difference (|x| <= pi), cos of a
+// latitude (|x| <= pi/2), and asin and sqrt of the haversine term (0..1).
+// Every function takes a MathTier:
+//
+//   precise   double-double evaluation, correctly rounded. Results too close
+//             to a rounding boundary to call go to the slow double-double
+//             reference in haversine_kernel.c
+//   standard  fdlibm's polynomials on the reduced argument without its low
+//             part, within 1.4 ulp
+//   fast      short Taylor polynomials and a refined sqrt estimate. sin and
+//             cos are off by up to 1.75e-9 absolute at the ends of the
+//             reduced range, about 1.6e7 ulp, asin by up to 5e-10 and sqrt
+//             by 3 ulp. That puts distances up to 3e-3 km off, so fast never
+//             validates
+//
+// These are maxima from -math-sweep against the double-double reference and
+// from validating the 1M pair data set.
+//
+// Included once per instruction set by haversine_kernel.c, see the operation
+// list at the top of haversine_simd.c. Additionally expects:
+//
+//   v_mul_err(a, b, p)    the exact rounding error a*b - p where p = a*b
+//   v_rsqrt(a)            low precision estimate of 1/sqrt(a)
+//   v_any(m)              whether any lane of m is set
+//------------------------------------------------------------------------------
+
+typedef struct {
+	Vec hi, lo;
+} V(DoubleDouble);
+
+#define DD V(DoubleDouble)
+
+static FORCE_INLINE TARGET DD V(dd_two_sum)(Vec a, Vec b) {
+	Vec s = v_add(a, b);
+	Vec bb = v_sub(s, a);
+	Vec e = v_add(v_sub(a, v_sub(s, bb)), v_sub(b, bb));
+	return (DD){s, e};
+}
+
+// requires |a| >= |b|
+static FORCE_INLINE TARGET DD V(dd_fast_two_sum)(Vec a, Vec b) {
+	Vec s = v_add(a, b);
+	Vec e = v_sub(b, v_sub(s, a));
+	return (DD){s, e};
+}
+
+static FORCE_INLINE TARGET DD V(dd_add)(DD a, DD b) {
+	DD s = V(dd_two_sum)(a.hi, b.hi);
+	return V(dd_fast_two_sum)(s.hi, v_add(s.lo, v_add(a.lo, b.lo)));
+}
+
+static FORCE_INLINE TARGET DD V(dd_mul)(DD a, DD b) {
+	Vec p = v_mul(a.hi, b.hi);
+	Vec e = v_mul_err(a.hi, b.hi, p);
+	e = v_add(e, v_add(v_mul(a.hi, b.lo), v_mul(a.lo, b.hi)));
+	return V(dd_fast_two_sum)(p, e);
+}
+
+static FORCE_INLINE TARGET DD V(dd_set1)(F64 hi, F64 lo) {
+	return (DD){v_set1(hi), v_set1(lo)};
+}
+
+static FORCE_INLINE TARGET DD V(dd_select)(VMask m, DD a, DD b) {
+	return (DD){v_select(m, a.hi, b.hi), v_select(m, a.lo, b.lo)};
+}
+
+// p*z + c
+static FORCE_INLINE TARGET DD V(dd_horner)(DD p, DD z, DD c) {
+	return V(dd_add)(V(dd_mul)(p, z), c);
+}
+
+// hi + lo rounded to double. bound is the relative error of the evaluation
+// that gave hi + lo; where the true result could lie on the other side of a
+// rounding boundary, those lanes are recomputed from the double-double
+// reference, so the result is correctly rounded either way. With the bounds
+// below that is about one call in several thousand.
+static FORCE_INLINE TARGET Vec V(dd_round)(DD p, F64 bound, MathFunc func, Vec x) {
+	Vec result = v_add(p.hi, p.lo);
+	Vec margin = v_mul(v_abs(result), v_set1(bound));
+	Vec up = v_add(p.hi, v_add(p.lo, margin));
+	Vec down = v_add(p.hi, v_sub(p.lo, margin));
+	if (v_any(v_lt(down, up))) {
+		F64 xs[LANES], ups[LANES], downs[LANES], results[LANES];
+		v_store(xs, x);
+		v_store(ups, up);
+		v_store(downs, down);
+		v_store(results, result);
+		for (int i=0; i < LANES; ++i) {
+			if (downs[i] < ups[i]) {
+				results[i] = math_reference(func, xs[i]).hi;
+			}
+		}
+		result = v_load(results);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------
+// sin and cos
+//------------------------------------------------------------------------------
+// Cody-Waite reduction by pi/2 in four parts. Only valid for the small
+// quadrant counts the haversine inputs produce (|x| <= pi), where k times each
+// part is exact and x - k*part1 is exact. The fourth part keeps r accurate to
+// well past 2^-100 relative even next to multiples of pi/2.
+static FORCE_INLINE TARGET DD V(reduce_pio2)(Vec x, Vec *quadrant) {
+	Vec k = v_round(v_mul(x, v_set1(6.36619772367581382433e-01)));
+	Vec t = v_sub(x, v_mul(k, v_set1(1.57079632673412561417e+00)));
+	DD r = V(dd_two_sum)(t, v_mul(k, v_set1(-6.07710050630396597660e-11)));
+	Vec lo = v_sub(r.lo, v_mul(k, v_set1(2.02226624871116645580e-21)));
+	lo = v_sub(lo, v_mul(k, v_set1(8.47842766036889956997e-32)));
+	r = V(dd_fast_two_sum)(r.hi, lo);
+	*quadrant = v_select(v_lt(k, v_set1(0)), v_add(k, v_set1(4)), k);
+	return r;
+}
+
+// sin(r) for even quadrants and cos(r) for odd ones, evaluated as one Taylor
+// series in r^2 with the coefficients picked per lane, through r^25 and r^24.
+// Every term whose rounding in double could reach past about 2^-80 of the
+// result is carried in double-double.
+static FORCE_INLINE TARGET DD V(sin_cos_poly_precise)(DD r, VMask odd) {
+	static const F64 tail[][2] = { // sin, cos
+		{ 6.4469502843844736e-26,  1.6117375710961184e-24},
+		{-3.8681701706306841e-23, -8.8967913924505741e-22},
+		{ 1.9572941063391263e-20,  4.1103176233121648e-19},
+		{-8.2206352466243295e-18, -1.5619206968586225e-16},
+		{ 2.8114572543455206e-15,  4.7794773323873853e-14},
+		{-7.6471637318198164e-13, -1.1470745597729725e-11},
+		{ 1.6059043836821613e-10,  2.08767569878681e-09},
+	};
+	static const F64 head[][2][2] = { // sin, cos as hi, lo
+		{{-2.505210838544172e-08,  1.448814070935912e-24},  {-2.7557319223985888e-07, -2.3767714622250297e-23}},
+		{{ 2.7557319223985893e-06, -1.8583932740464721e-22}, { 2.4801587301587302e-05,  2.1511947866775882e-23}},
+		{{-1.9841269841269841e-04, -1.7209558293420705e-22}, {-0.001388888888888889,    5.300543954373577e-20}},
+		{{ 0.008333333333333333,    1.1564823173178714e-19}, { 0.041666666666666664,    2.3129646346357427e-18}},
+		{{-0.16666666666666666,    -9.25185853854297e-18},  {-0.5,                     0}},
+		{{ 1.0,                     0},                      { 1.0,                     0}},
+	};
+	DD z = V(dd_mul)(r, r);
+	Vec q = v_select(odd, v_set1(tail[0][1]), v_set1(tail[0][0]));
+	for (int i=1; i < ARRAY_COUNT(tail); ++i) {
+		q = v_fma(q, z.hi, v_select(odd, v_set1(tail[i][1]), v_set1(tail[i][0])));
+	}
+	DD p = {q, v_set1(0)};
+	for (int i=0; i < ARRAY_COUNT(head); ++i) {
+		DD c = V(dd_select)(odd, V(dd_set1)(head[i][1][0], head[i][1][1]), V(dd_set1)(head[i][0][0], head[i][0][1]));
+		p = V(dd_horner)(p, z, c);
+	}
+	// sin is r times the series
+	return V(dd_mul)(p, V(dd_select)(odd, V(dd_set1)(1.0, 0), r));
+}
+
+// minimax polynomials on [-pi/4, pi/4], from fdlibm k_sin.c/k_cos.c
+static FORCE_INLINE TARGET Vec V(sin_poly_standard)(Vec x) {
+	Vec z = v_mul(x, x);
+	Vec w = v_mul(z, z);
+	Vec r = v_fma(z, v_fma(z, v_set1(2.75573137070700676789e-06), v_set1(-1.98412698298579493134e-04)), v_set1(8.33333333332248946124e-03));
+	r = v_fma(v_mul(z, w), v_fma(z, v_set1(1.58969099521155010221e-10), v_set1(-2.50507602534068634195e-08)), r);
+	Vec v = v_mul(z, x);
+	return v_fma(v, v_fma(z, r, v_set1(-1.66666666666666324348e-01)), x);
+}
+
+static FORCE_INLINE TARGET Vec V(cos_poly_standard)(Vec x) {
+	Vec z = v_mul(x, x);
+	Vec w = v_mul(z, z);
+	Vec r = v_mul(z, v_fma(z, v_fma(z, v_set1(2.48015872894767294178e-05), v_set1(-1.38888888888741095749e-03)), v_set1(4.16666666666666019037e-02)));
+	r = v_fma(v_mul(w, w), v_fma(z, v_fma(z, v_set1(-1.13596475577881948265e-11), v_set1(2.08757232129817482790e-09)), v_set1(-2.75573143513906633035e-07)), r);
+	Vec hz = v_mul(v_set1(0.5), z);
+	Vec one = v_set1(1.0);
+	w = v_sub(one, hz);
+	return v_add(w, v_fma(z, r, v_sub(v_sub(one, w), hz)));
+}
+
+// Taylor series through x^9 and x^10
+static FORCE_INLINE TARGET Vec V(sin_poly_fast)(Vec x) {
+	Vec z = v_mul(x, x);
+	Vec p = v_fma(z, v_set1(2.7557319223985893e-06), v_set1(-1.9841269841269841e-04));
+	p = v_fma(z, p, v_set1(8.3333333333333332e-03));
+	p = v_fma(z, p, v_set1(-1.6666666666666666e-01));
+	return v_fma(v_mul(z, x), p, x);
+}
+
+static FORCE_INLINE TARGET Vec V(cos_poly_fast)(Vec x) {
+	Vec z = v_mul(x, x);
+	Vec p = v_fma(z, v_set1(-2.755731922398589e-07), v_set1(2.4801587301587302e-05));
+	p = v_fma(z, p, v_set1(-1.3888888888888889e-03));
+	p = v_fma(z, p, v_set1(4.1666666666666664e-02));
+	p = v_fma(z, p, v_set1(-0.5));
+	return v_fma(z, p, v_set1(1.0));
+}
+
+// sin(r), cos(r), -sin(r) or -cos(r) for quadrant 0, 1, 2 or 3. cos(x) is
+// sin(x + pi/2), so passing shift = 1 turns this into cos.
+static FORCE_INLINE TARGET Vec V(sin_quadrant)(Vec x, F64 shift, MathTier tier) {
+	Vec quadrant;
+	DD r = V(reduce_pio2)(x, &quadrant);
+	quadrant = v_add(quadrant, v_set1(shift));
+	quadrant = v_select(v_lt(v_set1(3.5), quadrant), v_sub(quadrant, v_set1(4)), quadrant);
+
+	VMask upper = v_lt(v_set1(1.5), quadrant);
+	VMask odd = v_lt(v_set1(0.5), v_select(upper, v_sub(quadrant, v_set1(2)), quadrant));
+
+	Vec zero = v_set1(0);
+	Vec result;
+	if (tier == MATH_TIER_PRECISE) {
+		DD p = V(sin_cos_poly_precise)(r, odd);
+		p = V(dd_select)(upper, (DD){v_sub(zero, p.hi), v_sub(zero, p.lo)}, p);
+		// the series measures below 2^-85 relative against quad precision
+		result = V(dd_round)(p, 2.0679515313825692e-25, shift ? MATH_FUNC_COS : MATH_FUNC_SIN, x); // 2^-82
+	} else {
+		if (tier == MATH_TIER_STANDARD) {
+			result = v_select(odd, V(cos_poly_standard)(r.hi), V(sin_poly_standard)(r.hi));
+		} else {
+			result = v_select(odd, V(cos_poly_fast)(r.hi), V(sin_poly_fast)(r.hi));
+		}
+		result = v_select(upper, v_sub(zero, result), result);
+	}
+	return result;
+}
+
+static FORCE_INLINE TARGET Vec V(sin)(Vec x, MathTier tier) {
+	return V(sin_quadrant)(x, 0, tier);
+}
+
+static FORCE_INLINE TARGET Vec V(cos)(Vec x, MathTier tier) {
+	return V(sin_quadrant)(x, 1, tier);
+}
+
+//------------------------------------------------------------------------------
+// sqrt
+//------------------------------------------------------------------------------
+static FORCE_INLINE TARGET Vec V(sqrt)(Vec x, MathTier tier) {
+	Vec result;
+	if (tier == MATH_TIER_FAST) {
+		// two newton steps on the estimate, x = 0 would give 0 * inf. this
+		// has to stay accurate since asin(sqrt(a)) magnifies errors near 1.
+		Vec y = v_rsqrt(x);
+		Vec half_x = v_mul(v_set1(0.5), x);
+		y = v_mul(y, v_sub(v_set1(1.5), v_mul(half_x, v_mul(y, y))));
+		y = v_mul(y, v_sub(v_set1(1.5), v_mul(half_x, v_mul(y, y))));
+		result = v_select(v_lt(v_set1(0), x), v_mul(x, y), v_set1(0));
+	} else {
+		// hardware sqrt is already correctly rounded
+		result = v_sqrt(x);
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------
+// asin
+//------------------------------------------------------------------------------
+// Taylor series of asin(y)/y in y^2 for y <= 0.5, through y^69
+static FORCE_INLINE TARGET DD V(asin_poly_precise)(DD y) {
+	static const F64 tail[] = {
+		0.0013971399176302534, 0.0014603208940791154, 0.0015284115961225677, 0.001601963275351444,
+		0.0016816093935831068, 0.0017680811205154183, 0.0018622264064031275, 0.0019650336162772837,
+		0.0020776610325181676, 0.0022014739737101384, 0.002338091892111975,  0.0024894486782468836,
+		0.00265787063820729,   0.002846178401108942,  0.0030578216492580306, 0.003297059503473485,
+		0.0035692053938259347, 0.003880964558837669,  0.004240907093679363,  0.004660143486915096,
+		0.005153309682319905,  0.005740037670841924,  0.006447210311889649,  0.0073125258735988454,
+		0.008390335809616815,  0.009761609529194078,  0.011551800896139705,  0.01396484375,
+		0.017352764423076924,
+	};
+	DD z = V(dd_mul)(y, y);
+	Vec q = v_set1(tail[0]);
+	for (int i=1; i < ARRAY_COUNT(tail); ++i) {
+		q = v_fma(q, z.hi, v_set1(tail[i]));
+	}
+	DD p = V(dd_horner)((DD){q, v_set1(0)}, z, V(dd_set1)(0.022372159090909092, -9.4621280507825835e-19));
+	p = V(dd_horner)(p, z, V(dd_set1)(0.030381944444444444, 3.8549410577262378e-19));
+	p = V(dd_horner)(p, z, V(dd_set1)(0.044642857142857144, -9.9127055770103257e-19));
+	p = V(dd_horner)(p, z, V(dd_set1)(0.075, 2.7755575615628915e-18));
+	p = V(dd_horner)(p, z, V(dd_set1)(0.16666666666666666, 9.25185853854297e-18));
+	p = V(dd_horner)(p, z, V(dd_set1)(1.0, 0));
+	return V(dd_mul)(p, y);
+}
+
+static FORCE_INLINE TARGET Vec V(asin_precise)(Vec x) {
+	// x >= 0.5, asin(x) = pi/2 - 2*asin(s) with s = sqrt((1-x)/2) carried
+	// in double-double. t is exact since 1-x is.
+	VMask small = v_lt(x, v_set1(0.5));
+	Vec t = v_mul(v_sub(v_set1(1.0), x), v_set1(0.5));
+	Vec s = v_sqrt(t);
+	Vec ss = v_mul(s, s);
+	Vec s_lo = v_div(v_sub(v_sub(t, ss), v_mul_err(s, s, ss)), v_add(s, s));
+	s_lo = v_select(v_lt(v_set1(0), s), s_lo, v_set1(0));
+
+	// both halves share the series, so each lane only runs it once
+	DD y = V(dd_select)(small, (DD){x, v_set1(0)}, (DD){s, s_lo});
+	DD a = V(asin_poly_precise)(y);
+	DD large = V(dd_add)(V(dd_set1)(1.5707963267948966, 6.123233995736766e-17),
+		(DD){v_mul(a.hi, v_set1(-2.0)), v_mul(a.lo, v_set1(-2.0))});
+
+	// measures below 2^-69 relative against quad precision, the tail in
+	// double costs the most
+	DD result = V(dd_select)(small, a, large);
+	return V(dd_round)(result, 1.3552527156068805e-20, MATH_FUNC_ASIN, x); // 2^-66
+}
+
+// rational approximation of (asin(x) - x) / x^3 in x^2, from fdlibm e_asin.c
+static FORCE_INLINE TARGET Vec V(asin_rational)(Vec t) {
+	Vec p = v_fma(t, v_set1(3.47933107596021167570e-05), v_set1(7.91534994289814532176e-04));
+	p = v_fma(t, p, v_set1(-4.00555345006794114027e-02));
+	p = v_fma(t, p, v_set1(2.01212532134862925881e-01));
+	p = v_fma(t, p, v_set1(-3.25565818622400915405e-01));
+	p = v_fma(t, p, v_set1(1.66666666666666657415e-01));
+	p = v_mul(t, p);
+	Vec q = v_fma(t, v_set1(7.70381505559019352791e-02), v_set1(-6.88283971605453293030e-01));
+	q = v_fma(t, q, v_set1(2.02094576023350569471e+00));
+	q = v_fma(t, q, v_set1(-2.40339491173441421878e+00));
+	q = v_fma(t, q, v_set1(1.0));
+	return v_div(p, q);
+}
+
+static FORCE_INLINE TARGET Vec V(asin_standard)(Vec x) {
+	Vec pio2_hi = v_set1(1.57079632679489655800e+00);
+	Vec pio2_lo = v_set1(6.12323399573676603587e-17);
+	Vec pio4_hi = v_set1(7.85398163397448278999e-01);
+
+	// x < 0.5
+	Vec small = v_fma(x, V(asin_rational)(v_mul(x, x)), x);
+
+	// x >= 0.5, asin(x) = pi/2 - 2*asin(sqrt((1-x)/2))
+	Vec t = v_mul(v_sub(v_set1(1.0), x), v_set1(0.5));
+	Vec r = V(asin_rational)(t);
+	Vec s = v_sqrt(t);
+
+	// x >= 0.975
+	Vec high = v_sub(pio2_hi, v_sub(v_mul(v_set1(2.0), v_fma(s, r, s)), pio2_lo));
+
+	// 0.5 <= x < 0.975, split s so that 2*asin keeps the low bits
+	Vec w = v_trunc32(s);
+	Vec c = v_div(v_sub(t, v_mul(w, w)), v_add(s, w));
+	Vec p = v_sub(v_mul(v_mul(v_set1(2.0), s), r), v_sub(pio2_lo, v_mul(v_set1(2.0), c)));
+	Vec q = v_sub(pio4_hi, v_mul(v_set1(2.0), w));
+	Vec mid = v_sub(pio4_hi, v_sub(p, q));
+
+	Vec large = v_select(v_lt(x, v_set1(0.975)), mid, high);
+	return v_select(v_lt(x, v_set1(0.5)), small, large);
+}
+
+// Taylor series through y^23 for y <= 0.5, the upper half goes through the
+// same identity as the other tiers
+static FORCE_INLINE TARGET Vec V(asin_poly_fast)(Vec y) {
+	Vec z = v_mul(y, y);
+	Vec p = v_fma(z, v_set1(0.0073125258735988454), v_set1(0.008390335809616815));
+	p = v_fma(z, p, v_set1(0.009761609529194078));
+	p = v_fma(z, p, v_set1(0.011551800896139705));
+	p = v_fma(z, p, v_set1(0.01396484375));
+	p = v_fma(z, p, v_set1(0.017352764423076924));
+	p = v_fma(z, p, v_set1(0.022372159090909092));
+	p = v_fma(z, p, v_set1(0.030381944444444444));
+	p = v_fma(z, p, v_set1(0.044642857142857144));
+	p = v_fma(z, p, v_set1(0.075));
+	p = v_fma(z, p, v_set1(0.16666666666666666));
+	return v_fma(v_mul(z, y), p, y);
+}
+
+static FORCE_INLINE TARGET Vec V(asin_fast)(Vec x) {
+	VMask small = v_lt(x, v_set1(0.5));
+	Vec t = v_mul(v_sub(v_set1(1.0), x), v_set1(0.5));
+	Vec y = v_select(small, x, V(sqrt)(t, MATH_TIER_FAST));
+	Vec p = V(asin_poly_fast)(y);
+	return v_select(small, p, v_fma(p, v_set1(-2.0), v_set1(1.5707963267948966)));
+}
+
+// only handles 0 <= x <= 1, which is all haversine needs
+static FORCE_INLINE TARGET Vec V(asin)(Vec x, MathTier tier) {
+	Vec result;
+	switch (tier) {
+		case MATH_TIER_PRECISE:  result = V(asin_precise)(x);  break;
+		case MATH_TIER_STANDARD: result = V(asin_standard)(x); break;
+		default:                 result = V(asin_fast)(x);     break;
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------
+// Error Sweeps
+//------------------------------------------------------------------------------
+static TARGET void V(math_eval)(MathFunc func, MathTier tier, F64 *in, U64 count, F64 *out) {
+	assert(count % LANES == 0);
+	for (U64 i=0; i < count; i += LANES) {
+		Vec x = v_load(in + i);
+		Vec y;
+		switch (func) {
+			case MATH_FUNC_SIN:  y = V(sin)(x, tier);  break;
+			case MATH_FUNC_COS:  y = V(cos)(x, tier);  break;
+			case MATH_FUNC_ASIN: y = V(asin)(x, tier); break;
+			default:             y = V(sqrt)(x, tier); break;
+		}
+		v_store(out + i, y);
+	}
+}
+
+#undef DD
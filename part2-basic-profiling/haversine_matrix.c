@@ -0,0 +1,163 @@
+//------------------------------------------------------------------------------
+// Distance matrix
+//
+// Distances from each of n row points to each of m column points. Everything
+// the formula needs per point (the sines and cosines of the half angles and
+// the cosine of the latitude) is computed once up front, so a distance costs
+// a handful of multiplies plus one sqrt and one asin.
+//
+// The matrix is worked through in bands of MATRIX_TILE_ROWS rows. The threads
+// of the pool split a band into tiles of MATRIX_TILE_ROWS x MATRIX_TILE_COLS,
+// sized so a tile's column terms and output stay in L2. A finished band is
+// optionally written out row by row before the next starts, so only one band
+// is ever held in memory.
+//------------------------------------------------------------------------------
+#define MATRIX_TILE_ROWS 64
+
+// NOTE(shaw): the reference formula costs 21 operations a distance counting
+// each call to sin, cos, asin and sqrt as one, which is what the throughput
+// is expressed in, so the numbers stay comparable across kernels and tiers
+#define MATRIX_FLOPS_PER_DISTANCE 21
+
+MatrixPoints matrix_points(F64 *x, F64 *y, U64 count) {
+	MatrixPoints points = {0};
+	U64 padded_count = (count + MATRIX_TILE_COLS - 1) / MATRIX_TILE_COLS * MATRIX_TILE_COLS;
+	points.count = count;
+	points.sin_half_lat = xcalloc(5*MAX(padded_count, 1), sizeof(F64));
+	points.cos_half_lat = points.sin_half_lat + padded_count;
+	points.sin_half_lon = points.cos_half_lat + padded_count;
+	points.cos_half_lon = points.sin_half_lon + padded_count;
+	points.cos_lat      = points.cos_half_lon + padded_count;
+	for (U64 i=0; i < count; ++i) {
+		F64 lat = radians_from_degrees(y[i]);
+		F64 lon = radians_from_degrees(x[i]);
+		points.sin_half_lat[i] = sin(lat/2);
+		points.cos_half_lat[i] = cos(lat/2);
+		points.sin_half_lon[i] = sin(lon/2);
+		points.cos_half_lon[i] = cos(lon/2);
+		points.cos_lat[i]      = cos(lat);
+	}
+	return points;
+}
+
+typedef struct {
+	MatrixTileFunc *tile_func;
+	MatrixPoints rows;
+	MatrixPoints cols;
+	U64 band_row;      // first row of the band being computed
+	U64 band_rows;     // rows in it
+	U64 tile_count;    // tiles across a band
+	F64 *band;         // band_rows x cols.count, only when writing the matrix out
+	F64 *tile_sums;    // one per tile of the band
+	F64 **tile_scratch; // one MATRIX_TILE_ROWS x MATRIX_TILE_COLS per thread
+	volatile U64 next_tile;
+} MatrixJob;
+
+static void matrix_job_thread(void *params, U32 thread_index, U32 thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	MatrixJob *job = params;
+	F64 *scratch = job->tile_scratch[thread_index];
+	for (;;) {
+		U64 tile = os_atomic_add_u64(&job->next_tile, 1);
+		if (tile >= job->tile_count) break;
+
+		U64 col_begin = tile * MATRIX_TILE_COLS;
+		U64 col_count = MIN(MATRIX_TILE_COLS, job->cols.count - col_begin);
+		job->tile_func(&job->rows, job->band_row, job->band_rows, &job->cols, col_begin, scratch);
+
+		// the padding columns hold garbage distances, they are left out of both
+		F64 sum = 0;
+		for (U64 r=0; r < job->band_rows; ++r) {
+			F64 *tile_row = scratch + r*MATRIX_TILE_COLS;
+			for (U64 c=0; c < col_count; ++c) {
+				sum += tile_row[c];
+			}
+			if (job->band) {
+				memcpy(job->band + r*job->cols.count + col_begin, tile_row, col_count * sizeof(F64));
+			}
+		}
+		job->tile_sums[tile] = sum;
+	}
+	PROFILE_FUNCTION_END;
+}
+
+// rows come from the first n x0/y0 points of the input and columns from the
+// first m x1/y1 points, output_filepath may be NULL
+void haversine_matrix(ThreadPool *pool, HaversineKernel *kernel, HaversineInput input, U64 n, U64 m, char *output_filepath) {
+	PROFILE_FUNCTION_BEGIN;
+	if (!input.x0) {
+		fatal("the distance matrix needs f64 coordinates");
+	}
+	n = n ? MIN(n, input.num_pairs) : input.num_pairs;
+	m = m ? MIN(m, input.num_pairs) : input.num_pairs;
+
+	MatrixJob job = {0};
+	job.tile_func = kernel->matrix_tile;
+	job.rows = matrix_points(input.x0, input.y0, n);
+	job.cols = matrix_points(input.x1, input.y1, m);
+	job.tile_count = (m + MATRIX_TILE_COLS - 1) / MATRIX_TILE_COLS;
+	job.tile_sums = xmalloc(MAX(job.tile_count, 1) * sizeof(F64));
+	job.tile_scratch = xmalloc(pool->thread_count * sizeof(F64*));
+	for (U32 i=0; i < pool->thread_count; ++i) {
+		job.tile_scratch[i] = xmalloc(MATRIX_TILE_ROWS * MATRIX_TILE_COLS * sizeof(F64));
+	}
+
+	FILE *output = NULL;
+	if (output_filepath) {
+		output = fopen(output_filepath, "wb");
+		if (!output) {
+			fatal("failed to open %s for writing", output_filepath);
+		}
+		job.band = xmalloc(MATRIX_TILE_ROWS * MAX(m, 1) * sizeof(F64));
+	}
+
+	// tile sums are added in the same order whatever the thread count, so the
+	// average comes out the same
+	PairwiseSum sum = {0};
+	U64 tiles_done = 0;
+	U64 start = read_cpu_timer();
+	for (U64 band_row=0; band_row < n; band_row += MATRIX_TILE_ROWS) {
+		job.band_row = band_row;
+		job.band_rows = MIN(MATRIX_TILE_ROWS, n - band_row);
+		job.next_tile = 0;
+		thread_pool_run(pool, matrix_job_thread, &job);
+
+		for (U64 tile=0; tile < job.tile_count; ++tile) {
+			pairwise_add(&sum, job.tile_sums[tile]);
+		}
+		tiles_done += job.tile_count;
+
+		if (output && fwrite(job.band, sizeof(F64), job.band_rows * m, output) != job.band_rows * m) {
+			fatal("failed to write %s", output_filepath);
+		}
+	}
+	U64 ticks = read_cpu_timer() - start;
+
+	if (output && fclose(output) != 0) {
+		fatal("failed to write %s", output_filepath);
+	}
+
+	U64 distance_count = n * m;
+	F64 seconds = ticks / (F64)estimate_cpu_freq();
+	printf("Distance matrix: %llu x %llu, %s, %u threads\n", n, m, kernel->label, pool->thread_count);
+	printf("Average distance: %.16f\n", distance_count ? pairwise_total(&sum) / distance_count : 0);
+	if (output) {
+		printf("Wrote %llu x %llu F64 row major to %s\n", n, m, output_filepath);
+	}
+	if (seconds > 0) {
+		printf("%.3f ms, %.2f mdistances/s, %.2f gflop/s equivalent, %.1f tiles/s (%dx%d)\n",
+			seconds * 1000, distance_count / seconds / 1e6,
+			distance_count * MATRIX_FLOPS_PER_DISTANCE / seconds / 1e9,
+			tiles_done / seconds, MATRIX_TILE_ROWS, MATRIX_TILE_COLS);
+	}
+
+	for (U32 i=0; i < pool->thread_count; ++i) {
+		free(job.tile_scratch[i]);
+	}
+	free(job.tile_scratch);
+	free(job.tile_sums);
+	free(job.band);
+	free(job.rows.sin_half_lat);
+	free(job.cols.sin_half_lat);
+	PROFILE_BLOCK_END_THROUGHPUT(output ? distance_count * sizeof(F64) : 0);
+}
@@ -0,0 +1,89 @@
+//------------------------------------------------------------------------------
+// Binary pairs format
+//
+// Shared by generate_points.c, which writes it, and haversine.c, which maps it
+// and runs the kernels straight off the columns.
+//
+//   PairsHeader                 64 bytes, little endian
+//   x0[num_pairs]               F64 degrees, or S32 fixed point (see below),
+//                               each column starts on a 64 byte boundary
+//   y0[num_pairs]
+//   x1[num_pairs]
+//   y1[num_pairs]
+//------------------------------------------------------------------------------
+#include <stdint.h>
+
+#define PAIRS_MAGIC   0x0053524941505648ull // "HVPAIRS"
+#define PAIRS_VERSION 1
+#define PAIRS_ALIGN   64
+
+typedef enum {
+	PAIRS_COLUMN_F64,
+	PAIRS_COLUMN_S32,
+} PairsColumnType;
+
+// NOTE(shaw): S32 columns hold degrees times PAIRS_S32_UNITS_PER_DEGREE, the
+// largest whole number that still keeps +-180 inside an S32. That is a step
+// of about 8.4e-8 degrees, under a centimetre on the ground, for half the
+// bytes of an F64.
+#define PAIRS_S32_UNITS_PER_DEGREE 11930464.0
+#define PAIRS_S32_DEGREES_PER_UNIT (1.0 / PAIRS_S32_UNITS_PER_DEGREE)
+
+typedef enum {
+	PAIRS_X0,
+	PAIRS_Y0,
+	PAIRS_X1,
+	PAIRS_Y1,
+	PAIRS_COLUMN_COUNT,
+} PairsColumn;
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t column_type;  // PairsColumnType
+	uint64_t num_pairs;
+	uint64_t column_offsets[PAIRS_COLUMN_COUNT]; // from the start of the file
+	uint64_t reserved;
+} PairsHeader;
+
+static inline uint64_t pairs_column_size(uint32_t column_type, uint64_t num_pairs) {
+	uint64_t size = num_pairs * (column_type == PAIRS_COLUMN_S32 ? sizeof(int32_t) : sizeof(double));
+	return (size + PAIRS_ALIGN - 1) & ~(uint64_t)(PAIRS_ALIGN - 1);
+}
+
+static inline PairsHeader pairs_header(uint32_t column_type, uint64_t num_pairs) {
+	PairsHeader header = {0};
+	header.magic = PAIRS_MAGIC;
+	header.version = PAIRS_VERSION;
+	header.column_type = column_type;
+	header.num_pairs = num_pairs;
+	uint64_t offset = sizeof(PairsHeader);
+	for (int column=0; column < PAIRS_COLUMN_COUNT; ++column) {
+		header.column_offsets[column] = offset;
+		offset += pairs_column_size(column_type, num_pairs);
+	}
+	return header;
+}
+
+static inline uint64_t pairs_file_size(PairsHeader header) {
+	return header.column_offsets[PAIRS_Y1] + pairs_column_size(header.column_type, header.num_pairs);
+}
+
+
+//------------------------------------------------------------------------------
+// Shard manifest
+//
+// A dataset too big for one file is written as shards, each a complete JSON or
+// binary pairs file of its own, holding consecutive runs of the pairs. The
+// manifest next to them is text:
+//
+//   haversine_shards 1
+//   format json                 or bin
+//   pairs <total pair count>
+//   shards <shard count>
+//   <first pair> <pair count> <file name>      one line per shard, in order
+//
+// File names are relative to the manifest's directory and have no spaces.
+//------------------------------------------------------------------------------
+#define SHARD_MANIFEST_MAGIC   "haversine_shards"
+#define SHARD_MANIFEST_VERSION 1
@@ -0,0 +1,662 @@
+//------------------------------------------------------------------------------
+// Streaming pipeline
+//
+// Instead of reading the whole file, then parsing all of it, then computing,
+// every stage runs on its own thread and hands work to the next through
+// bounded queues, so the disk, the parser and the kernels are all busy at once.
+//
+//   reader thread      fills fixed size chunks of the file
+//   parser thread      turns chunks into batches of KERNEL_BLOCK_COUNT pairs
+//   compute threads    sum each batch with the kernel
+//   calling thread     folds the batch sums back together in file order
+//
+// Chunks and batches come from fixed pools and are recycled through free
+// queues, so memory use does not depend on the size of the file.
+//
+// NOTE(shaw): batches are exactly the blocks sum_haversine uses and are folded
+// in the same order, so the average matches the phased path bit for bit.
+//------------------------------------------------------------------------------
+#define PIPELINE_CHUNK_SIZE  (1 << 20)
+#define PIPELINE_CHUNK_COUNT 16 // must be a power of two
+#define PIPELINE_BATCH_COUNT 64 // must be a power of two
+#define PAIR_OBJECT_MAX_SIZE 4096
+
+typedef struct {
+	char *data;
+	U64 size; // 0 marks the end of the file
+} PipelineChunk;
+
+typedef struct {
+	F64 x0[KERNEL_BLOCK_COUNT];
+	F64 y0[KERNEL_BLOCK_COUNT];
+	F64 x1[KERNEL_BLOCK_COUNT];
+	F64 y1[KERNEL_BLOCK_COUNT];
+	U64 count;
+	U64 sequence;
+	F64 sum;
+} PipelineBatch;
+
+typedef struct {
+	FILE *file;
+	HaversineKernel *kernel;
+	U32 compute_thread_count;
+
+	PipelineChunk chunks[PIPELINE_CHUNK_COUNT];
+	PipelineBatch *batches;
+	BoundedQueue *free_chunks;
+	BoundedQueue *full_chunks;
+	BoundedQueue *free_batches;
+	BoundedQueue *full_batches;   // NULL tells a compute thread to stop
+	BoundedQueue *summed_batches;
+
+	// written by the parser thread once it has pushed its last batch
+	volatile U64 batch_total;
+	volatile U64 parse_done;
+} Pipeline;
+
+typedef struct {
+	F64 sum;
+	U64 num_pairs;
+	U64 bytes_read;
+} PipelineResult;
+
+
+//------------------------------------------------------------------------------
+// Streaming Pair Parser
+//------------------------------------------------------------------------------
+// NOTE(shaw): this understands an array of pair objects found somewhere after
+// the first '['. Coordinates must be numbers, any other key can hold any JSON
+// value and is skipped, strings and nesting included. That is what lets it
+// work a chunk at a time without building a tree: an object can only be cut
+// by a chunk boundary, and the piece before the cut is carried over to the
+// next chunk and parsed again from its '{' once more has arrived.
+typedef enum {
+	PAIR_STREAM_BEFORE_ARRAY,
+	PAIR_STREAM_IN_ARRAY,
+	PAIR_STREAM_DONE,
+} PairStreamState;
+
+typedef struct {
+	PairStreamState state;
+	char carry[PAIR_OBJECT_MAX_SIZE];
+	U64 carry_size;
+} PairStream;
+
+typedef void PairFunc(void *user, F64 x0, F64 y0, F64 x1, F64 y1);
+
+static char *skip_space(char *at, char *end) {
+	while (at < end && isspace(*at)) {
+		++at;
+	}
+	return at;
+}
+
+static bool is_number_char(char c) {
+	return isdigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// NOTE(shaw): the skip functions return NULL when end comes before what they
+// skip is over, meaning the object has to wait for the next chunk
+
+// from just past the opening quote to the closing one
+static char *skip_string(char *at, char *end) {
+	while (at < end) {
+		if (*at == '\\') {
+			at += 2;
+		} else if (*at == '"') {
+			return at;
+		} else {
+			++at;
+		}
+	}
+	return NULL;
+}
+
+// to just past any value
+static char *skip_value(char *at, char *end) {
+	if (*at == '"') {
+		at = skip_string(at + 1, end);
+		return at ? at + 1 : NULL;
+	}
+	if (*at == '{' || *at == '[') {
+		int depth = 0;
+		while (at < end) {
+			if (*at == '"') {
+				at = skip_string(at + 1, end);
+				if (!at) return NULL;
+			} else if (*at == '{' || *at == '[') {
+				++depth;
+			} else if (*at == '}' || *at == ']') {
+				if (--depth == 0) return at + 1;
+			}
+			++at;
+		}
+		return NULL;
+	}
+	// numbers and true/false/null
+	while (at < end && *at != ',' && *at != '}' && *at != ']' && !isspace(*at)) {
+		++at;
+	}
+	return at < end ? at : NULL;
+}
+
+// parses the object from the '{' at `at`, returns just past its '}' or NULL
+// if it doesn't end before `end`, in which case func isn't called
+static char *parse_pair_object(char *at, char *end, PairFunc *func, void *user) {
+	F64 coords[PAIRS_COLUMN_COUNT] = {0};
+	++at;
+	for (;;) {
+		at = skip_space(at, end);
+		if (at == end) return NULL;
+		if (*at == '}') break;
+		if (*at != '"') parse_error("expected a key in pair object");
+		char *key = ++at;
+		at = skip_string(at, end);
+		if (!at) return NULL;
+		U64 key_length = at - key;
+		at = skip_space(at + 1, end);
+		if (at == end) return NULL;
+		if (*at != ':') parse_error("expected ':' after key in pair object");
+		at = skip_space(at + 1, end);
+		if (at == end) return NULL;
+
+		if (key_length == 2 && (key[0] == 'x' || key[0] == 'y') && (key[1] == '0' || key[1] == '1')) {
+			// the number has to end before the chunk does, then the character
+			// after it stops strtod, so it can't run off the end of the chunk
+			char *number_end = at;
+			while (number_end < end && is_number_char(*number_end)) {
+				++number_end;
+			}
+			if (number_end == end) return NULL;
+			char *parsed_end;
+			F64 value = strtod(at, &parsed_end);
+			if (parsed_end == at || parsed_end != number_end) parse_error("expected a number in pair object");
+			coords[(key[1] - '0')*2 + (key[0] == 'y')] = value;
+			at = number_end;
+		} else {
+			at = skip_value(at, end);
+			if (!at) return NULL;
+		}
+
+		at = skip_space(at, end);
+		if (at == end) return NULL;
+		if (*at == ',') {
+			++at;
+		} else if (*at != '}') {
+			parse_error("expected ',' or '}' in pair object, got '%c'", *at);
+		}
+	}
+	func(user, coords[PAIRS_X0], coords[PAIRS_Y0], coords[PAIRS_X1], coords[PAIRS_Y1]);
+	return at + 1;
+}
+
+// feeds the next piece of the file through the parser, size 0 ends the stream
+void pair_stream_parse(PairStream *stream, char *data, U64 size, PairFunc *func, void *user) {
+	char *at = data;
+	char *end = data + size;
+
+	if (size == 0) {
+		if (stream->state != PAIR_STREAM_DONE) parse_error("unexpected end of input");
+		return;
+	}
+
+	// finish the object that was cut off at the end of the last piece, as much
+	// of this piece as fits goes after it and whatever the object didn't use
+	// is parsed from here as usual
+	if (stream->carry_size) {
+		U64 carried = stream->carry_size;
+		U64 take = MIN(size, PAIR_OBJECT_MAX_SIZE - carried);
+		memcpy(stream->carry + carried, at, take);
+		stream->carry_size += take;
+		char *next = parse_pair_object(stream->carry, stream->carry + stream->carry_size, func, user);
+		if (!next) {
+			if (stream->carry_size == PAIR_OBJECT_MAX_SIZE) parse_error("pair object too large");
+			return;
+		}
+		at += (next - stream->carry) - carried;
+		stream->carry_size = 0;
+	}
+
+	while (at < end) {
+		if (stream->state == PAIR_STREAM_BEFORE_ARRAY) {
+			char *open = memchr(at, '[', end - at);
+			if (!open) break;
+			stream->state = PAIR_STREAM_IN_ARRAY;
+			at = open + 1;
+		} else if (stream->state == PAIR_STREAM_IN_ARRAY) {
+			while (at < end && (isspace(*at) || *at == ',')) {
+				++at;
+			}
+			if (at == end) break;
+			if (*at == ']') {
+				stream->state = PAIR_STREAM_DONE;
+			} else if (*at == '{') {
+				char *next = parse_pair_object(at, end, func, user);
+				if (!next) {
+					if (end - at >= PAIR_OBJECT_MAX_SIZE) parse_error("pair object too large");
+					memcpy(stream->carry, at, end - at);
+					stream->carry_size = end - at;
+					break;
+				}
+				at = next;
+			} else {
+				parse_error("expected '{' or ']' in pairs array, got '%c'", *at);
+			}
+		} else {
+			break; // anything after the array is ignored
+		}
+	}
+}
+
+
+//------------------------------------------------------------------------------
+// Stages
+//------------------------------------------------------------------------------
+static void pipeline_reader(void *param) {
+	PROFILE_FUNCTION_BEGIN;
+	Pipeline *pipeline = param;
+	U64 bytes_read = 0;
+	for (;;) {
+		PipelineChunk *chunk = queue_pop(pipeline->free_chunks);
+		PROFILE_BLOCK_BEGIN("pipeline read chunk");
+		chunk->size = fread(chunk->data, 1, PIPELINE_CHUNK_SIZE, pipeline->file);
+		PROFILE_BLOCK_END_THROUGHPUT(chunk->size);
+		bytes_read += chunk->size;
+		queue_push(pipeline->full_chunks, chunk);
+		if (chunk->size == 0) break;
+	}
+	PROFILE_BLOCK_END_THROUGHPUT(bytes_read);
+	profile_thread_release();
+}
+
+typedef struct {
+	Pipeline *pipeline;
+	PipelineBatch *batch;
+	U64 sequence;
+} PipelineParser;
+
+static void pipeline_push_batch(PipelineParser *parser) {
+	parser->batch->sequence = parser->sequence++;
+	queue_push(parser->pipeline->full_batches, parser->batch);
+	parser->batch = NULL;
+}
+
+static void pipeline_push_pair(void *user, F64 x0, F64 y0, F64 x1, F64 y1) {
+	PipelineParser *parser = user;
+	if (!parser->batch) {
+		parser->batch = queue_pop(parser->pipeline->free_batches);
+		parser->batch->count = 0;
+	}
+	PipelineBatch *batch = parser->batch;
+	batch->x0[batch->count] = x0;
+	batch->y0[batch->count] = y0;
+	batch->x1[batch->count] = x1;
+	batch->y1[batch->count] = y1;
+	if (++batch->count == KERNEL_BLOCK_COUNT) {
+		pipeline_push_batch(parser);
+	}
+}
+
+static void pipeline_parser(void *param) {
+	PROFILE_FUNCTION_BEGIN;
+	Pipeline *pipeline = param;
+	PipelineParser parser = { .pipeline = pipeline };
+	PairStream *stream = xcalloc(1, sizeof(PairStream));
+	U64 bytes_parsed = 0;
+
+	for (;;) {
+		PipelineChunk *chunk = queue_pop(pipeline->full_chunks);
+		U64 size = chunk->size;
+		bytes_parsed += size;
+		PROFILE_BLOCK_BEGIN("pipeline parse chunk");
+		pair_stream_parse(stream, chunk->data, size, pipeline_push_pair, &parser);
+		PROFILE_BLOCK_END_THROUGHPUT(size);
+		queue_push(pipeline->free_chunks, chunk);
+		if (size == 0) break;
+	}
+	if (parser.batch) {
+		pipeline_push_batch(&parser);
+	}
+
+	os_atomic_store_u64(&pipeline->batch_total, parser.sequence);
+	os_atomic_store_u64(&pipeline->parse_done, 1);
+	for (U32 i=0; i < pipeline->compute_thread_count; ++i) {
+		queue_push(pipeline->full_batches, NULL);
+	}
+	free(stream);
+	PROFILE_BLOCK_END_THROUGHPUT(bytes_parsed);
+	profile_thread_release();
+}
+
+static void pipeline_compute(void *param) {
+	PROFILE_FUNCTION_BEGIN;
+	Pipeline *pipeline = param;
+	F64 distances[KERNEL_BLOCK_COUNT];
+	U64 pair_count = 0;
+	for (;;) {
+		PipelineBatch *batch = queue_pop(pipeline->full_batches);
+		if (!batch) break;
+		pipeline->kernel->func(batch->x0, batch->y0, batch->x1, batch->y1, batch->count, distances);
+		F64 sum = 0;
+		for (U64 i=0; i < batch->count; ++i) {
+			sum += distances[i];
+		}
+		batch->sum = sum;
+		pair_count += batch->count;
+		queue_push(pipeline->summed_batches, batch);
+	}
+	PROFILE_BLOCK_END_THROUGHPUT(pair_count * 4 * sizeof(F64));
+	profile_thread_release();
+}
+
+// compute_thread_count 0 means one per logical processor
+PipelineResult run_pipeline(char *filepath, HaversineKernel *kernel, U32 compute_thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	PipelineResult result = {0};
+	Pipeline *pipeline = xcalloc(1, sizeof(Pipeline));
+	pipeline->file = fopen(filepath, "rb");
+	if (!pipeline->file) {
+		fatal("failed to open file %s", filepath);
+	}
+	pipeline->kernel = kernel;
+	pipeline->compute_thread_count = compute_thread_count ? compute_thread_count : os_logical_processor_count();
+
+	pipeline->free_chunks = queue_create(PIPELINE_CHUNK_COUNT);
+	pipeline->full_chunks = queue_create(PIPELINE_CHUNK_COUNT);
+	for (int i=0; i < PIPELINE_CHUNK_COUNT; ++i) {
+		pipeline->chunks[i].data = xmalloc(PIPELINE_CHUNK_SIZE);
+		queue_push(pipeline->free_chunks, &pipeline->chunks[i]);
+	}
+
+	// the stop markers for the compute threads need room on top of the batches
+	U64 full_capacity = PIPELINE_BATCH_COUNT;
+	while (full_capacity < PIPELINE_BATCH_COUNT + pipeline->compute_thread_count) {
+		full_capacity *= 2;
+	}
+	pipeline->batches = xmalloc(PIPELINE_BATCH_COUNT * sizeof(PipelineBatch));
+	pipeline->free_batches = queue_create(PIPELINE_BATCH_COUNT);
+	pipeline->full_batches = queue_create(full_capacity);
+	pipeline->summed_batches = queue_create(PIPELINE_BATCH_COUNT);
+	for (int i=0; i < PIPELINE_BATCH_COUNT; ++i) {
+		queue_push(pipeline->free_batches, &pipeline->batches[i]);
+	}
+
+	OS_Thread reader = os_thread_create(pipeline_reader, pipeline);
+	OS_Thread parser = os_thread_create(pipeline_parser, pipeline);
+	OS_Thread *compute = xmalloc(pipeline->compute_thread_count * sizeof(OS_Thread));
+	for (U32 i=0; i < pipeline->compute_thread_count; ++i) {
+		compute[i] = os_thread_create(pipeline_compute, pipeline);
+	}
+
+	// batches finish out of order, so they wait here until every batch before
+	// them has been added. A batch isn't recycled until it has been added, so
+	// at most PIPELINE_BATCH_COUNT sequence numbers are ever waiting.
+	PipelineBatch *waiting[PIPELINE_BATCH_COUNT] = {0};
+	PairwiseSum sum = {0};
+	U64 next_sequence = 0;
+	for (;;) {
+		void *value;
+		if (queue_try_pop(pipeline->summed_batches, &value)) {
+			PipelineBatch *batch = value;
+			waiting[batch->sequence % PIPELINE_BATCH_COUNT] = batch;
+			PipelineBatch *next;
+			while ((next = waiting[next_sequence % PIPELINE_BATCH_COUNT]) && next->sequence == next_sequence) {
+				pairwise_add(&sum, next->sum);
+				result.num_pairs += next->count;
+				waiting[next_sequence % PIPELINE_BATCH_COUNT] = NULL;
+				++next_sequence;
+				queue_push(pipeline->free_batches, next);
+			}
+		} else if (os_atomic_load_u64(&pipeline->parse_done) && next_sequence == os_atomic_load_u64(&pipeline->batch_total)) {
+			break;
+		} else {
+			os_thread_yield();
+		}
+	}
+	result.sum = pairwise_total(&sum);
+
+	os_thread_join(reader);
+	os_thread_join(parser);
+	for (U32 i=0; i < pipeline->compute_thread_count; ++i) {
+		os_thread_join(compute[i]);
+	}
+	result.bytes_read = _ftelli64(pipeline->file);
+	fclose(pipeline->file);
+
+	free(compute);
+	for (int i=0; i < PIPELINE_CHUNK_COUNT; ++i) {
+		free(pipeline->chunks[i].data);
+	}
+	free(pipeline->batches);
+	queue_destroy(pipeline->free_chunks);
+	queue_destroy(pipeline->full_chunks);
+	queue_destroy(pipeline->free_batches);
+	queue_destroy(pipeline->full_batches);
+	queue_destroy(pipeline->summed_batches);
+	free(pipeline);
+
+	PROFILE_BLOCK_END_THROUGHPUT(result.bytes_read);
+	return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Bounded Memory Streaming
+//------------------------------------------------------------------------------
+// Single threaded sibling of the pipeline for inputs that don't fit in memory
+// and still need validating. The input is parsed through one fixed window,
+// the answers are read one block at a time alongside it, and the errors go
+// into the same fixed size ErrorStats validate() reports, so memory use is the
+// same for 1MB and 100GB.
+#define STREAM_WINDOW_SIZE (1 << 20)
+
+typedef struct {
+	HaversineKernel *kernel;
+	FILE *answers;
+	PipelineBatch batch;
+	F64 distances[KERNEL_BLOCK_COUNT];
+	F64 expected[KERNEL_BLOCK_COUNT];
+	F64 abs_errors[KERNEL_BLOCK_COUNT];
+	F64 ulp_errors[KERNEL_BLOCK_COUNT];
+	DistanceErrorsFunc *distance_errors;
+	ErrorStats stats;
+	F64 worst_expected; // answer of the pair with the largest error so far
+	PairwiseSum sum;
+	U64 num_pairs;
+} StreamState;
+
+static void stream_flush_batch(StreamState *state) {
+	PipelineBatch *batch = &state->batch;
+	if (!batch->count) return;
+
+	state->kernel->func(batch->x0, batch->y0, batch->x1, batch->y1, batch->count, state->distances);
+	F64 sum = 0;
+	for (U64 i=0; i < batch->count; ++i) {
+		sum += state->distances[i];
+	}
+	pairwise_add(&state->sum, sum);
+
+	if (state->answers) {
+		if (fread(state->expected, sizeof(F64), batch->count, state->answers) != batch->count) {
+			fatal("answers file has fewer answers than the input has pairs");
+		}
+		state->distance_errors(state->distances, state->expected, batch->count, state->abs_errors, state->ulp_errors);
+		error_stats_add(&state->stats, state->abs_errors, state->ulp_errors, batch->count, state->num_pairs, NULL);
+		// pairs only ever come later, so the worst is in this batch if it moved
+		U64 worst = state->stats.max_abs_error_index;
+		if (worst >= state->num_pairs) {
+			state->worst_expected = state->expected[worst - state->num_pairs];
+		}
+	}
+
+	state->num_pairs += batch->count;
+	batch->count = 0;
+}
+
+static void stream_push_pair(void *user, F64 x0, F64 y0, F64 x1, F64 y1) {
+	StreamState *state = user;
+	PipelineBatch *batch = &state->batch;
+	batch->x0[batch->count] = x0;
+	batch->y0[batch->count] = y0;
+	batch->x1[batch->count] = x1;
+	batch->y1[batch->count] = y1;
+	if (++batch->count == KERNEL_BLOCK_COUNT) {
+		stream_flush_batch(state);
+	}
+}
+
+void stream_haversine(char *filepath, char *answers_filepath, HaversineKernel *kernel) {
+	PROFILE_FUNCTION_BEGIN;
+	FILE *file = fopen(filepath, "rb");
+	if (!file) {
+		fatal("failed to open file %s", filepath);
+	}
+	StreamState *state = xcalloc(1, sizeof(StreamState));
+	state->kernel = kernel;
+	state->distance_errors = find_distance_errors();
+	if (answers_filepath) {
+		state->answers = fopen(answers_filepath, "rb");
+		if (!state->answers) {
+			fatal("failed to open file %s", answers_filepath);
+		}
+	}
+
+	char *window = xmalloc(STREAM_WINDOW_SIZE);
+	PairStream *stream = xcalloc(1, sizeof(PairStream));
+	U64 bytes_read = 0;
+	for (;;) {
+		PROFILE_BLOCK_BEGIN("read window");
+		U64 size = fread(window, 1, STREAM_WINDOW_SIZE, file);
+		PROFILE_BLOCK_END_THROUGHPUT(size);
+		pair_stream_parse(stream, window, size, stream_push_pair, state);
+		bytes_read += size;
+		if (size == 0) break;
+	}
+	stream_flush_batch(state);
+	fclose(file);
+
+	F64 average = state->num_pairs > 0 ? pairwise_total(&state->sum) / state->num_pairs : 0;
+	if (state->answers) {
+		// the generated average comes right after the last answer
+		F64 generated_average = 0;
+		if (fread(&generated_average, sizeof(generated_average), 1, state->answers) != 1) {
+			fatal("answers file is missing the generated average");
+		}
+		fclose(state->answers);
+		print_validation(state->num_pairs, average, generated_average);
+		print_error_stats(&state->stats, state->num_pairs, state->worst_expected);
+	} else {
+		printf("Number of pairs: %llu\n", state->num_pairs);
+		printf("Average haversine distance: %.16f\n", average);
+	}
+
+	free(stream);
+	free(window);
+	free(state);
+	PROFILE_BLOCK_END_THROUGHPUT(bytes_read);
+}
+
+
+//------------------------------------------------------------------------------
+// Parse-fused Compute
+//------------------------------------------------------------------------------
+// Every pair the parser finishes goes into a batch of just FUSED_BATCH_COUNT,
+// one or two vectors worth, which runs through the kernel as soon as it fills.
+// The coordinates never make it further than a few cache lines, so none of
+// the pair array traffic of the other modes exists here.
+//
+// NOTE(shaw): the kernel sums are still collected into blocks of
+// KERNEL_BLOCK_COUNT before going into the pairwise sum, so the average
+// matches every other mode.
+#define FUSED_BATCH_COUNT 8
+
+typedef struct {
+	HaversineKernel *kernel;
+	F64 x0[FUSED_BATCH_COUNT];
+	F64 y0[FUSED_BATCH_COUNT];
+	F64 x1[FUSED_BATCH_COUNT];
+	F64 y1[FUSED_BATCH_COUNT];
+	F64 distances[FUSED_BATCH_COUNT];
+	U64 count;
+	F64 block_sum;
+	U64 block_fill;
+	PairwiseSum sum;
+	U64 num_pairs;
+} FusedState;
+
+static_assert(KERNEL_BLOCK_COUNT % FUSED_BATCH_COUNT == 0, "fused batches must not straddle blocks");
+
+static void fused_flush_batch(FusedState *state) {
+	state->kernel->func(state->x0, state->y0, state->x1, state->y1, state->count, state->distances);
+	for (U64 i=0; i < state->count; ++i) {
+		state->block_sum += state->distances[i];
+	}
+	state->block_fill += state->count;
+	state->num_pairs += state->count;
+	state->count = 0;
+
+	if (state->block_fill == KERNEL_BLOCK_COUNT) {
+		pairwise_add(&state->sum, state->block_sum);
+		state->block_sum = 0;
+		state->block_fill = 0;
+	}
+}
+
+static void fused_push_pair(void *user, F64 x0, F64 y0, F64 x1, F64 y1) {
+	FusedState *state = user;
+	state->x0[state->count] = x0;
+	state->y0[state->count] = y0;
+	state->x1[state->count] = x1;
+	state->y1[state->count] = y1;
+	if (++state->count == FUSED_BATCH_COUNT) {
+		fused_flush_batch(state);
+	}
+}
+
+void fused_haversine(char *filepath, char *answers_filepath, HaversineKernel *kernel) {
+	PROFILE_FUNCTION_BEGIN;
+	FILE *file = fopen(filepath, "rb");
+	if (!file) {
+		fatal("failed to open file %s", filepath);
+	}
+	FusedState *state = xcalloc(1, sizeof(FusedState));
+	state->kernel = kernel;
+
+	char *window = xmalloc(STREAM_WINDOW_SIZE);
+	PairStream *stream = xcalloc(1, sizeof(PairStream));
+	U64 bytes_read = 0;
+	for (;;) {
+		PROFILE_BLOCK_BEGIN("read window");
+		U64 size = fread(window, 1, STREAM_WINDOW_SIZE, file);
+		PROFILE_BLOCK_END_THROUGHPUT(size);
+		pair_stream_parse(stream, window, size, fused_push_pair, state);
+		bytes_read += size;
+		if (size == 0) break;
+	}
+	fclose(file);
+	if (state->count) {
+		fused_flush_batch(state);
+	}
+	if (state->block_fill) {
+		pairwise_add(&state->sum, state->block_sum);
+	}
+
+	F64 average = state->num_pairs > 0 ? pairwise_total(&state->sum) / state->num_pairs : 0;
+	if (answers_filepath) {
+		print_validation(state->num_pairs, average, read_generated_average(answers_filepath));
+	} else {
+		printf("Number of pairs: %llu\n", state->num_pairs);
+		printf("Average haversine distance: %.16f\n", average);
+	}
+
+	// what a pair array would have cost: written once by the parser and read
+	// back once by the kernel
+	F64 pair_array_megabytes = state->num_pairs * 4*sizeof(F64) / (F64)(1024*1024);
+	printf("Pair array traffic avoided: %.3fmb (%.3fmb written, %.3fmb read back)\n",
+		2*pair_array_megabytes, pair_array_megabytes, pair_array_megabytes);
+
+	free(stream);
+	free(window);
+	free(state);
+	PROFILE_BLOCK_END_THROUGHPUT(bytes_read);
+}
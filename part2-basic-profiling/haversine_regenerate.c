@@ -0,0 +1,189 @@
+//------------------------------------------------------------------------------
+// Validation without the answers file
+//
+// generate_points makes pair i from nothing but the mode, the seed and i (see
+// haversine_generator.c), so the answer it wrote for pair i can be made again
+// here instead of read from the .f64 file. -regenerate does that for every
+// pair, spread over the pool block by block like validate(), and checks the
+// input really holds the pairs it regenerated. With -spot-check n the compute
+// runs over everything as usual, at kernel speed, and only n pairs picked at
+// random are regenerated and checked.
+//------------------------------------------------------------------------------
+
+// the reference answers of the pairs first..first+count, or of indices[0..count]
+// when indices isn't NULL, returns how many of them the input doesn't hold
+// NOTE(shaw): quantized input can't hold the generated coordinates exactly, so
+// only f64 input is compared
+static U64 regenerate_answers(PairGenerator *generator, HaversineInput input, U64 first, U64 count, U64 *indices, F64 *expected) {
+	U64 mismatched = 0;
+	for (U64 i=0; i < count; ++i) {
+		U64 index = indices ? indices[i] : first + i;
+		F64 x0, y0, x1, y1;
+		generate_pair(generator, index, &x0, &y0, &x1, &y1);
+		if (input.x0) {
+			mismatched += input.x0[index] != x0 || input.y0[index] != y0 || input.x1[index] != x1 || input.y1[index] != y1;
+		}
+		expected[i] = reference_haversine(x0, y0, x1, y1, EARTH_RADIUS_KM);
+	}
+	return mismatched;
+}
+
+static void print_mismatched_pairs(HaversineInput input, U64 mismatched, U64 checked) {
+	if (input.x0) {
+		printf("Pairs that differ from the regenerated ones: %llu of %llu%s\n", mismatched, checked,
+			mismatched ? ", wrong mode or seed?" : "");
+	} else {
+		printf("Pairs not compared against the regenerated ones, the input is quantized\n");
+	}
+}
+
+typedef struct {
+	HaversineKernel *kernel;
+	DistanceErrorsFunc *distance_errors;
+	PairGenerator *generator;
+	HaversineInput input;
+	F64 *block_sums;
+	F64 *expected_sums;
+	U64 block_count;
+	ErrorStats *stats;       // one per thread
+	U64 *mismatched_pairs;   // one per thread
+	volatile U64 next_block;
+} RegenerateJob;
+
+static void regenerate_job_thread(void *params, U32 thread_index, U32 thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	RegenerateJob *job = params;
+	F64 computed[KERNEL_BLOCK_COUNT];
+	F64 expected[KERNEL_BLOCK_COUNT];
+	F64 abs_errors[KERNEL_BLOCK_COUNT];
+	F64 ulp_errors[KERNEL_BLOCK_COUNT];
+	U64 mismatched = 0;
+	for (;;) {
+		U64 block = os_atomic_add_u64(&job->next_block, 1);
+		if (block >= job->block_count) break;
+
+		U64 first = block * KERNEL_BLOCK_COUNT;
+		U64 count = MIN(KERNEL_BLOCK_COUNT, job->input.num_pairs - first);
+		job->block_sums[block] = sum_block(job->kernel, job->input, block, computed);
+		mismatched += regenerate_answers(job->generator, job->input, first, count, NULL, expected);
+
+		F64 expected_sum = 0;
+		for (U64 i=0; i < count; ++i) {
+			expected_sum += expected[i];
+		}
+		job->expected_sums[block] = expected_sum;
+
+		job->distance_errors(computed, expected, count, abs_errors, ulp_errors);
+		error_stats_add(&job->stats[thread_index], abs_errors, ulp_errors, count, first, NULL);
+	}
+	job->mismatched_pairs[thread_index] = mismatched;
+	PROFILE_FUNCTION_END;
+}
+
+// validate() with every answer regenerated rather than read, the generated
+// average is the average of the regenerated answers
+void validate_regenerated(ThreadPool *pool, HaversineKernel *kernel, HaversineInput input, PairGenerator *generator) {
+	PROFILE_FUNCTION_BEGIN;
+	RegenerateJob job = {0};
+	job.kernel = kernel;
+	job.distance_errors = find_distance_errors();
+	job.generator = generator;
+	job.input = input;
+	job.block_count = block_count(input.num_pairs);
+	job.block_sums = xmalloc(MAX(job.block_count, 1) * sizeof(F64));
+	job.expected_sums = xmalloc(MAX(job.block_count, 1) * sizeof(F64));
+	job.stats = xcalloc(pool->thread_count, sizeof(ErrorStats));
+	job.mismatched_pairs = xcalloc(pool->thread_count, sizeof(U64));
+	thread_pool_run(pool, regenerate_job_thread, &job);
+
+	PairwiseSum sum = {0};
+	PairwiseSum expected_sum = {0};
+	for (U64 block=0; block < job.block_count; ++block) {
+		pairwise_add(&sum, job.block_sums[block]);
+		pairwise_add(&expected_sum, job.expected_sums[block]);
+	}
+
+	ErrorStats total = {0};
+	U64 mismatched = 0;
+	for (U32 t=0; t < pool->thread_count; ++t) {
+		error_stats_merge(&total, &job.stats[t]);
+		mismatched += job.mismatched_pairs[t];
+	}
+
+	F64 average = input.num_pairs > 0 ? pairwise_total(&sum) / input.num_pairs : 0;
+	F64 generated_average = input.num_pairs > 0 ? pairwise_total(&expected_sum) / input.num_pairs : 0;
+	print_validation(input.num_pairs, average, generated_average);
+	print_mismatched_pairs(input, mismatched, input.num_pairs);
+
+	F64 worst_expected = 0;
+	if (input.num_pairs) {
+		regenerate_answers(generator, input, 0, 1, &total.max_abs_error_index, &worst_expected);
+	}
+	print_error_stats(&total, input.num_pairs, worst_expected);
+
+	free(job.mismatched_pairs);
+	free(job.stats);
+	free(job.expected_sums);
+	free(job.block_sums);
+	PROFILE_BLOCK_END_THROUGHPUT(input.num_pairs * input_bytes_per_pair(input));
+}
+
+// the whole compute plus sample_count pairs, drawn with replacement from their
+// own stream of the seed, checked against regenerated answers
+void spot_check(ThreadPool *pool, HaversineKernel *kernel, HaversineInput input, PairGenerator *generator, U64 sample_count) {
+	PROFILE_FUNCTION_BEGIN;
+	F64 sum = sum_haversine(pool, kernel, input, NULL);
+	F64 average = input.num_pairs > 0 ? sum / input.num_pairs : 0;
+	printf("Number of pairs: %zu\n", input.num_pairs);
+	printf("Average haversine distance: %.16f\n", average);
+
+	if (!input.num_pairs) sample_count = 0;
+	printf("\nSpot check of %llu pairs:\n", sample_count);
+
+	// the sampled pairs are gathered into columns of their own so the kernel
+	// runs over them like any other block
+	DistanceErrorsFunc *distance_errors = find_distance_errors();
+	F64 sample_x0[KERNEL_BLOCK_COUNT], sample_y0[KERNEL_BLOCK_COUNT], sample_x1[KERNEL_BLOCK_COUNT], sample_y1[KERNEL_BLOCK_COUNT];
+	S32 sample_qx0[KERNEL_BLOCK_COUNT], sample_qy0[KERNEL_BLOCK_COUNT], sample_qx1[KERNEL_BLOCK_COUNT], sample_qy1[KERNEL_BLOCK_COUNT];
+	HaversineInput samples = {0};
+	if (input.qx0) {
+		samples.qx0 = sample_qx0; samples.qy0 = sample_qy0; samples.qx1 = sample_qx1; samples.qy1 = sample_qy1;
+	} else {
+		samples.x0 = sample_x0; samples.y0 = sample_y0; samples.x1 = sample_x1; samples.y1 = sample_y1;
+	}
+
+	U64 indices[KERNEL_BLOCK_COUNT];
+	F64 computed[KERNEL_BLOCK_COUNT];
+	F64 expected[KERNEL_BLOCK_COUNT];
+	F64 abs_errors[KERNEL_BLOCK_COUNT];
+	F64 ulp_errors[KERNEL_BLOCK_COUNT];
+	ErrorStats stats = {0};
+	U64 mismatched = 0;
+	for (U64 done=0; done < sample_count; done += KERNEL_BLOCK_COUNT) {
+		U64 count = MIN(KERNEL_BLOCK_COUNT, sample_count - done);
+		for (U64 i=0; i < count; ++i) {
+			Philox4x32 r = philox4x32(generator->seed, done + i, 0, RANDOM_STREAM_SAMPLES);
+			U64 index = ((((U64)r.v[0] << 32) | r.v[1]) % input.num_pairs);
+			indices[i] = index;
+			if (input.qx0) {
+				sample_qx0[i] = input.qx0[index]; sample_qy0[i] = input.qy0[index];
+				sample_qx1[i] = input.qx1[index]; sample_qy1[i] = input.qy1[index];
+			} else {
+				sample_x0[i] = input.x0[index]; sample_y0[i] = input.y0[index];
+				sample_x1[i] = input.x1[index]; sample_y1[i] = input.y1[index];
+			}
+		}
+		run_kernel(kernel, samples, 0, count, computed);
+		mismatched += regenerate_answers(generator, input, 0, count, indices, expected);
+		distance_errors(computed, expected, count, abs_errors, ulp_errors);
+		error_stats_add(&stats, abs_errors, ulp_errors, count, 0, indices);
+	}
+
+	print_mismatched_pairs(input, mismatched, sample_count);
+	F64 worst_expected = 0;
+	if (sample_count) {
+		regenerate_answers(generator, input, 0, 1, &stats.max_abs_error_index, &worst_expected);
+	}
+	print_error_stats(&stats, sample_count, worst_expected);
+	PROFILE_BLOCK_END_THROUGHPUT(input.num_pairs * input_bytes_per_pair(input));
+}
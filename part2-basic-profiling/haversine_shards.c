@@ -0,0 +1,207 @@
+//------------------------------------------------------------------------------
+// Sharded input
+//
+// A manifest from generate_points (format in haversine_pairs.h) lists shards
+// holding consecutive runs of the pairs. The threads of the pool take a shard
+// each, map or read it and parse it, and drop its pairs straight into their
+// place in the full columns, so after loading it is the same HaversineInput a
+// single file would have given and everything downstream works unchanged.
+//
+// NOTE(shaw): the tree parser keeps its state in globals, so JSON shards go
+// through the streaming pair parser instead, which keeps all of it in the
+// PairStream it is handed.
+//------------------------------------------------------------------------------
+typedef struct {
+	U64 first;
+	U64 count;
+	char *filepath;
+} Shard;
+
+typedef struct {
+	bool binary;
+	U64 num_pairs;
+	Shard *shards; // BUF
+} ShardManifest;
+
+bool is_shard_manifest(char *filepath) {
+	char magic[sizeof(SHARD_MANIFEST_MAGIC)] = {0};
+	FILE *f = fopen(filepath, "rb");
+	if (f) {
+		fread(magic, 1, sizeof(magic) - 1, f);
+		fclose(f);
+	}
+	return 0 == strcmp(magic, SHARD_MANIFEST_MAGIC);
+}
+
+ShardManifest read_shard_manifest(char *filepath) {
+	ShardManifest manifest = {0};
+	FILE *f = fopen(filepath, "r");
+	if (!f) {
+		fatal("failed to open %s", filepath);
+	}
+
+	int version = 0;
+	char format[16] = {0};
+	U64 shard_count = 0;
+	if (fscanf(f, SHARD_MANIFEST_MAGIC " %d format %15s pairs %llu shards %llu",
+		&version, format, &manifest.num_pairs, &shard_count) != 4)
+	{
+		fatal("%s: malformed shard manifest header", filepath);
+	}
+	if (version != SHARD_MANIFEST_VERSION) {
+		fatal("%s: unsupported shard manifest version %d", filepath, version);
+	}
+	if (0 == strcmp(format, "bin")) {
+		manifest.binary = true;
+	} else if (0 != strcmp(format, "json")) {
+		fatal("%s: unknown shard format '%s'", filepath, format);
+	}
+
+	// shard file names are relative to the manifest
+	int directory_length = 0;
+	for (int i=0; filepath[i]; ++i) {
+		if (filepath[i] == '/' || filepath[i] == '\\') directory_length = i + 1;
+	}
+
+	U64 next_first = 0;
+	for (U64 i=0; i < shard_count; ++i) {
+		Shard shard = {0};
+		char name[1024];
+		if (fscanf(f, "%llu %llu %1023s", &shard.first, &shard.count, name) != 3) {
+			fatal("%s: expected %llu shards, found %llu", filepath, shard_count, i);
+		}
+		if (shard.first != next_first) {
+			fatal("%s: shard %llu starts at pair %llu, expected %llu", filepath, i, shard.first, next_first);
+		}
+		next_first += shard.count;
+		shard.filepath = buf__printf(NULL, "%.*s%s", directory_length, filepath, name);
+		buf_push(manifest.shards, shard);
+	}
+	if (next_first != manifest.num_pairs) {
+		fatal("%s: shards hold %llu pairs, the header says %llu", filepath, next_first, manifest.num_pairs);
+	}
+
+	fclose(f);
+	return manifest;
+}
+
+typedef struct {
+	ShardManifest *manifest;
+	HaversineInput input;
+	volatile U64 next_shard;
+	volatile U64 bytes_loaded;
+} ShardLoadJob;
+
+typedef struct {
+	HaversineInput *input;
+	Shard *shard;
+	U64 next;
+} ShardPairSink;
+
+static void store_shard_pair(void *user, F64 x0, F64 y0, F64 x1, F64 y1) {
+	ShardPairSink *sink = user;
+	if (sink->next == sink->shard->first + sink->shard->count) {
+		fatal("%s: more pairs than its manifest entry says", sink->shard->filepath);
+	}
+	U64 i = sink->next++;
+	sink->input->x0[i] = x0;
+	sink->input->y0[i] = y0;
+	sink->input->x1[i] = x1;
+	sink->input->y1[i] = y1;
+}
+
+static void load_binary_shard(HaversineInput *input, Shard *shard, U64 *bytes_loaded) {
+	void *data;
+	U64 size;
+	if (!os_map_file(shard->filepath, &data, &size)) {
+		fatal("failed to map file %s", shard->filepath);
+	}
+	HaversineInput shard_input;
+	char *error = pairs_input_from_memory(data, size, &shard_input);
+	if (error) {
+		fatal("%s: %s", shard->filepath, error);
+	}
+	if (!shard_input.x0) {
+		fatal("%s: sharded input needs f64 columns", shard->filepath);
+	}
+	if (shard_input.num_pairs != shard->count) {
+		fatal("%s: holds %zu pairs, its manifest entry says %llu", shard->filepath, shard_input.num_pairs, shard->count);
+	}
+	U64 column_size = shard->count * sizeof(F64);
+	memcpy(input->x0 + shard->first, shard_input.x0, column_size);
+	memcpy(input->y0 + shard->first, shard_input.y0, column_size);
+	memcpy(input->x1 + shard->first, shard_input.x1, column_size);
+	memcpy(input->y1 + shard->first, shard_input.y1, column_size);
+	os_unmap_file(data, size);
+	*bytes_loaded = size;
+}
+
+static void load_json_shard(HaversineInput *input, Shard *shard, PairStream *stream, U64 *bytes_loaded) {
+	char *data;
+	size_t size;
+	if (!read_entire_file(shard->filepath, &data, &size)) {
+		fatal("failed to read file %s", shard->filepath);
+	}
+	ShardPairSink sink = { input, shard, shard->first };
+	memset(stream, 0, sizeof(PairStream));
+	pair_stream_parse(stream, data, size - 1, store_shard_pair, &sink); // not the null terminator
+	pair_stream_parse(stream, NULL, 0, store_shard_pair, &sink);
+	if (sink.next != shard->first + shard->count) {
+		fatal("%s: holds %llu pairs, its manifest entry says %llu", shard->filepath, sink.next - shard->first, shard->count);
+	}
+	free(data);
+	*bytes_loaded = size - 1;
+}
+
+static void shard_load_thread(void *params, U32 thread_index, U32 thread_count) {
+	PROFILE_FUNCTION_BEGIN;
+	ShardLoadJob *job = params;
+	U64 thread_bytes_loaded = 0;
+	PairStream *stream = job->manifest->binary ? NULL : xmalloc(sizeof(PairStream));
+	for (;;) {
+		U64 i = os_atomic_add_u64(&job->next_shard, 1);
+		if (i >= buf_lenu(job->manifest->shards)) break;
+		Shard *shard = &job->manifest->shards[i];
+		U64 bytes_loaded = 0;
+		if (job->manifest->binary) {
+			load_binary_shard(&job->input, shard, &bytes_loaded);
+		} else {
+			load_json_shard(&job->input, shard, stream, &bytes_loaded);
+		}
+		os_atomic_add_u64(&job->bytes_loaded, bytes_loaded);
+		thread_bytes_loaded += bytes_loaded;
+	}
+	free(stream);
+	PROFILE_BLOCK_END_THROUGHPUT(thread_bytes_loaded);
+}
+
+HaversineInput load_sharded_input(ThreadPool *pool, char *manifest_filepath) {
+	PROFILE_FUNCTION_BEGIN;
+	ShardManifest manifest = read_shard_manifest(manifest_filepath);
+
+	ShardLoadJob job = {0};
+	job.manifest = &manifest;
+	job.input.num_pairs = manifest.num_pairs;
+	job.input.x0 = xmalloc(4*MAX(manifest.num_pairs, 1) * sizeof(F64));
+	job.input.y0 = job.input.x0 + manifest.num_pairs;
+	job.input.x1 = job.input.y0 + manifest.num_pairs;
+	job.input.y1 = job.input.x1 + manifest.num_pairs;
+
+	U64 start = os_read_timer();
+	thread_pool_run(pool, shard_load_thread, &job);
+	F64 seconds = (os_read_timer() - start) / (F64)os_timer_freq();
+
+	printf("Loaded %u %s shards, %llu pairs, on %u threads", buf_len(manifest.shards),
+		manifest.binary ? "binary" : "json", manifest.num_pairs, pool->thread_count);
+	if (seconds > 0) {
+		printf(" in %.3f ms, %.2f gb/s", seconds * 1000, job.bytes_loaded / seconds / (1024.0 * 1024.0 * 1024.0));
+	}
+	printf("\n");
+
+	for (int i=0; i < buf_len(manifest.shards); ++i) {
+		buf_free(manifest.shards[i].filepath);
+	}
+	buf_free(manifest.shards);
+	PROFILE_BLOCK_END_THROUGHPUT(job.bytes_loaded);
+	return job.input;
+}
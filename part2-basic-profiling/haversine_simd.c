@@ -0,0 +1,217 @@
+//------------------------------------------------------------------------------
+// Haversine kernel template
+//
+// This file is included once per instruction set by haversine_kernel.c, which
+// defines the vector type and operations below before each include, after
+// haversine_math.c. Everything is written in terms of lanes so the scalar, AVX2
+// and AVX-512 kernels run the exact same math.
+//
+//   Vec, VMask            vector of F64 and the result of a comparison
+//   LANES                 number of F64 in a Vec
+//   TARGET                function attribute enabling the instruction set
+//   V(name)               suffixes name with the instruction set
+//   v_set1(a)             broadcast a constant
+//   v_load(p) v_store(p)  unaligned loads and stores
+//   v_load_s32(p)         load LANES S32 and convert them to F64
+//   v_add v_sub v_mul v_div v_sqrt
+//   v_fma(a, b, c)        a*b + c
+//   v_round(a)            round to nearest integer
+//   v_trunc32(a)          clear the low 32 bits of the mantissa
+//   v_abs(a)              clear the sign bit
+//   v_exponent(a)         clear the sign and mantissa bits
+//   v_lt(a, b)            a < b
+//   v_select(m, a, b)     m ? a : b
+//------------------------------------------------------------------------------
+
+static FORCE_INLINE TARGET Vec V(haversine)(Vec x0, Vec y0, Vec x1, Vec y1, Vec earth_radius, MathTier tier) {
+	Vec radians_per_degree = v_set1(0.01745329251994329577f); // matches reference_haversine
+	Vec half = v_set1(0.5);
+
+	Vec dlat = v_mul(radians_per_degree, v_sub(y1, y0));
+	Vec dlon = v_mul(radians_per_degree, v_sub(x1, x0));
+	Vec lat1 = v_mul(radians_per_degree, y0);
+	Vec lat2 = v_mul(radians_per_degree, y1);
+
+	Vec sin_dlat = V(sin)(v_mul(dlat, half), tier);
+	Vec sin_dlon = V(sin)(v_mul(dlon, half), tier);
+	Vec cos_lat = v_mul(V(cos)(lat1, tier), V(cos)(lat2, tier));
+	Vec a = v_add(v_mul(sin_dlat, sin_dlat), v_mul(cos_lat, v_mul(sin_dlon, sin_dlon)));
+	Vec c = v_mul(v_set1(2.0), V(asin)(V(sqrt)(a, tier), tier));
+	Vec result = v_mul(earth_radius, c);
+
+	// NOTE(shaw): the answers come from reference_haversine through libm, and
+	// asin(sqrt(a)) magnifies the ulp or so by which any other sin or cos
+	// differs from libm's, even a correctly rounded one, by sqrt(a/(1 - a)).
+	// Past these limits on a, nearly antipodal pairs, a distance can't be
+	// trusted to within EPSILON of libm's and the lane takes reference_haversine
+	// instead. Over 16M pairs the first over EPSILON was at a = 0.82 for
+	// standard and 0.90 for precise. Fast is off by far more everywhere and
+	// never falls back.
+	F64 libm_limit = tier == MATH_TIER_PRECISE ? 0.8 : tier == MATH_TIER_STANDARD ? 0.7 : 2.0;
+	if (v_any(v_lt(v_set1(libm_limit), a))) {
+		F64 as[LANES], xs0[LANES], ys0[LANES], xs1[LANES], ys1[LANES], radii[LANES], results[LANES];
+		v_store(as, a);
+		v_store(xs0, x0);
+		v_store(ys0, y0);
+		v_store(xs1, x1);
+		v_store(ys1, y1);
+		v_store(radii, earth_radius);
+		v_store(results, result);
+		for (int i=0; i < LANES; ++i) {
+			if (libm_limit < as[i]) {
+				results[i] = reference_haversine(xs0[i], ys0[i], xs1[i], ys1[i], radii[i]);
+			}
+		}
+		result = v_load(results);
+	}
+	return result;
+}
+
+// tier is always a constant, so once this is inlined into the wrappers below
+// the compiler drops the branches on it
+static FORCE_INLINE TARGET void V(haversine_kernel)(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances, MathTier tier) {
+	Vec earth_radius = v_set1(EARTH_RADIUS_KM);
+
+	U64 i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		Vec d = V(haversine)(v_load(x0 + i), v_load(y0 + i), v_load(x1 + i), v_load(y1 + i), earth_radius, tier);
+		v_store(distances + i, d);
+	}
+
+	// run the leftover pairs through one padded iteration so they get the
+	// same math as the rest
+	if (i < count) {
+		F64 tail[5][LANES] = {0};
+		U64 tail_count = count - i;
+		for (U64 j=0; j < tail_count; ++j) {
+			tail[0][j] = x0[i + j];
+			tail[1][j] = y0[i + j];
+			tail[2][j] = x1[i + j];
+			tail[3][j] = y1[i + j];
+		}
+		Vec d = V(haversine)(v_load(tail[0]), v_load(tail[1]), v_load(tail[2]), v_load(tail[3]), earth_radius, tier);
+		v_store(tail[4], d);
+		for (U64 j=0; j < tail_count; ++j) {
+			distances[i + j] = tail[4][j];
+		}
+	}
+}
+
+// NOTE(shaw): the quantized coordinates are converted and scaled on load, so
+// they cost nothing over the F64 kernel but half the memory traffic
+static FORCE_INLINE TARGET void V(haversine_kernel_q32)(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances, MathTier tier) {
+	Vec earth_radius = v_set1(EARTH_RADIUS_KM);
+	Vec scale = v_set1(PAIRS_S32_DEGREES_PER_UNIT);
+
+	U64 i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		Vec d = V(haversine)(
+			v_mul(v_load_s32(x0 + i), scale), v_mul(v_load_s32(y0 + i), scale),
+			v_mul(v_load_s32(x1 + i), scale), v_mul(v_load_s32(y1 + i), scale),
+			earth_radius, tier);
+		v_store(distances + i, d);
+	}
+
+	if (i < count) {
+		S32 tail[4][LANES] = {0};
+		F64 tail_distances[LANES];
+		U64 tail_count = count - i;
+		for (U64 j=0; j < tail_count; ++j) {
+			tail[0][j] = x0[i + j];
+			tail[1][j] = y0[i + j];
+			tail[2][j] = x1[i + j];
+			tail[3][j] = y1[i + j];
+		}
+		Vec d = V(haversine)(
+			v_mul(v_load_s32(tail[0]), scale), v_mul(v_load_s32(tail[1]), scale),
+			v_mul(v_load_s32(tail[2]), scale), v_mul(v_load_s32(tail[3]), scale),
+			earth_radius, tier);
+		v_store(tail_distances, d);
+		for (U64 j=0; j < tail_count; ++j) {
+			distances[i + j] = tail_distances[j];
+		}
+	}
+}
+
+static TARGET void V(haversine_kernel_precise)(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel)(x0, y0, x1, y1, count, distances, MATH_TIER_PRECISE);
+}
+
+static TARGET void V(haversine_kernel_standard)(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel)(x0, y0, x1, y1, count, distances, MATH_TIER_STANDARD);
+}
+
+static TARGET void V(haversine_kernel_fast)(F64 *x0, F64 *y0, F64 *x1, F64 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel)(x0, y0, x1, y1, count, distances, MATH_TIER_FAST);
+}
+
+static TARGET void V(haversine_kernel_precise_q32)(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel_q32)(x0, y0, x1, y1, count, distances, MATH_TIER_PRECISE);
+}
+
+static TARGET void V(haversine_kernel_standard_q32)(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel_q32)(x0, y0, x1, y1, count, distances, MATH_TIER_STANDARD);
+}
+
+static TARGET void V(haversine_kernel_fast_q32)(S32 *x0, S32 *y0, S32 *x1, S32 *y1, U64 count, F64 *distances) {
+	V(haversine_kernel_q32)(x0, y0, x1, y1, count, distances, MATH_TIER_FAST);
+}
+
+// absolute error of each computed distance, and the same error in units in
+// the last place of the expected distance
+static TARGET void V(distance_errors)(F64 *computed, F64 *expected, U64 count, F64 *abs_errors, F64 *ulp_errors) {
+	Vec ulp_scale = v_set1(2.220446049250313080847e-16); // 2^-52
+	Vec min_ulp = v_set1(4.940656458412465441766e-324); // 2^-1074, so an expected distance of 0 still gets a finite ulp
+
+	U64 i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		Vec expect = v_load(expected + i);
+		Vec error = v_abs(v_sub(v_load(computed + i), expect));
+		Vec ulp = v_mul(v_exponent(expect), ulp_scale);
+		ulp = v_select(v_lt(ulp, min_ulp), min_ulp, ulp);
+		v_store(abs_errors + i, error);
+		v_store(ulp_errors + i, v_div(error, ulp));
+	}
+	if (i < count) {
+		distance_errors_scalar(computed + i, expected + i, count - i, abs_errors + i, ulp_errors + i);
+	}
+}
+
+// NOTE(shaw): with the half angles precomputed per point, the sines of the
+// half differences come from sin((b - a)/2) = sin(b/2)cos(a/2) - cos(b/2)sin(a/2)
+// and the only transcendentals left per distance are the sqrt and asin.
+static FORCE_INLINE TARGET void V(haversine_matrix_tile)(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out, MathTier tier) {
+	Vec diameter = v_set1(2.0*EARTH_RADIUS_KM);
+	Vec one = v_set1(1.0);
+	for (U64 r=0; r < row_count; ++r) {
+		U64 row = row_begin + r;
+		Vec row_sin_lat = v_set1(rows->sin_half_lat[row]);
+		Vec row_cos_lat = v_set1(rows->cos_half_lat[row]);
+		Vec row_sin_lon = v_set1(rows->sin_half_lon[row]);
+		Vec row_cos_lon = v_set1(rows->cos_half_lon[row]);
+		Vec row_cos = v_set1(rows->cos_lat[row]);
+		F64 *out_row = out + r*MATRIX_TILE_COLS;
+
+		for (U64 c=0; c < MATRIX_TILE_COLS; c += LANES) {
+			U64 col = col_begin + c;
+			Vec sin_dlat = v_sub(v_mul(v_load(cols->sin_half_lat + col), row_cos_lat), v_mul(v_load(cols->cos_half_lat + col), row_sin_lat));
+			Vec sin_dlon = v_sub(v_mul(v_load(cols->sin_half_lon + col), row_cos_lon), v_mul(v_load(cols->cos_half_lon + col), row_sin_lon));
+			Vec cos_lat = v_mul(row_cos, v_load(cols->cos_lat + col));
+			Vec a = v_add(v_mul(sin_dlat, sin_dlat), v_mul(cos_lat, v_mul(sin_dlon, sin_dlon)));
+			a = v_select(v_lt(one, a), one, a); // rounding can push antipodal points just over
+			v_store(out_row + c, v_mul(diameter, V(asin)(V(sqrt)(a, tier), tier)));
+		}
+	}
+}
+
+static TARGET void V(haversine_matrix_tile_precise)(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out) {
+	V(haversine_matrix_tile)(rows, row_begin, row_count, cols, col_begin, out, MATH_TIER_PRECISE);
+}
+
+static TARGET void V(haversine_matrix_tile_standard)(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out) {
+	V(haversine_matrix_tile)(rows, row_begin, row_count, cols, col_begin, out, MATH_TIER_STANDARD);
+}
+
+static TARGET void V(haversine_matrix_tile_fast)(MatrixPoints *rows, U64 row_begin, U64 row_count, MatrixPoints *cols, U64 col_begin, F64 *out) {
+	V(haversine_matrix_tile)(rows, row_begin, row_count, cols, col_begin, out, MATH_TIER_FAST);
+}